@@ -0,0 +1,107 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "EventRing.h"
+
+// Every slot has a sequence number, which tells whose turn it is:
+// - equal to a push position p (mod the slot's index): free, the producer that claimed position p may fill it,
+// - equal to p + 1: holds the item pushed at p, the consumer that claimed position p may take it.
+// After taking it, the consumer sets it to p + n_slots, the next push position of that slot.
+typedef struct Slot Slot;
+
+struct Slot {
+    atomic_size_t sequence;
+    void* item;
+};
+
+struct EventRing {
+    size_t mask; // Number of slots - 1.
+    atomic_size_t push_position;
+    char padding[64]; // Producers and consumers do not share a cache line.
+    atomic_size_t pop_position;
+    atomic_bool overflowed;
+    Slot slots[];
+};
+
+EventRing* ering_new(size_t capacity)
+{
+    size_t n_slots = 2;
+    while (n_slots < capacity)
+        n_slots *= 2;
+    EventRing* ring = malloc(sizeof(EventRing) + n_slots * sizeof(Slot));
+    if (!ring)
+        return NULL;
+    ring->mask = n_slots - 1;
+    atomic_init(&ring->push_position, 0);
+    atomic_init(&ring->pop_position, 0);
+    atomic_init(&ring->overflowed, false);
+    for (size_t s = 0; s < n_slots; ++s) {
+        atomic_init(&ring->slots[s].sequence, s);
+        ring->slots[s].item = NULL;
+    }
+    return ring;
+}
+
+void ering_free(EventRing* ring)
+{
+    free(ring);
+}
+
+bool ering_push(EventRing* ring, void* item)
+{
+    size_t position = atomic_load_explicit(&ring->push_position, memory_order_relaxed);
+    for (;;) {
+        Slot* slot = &ring->slots[position & ring->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->push_position, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                slot->item = item;
+                atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) { // The slot still holds an item from the previous lap.
+            atomic_store_explicit(&ring->overflowed, true, memory_order_relaxed);
+            return false;
+        } else { // Another producer took this position.
+            position = atomic_load_explicit(&ring->push_position, memory_order_relaxed);
+        }
+    }
+}
+
+static bool pop(EventRing* ring, void** item)
+{
+    size_t position = atomic_load_explicit(&ring->pop_position, memory_order_relaxed);
+    for (;;) {
+        Slot* slot = &ring->slots[position & ring->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->pop_position, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                *item = slot->item;
+                atomic_store_explicit(&slot->sequence, position + ring->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) { // Empty (or the item is still being written).
+            return false;
+        } else {
+            position = atomic_load_explicit(&ring->pop_position, memory_order_relaxed);
+        }
+    }
+}
+
+size_t ering_drain(EventRing* ring, void* items[], size_t max)
+{
+    size_t count = 0;
+    while (count < max && pop(ring, &items[count]))
+        count++;
+    return count;
+}
+
+bool ering_overflowed(EventRing* ring)
+{
+    return atomic_exchange(&ring->overflowed, false);
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+// A bounded, lock-free queue of pointers (multi-producer, multi-consumer).
+// Pushing or popping an item costs a few atomic operations and never blocks. When the ring is full,
+// new items are rejected and the ring remembers that it overflowed, until the consumer asks about it.
+typedef struct EventRing EventRing;
+
+// Create a new, empty ring with room for at least `capacity` items (rounded up to a power of two).
+EventRing* ering_new(size_t capacity);
+
+// Free the ring. Items still in it are not freed - drain them first if they own anything.
+void ering_free(EventRing* ring);
+
+// Append `item`. Return false (and mark the ring as overflowed) if it is full.
+bool ering_push(EventRing* ring, void* item);
+
+// Move up to `max` of the oldest items into `items`, in order. Return how many were moved.
+size_t ering_drain(EventRing* ring, void* items[], size_t max);
+
+// Return whether any push was rejected since the last call, and clear that mark.
+bool ering_overflowed(EventRing* ring);
@@ -72,7 +72,13 @@ bool hmap_insert(HashMap* map, const char* key, void* value)
     if (p)
         return false; // Already exists.
     Pair* new_p = malloc(sizeof(Pair));
+    if (!new_p)
+        return false;
     new_p->key = strdup(key);
+    if (!new_p->key) {
+        free(new_p);
+        return false;
+    }
     new_p->value = value;
     new_p->next = map->buckets[h];
     map->buckets[h] = new_p;
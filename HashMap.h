@@ -18,7 +18,7 @@ void hmap_free(HashMap* map);
 void* hmap_get(HashMap* map, const char* key);
 
 // Insert a `value` under `key` and return true,
-// or do nothing and return false if `key` already exists in the map.
+// or do nothing and return false if `key` already exists in the map (or out of memory).
 // `value` must not be NULL.
 // (The caller can free `key` at any time - the map internally uses a copy of it).
 bool hmap_insert(HashMap* map, const char* key, void* value);
@@ -0,0 +1,460 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Journal.h"
+
+// The header of every record: its length and the CRC32 of its bytes.
+#define HEADER_SIZE (2 * sizeof(uint32_t))
+
+// Records appended but not written yet.
+typedef struct Buffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+// Positions count the bytes appended since the journal was opened (in all segments).
+struct Journal {
+    char* prefix;
+    unsigned long segment; // Being written.
+    int fd; // Of the segment, used only by the thread.
+    int directory;
+    pthread_mutex_t mutex;
+    pthread_cond_t work; // For the thread.
+    pthread_cond_t done; // For whoever waits for the thread.
+    pthread_t thread;
+    Buffer buffer;
+    Buffer spare; // The other buffer, written by the thread meanwhile.
+    uint64_t appended;
+    uint64_t written;
+    uint64_t synced;
+    uint64_t sync_wanted; // Someone waits for the records up to there to be synced.
+    bool rotating; // The records up to `rotate_at` go to the current segment, the following ones to the next one.
+    uint64_t rotate_at;
+    bool stopping;
+    int error; // Nothing is written anymore once it is set.
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void make_crc_table()
+{
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; ++k)
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crc_table[n] = c;
+    }
+}
+
+static uint32_t crc32(const unsigned char* data, size_t length)
+{
+    pthread_once(&crc_table_once, make_crc_table);
+    uint32_t c = 0xffffffffu;
+    for (size_t i = 0; i < length; ++i)
+        c = crc_table[(c ^ data[i]) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffffu;
+}
+
+// The file name of the segment, freed by the caller. NULL if out of memory.
+static char* segment_name(const char* prefix, unsigned long segment)
+{
+    size_t size = strlen(prefix) + 2 + 3 * sizeof(unsigned long);
+    char* name = malloc(size);
+    if (name)
+        snprintf(name, size, "%s.%lu", prefix, segment);
+    return name;
+}
+
+// Open the segment for appending, return the descriptor or -1 (with errno set).
+static int open_segment(const char* prefix, unsigned long segment)
+{
+    char* name = segment_name(prefix, segment);
+    if (!name) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    int err = errno;
+    free(name);
+    errno = err;
+    return fd;
+}
+
+// Open the directory that contains `prefix`, return the descriptor or -1 (with errno set).
+static int open_directory(const char* prefix)
+{
+    const char* slash = strrchr(prefix, '/');
+    if (!slash)
+        return open(".", O_RDONLY | O_DIRECTORY);
+    size_t length = slash == prefix ? 1 : slash - prefix;
+    char* directory = strndup(prefix, length);
+    if (!directory) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    int err = errno;
+    free(directory);
+    errno = err;
+    return fd;
+}
+
+static int write_all(int fd, const char* data, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+static bool has_work(Journal* journal)
+{
+    return journal->error == 0
+        && (journal->buffer.length > 0 || journal->sync_wanted > journal->synced || journal->rotating);
+}
+
+// Write (and sync, or rotate, if asked for) everything appended so far; called and returns with the mutex held,
+// but does not hold it meanwhile - the following records are appended into the other buffer.
+static void commit_batch(Journal* journal)
+{
+    Buffer batch = journal->buffer;
+    journal->buffer = journal->spare;
+    journal->buffer.length = 0;
+    uint64_t start = journal->written;
+    uint64_t end = start + batch.length;
+    bool sync = journal->sync_wanted > journal->synced;
+    bool rotate = journal->rotating;
+    size_t before_rotation = rotate ? journal->rotate_at - start : batch.length;
+    pthread_mutex_unlock(&journal->mutex);
+
+    int fd = journal->fd;
+    int err = write_all(fd, batch.data, before_rotation);
+    if (err == 0 && rotate) {
+        if (fdatasync(fd) != 0) {
+            err = errno;
+        } else {
+            fd = open_segment(journal->prefix, journal->segment + 1);
+            if (fd < 0 || fsync(journal->directory) != 0)
+                err = errno;
+        }
+        if (err == 0)
+            err = write_all(fd, batch.data + before_rotation, batch.length - before_rotation);
+    }
+    if (err == 0 && sync && fdatasync(fd) != 0)
+        err = errno;
+
+    pthread_mutex_lock(&journal->mutex);
+    journal->spare = batch;
+    if (err != 0) {
+        journal->error = err;
+        if (rotate && fd >= 0 && fd != journal->fd)
+            close(fd);
+    } else {
+        journal->written = end;
+        if (rotate) {
+            close(journal->fd);
+            journal->fd = fd;
+            journal->segment++;
+            journal->rotating = false;
+            if (journal->synced < start + before_rotation)
+                journal->synced = start + before_rotation;
+        }
+        if (sync)
+            journal->synced = end;
+    }
+    pthread_cond_broadcast(&journal->done);
+}
+
+static void* run(void* arg)
+{
+    Journal* journal = arg;
+    pthread_mutex_lock(&journal->mutex);
+    for (;;) {
+        while (!has_work(journal) && !journal->stopping)
+            pthread_cond_wait(&journal->work, &journal->mutex);
+        if (!has_work(journal))
+            break; // Stopping, and everything is written.
+        commit_batch(journal);
+    }
+    pthread_mutex_unlock(&journal->mutex);
+    return NULL;
+}
+
+Journal* journal_open(const char* prefix, unsigned long segment)
+{
+    Journal* journal = malloc(sizeof(Journal));
+    char* copy = strdup(prefix);
+    if (!journal || !copy) {
+        free(journal);
+        free(copy);
+        errno = ENOMEM;
+        return NULL;
+    }
+    journal->prefix = copy;
+    journal->segment = segment;
+    journal->directory = open_directory(prefix);
+    journal->fd = journal->directory >= 0 ? open_segment(prefix, segment) : -1;
+    if (journal->fd < 0 || fsync(journal->directory) != 0) { // The segment may be a new file.
+        int err = errno;
+        if (journal->fd >= 0)
+            close(journal->fd);
+        if (journal->directory >= 0)
+            close(journal->directory);
+        free(copy);
+        free(journal);
+        errno = err;
+        return NULL;
+    }
+    memset(&journal->buffer, 0, sizeof(Buffer));
+    memset(&journal->spare, 0, sizeof(Buffer));
+    journal->appended = 0;
+    journal->written = 0;
+    journal->synced = 0;
+    journal->sync_wanted = 0;
+    journal->rotating = false;
+    journal->rotate_at = 0;
+    journal->stopping = false;
+    journal->error = 0;
+    pthread_mutex_init(&journal->mutex, NULL);
+    pthread_cond_init(&journal->work, NULL);
+    pthread_cond_init(&journal->done, NULL);
+    int err = pthread_create(&journal->thread, NULL, run, journal);
+    if (err != 0) {
+        pthread_mutex_destroy(&journal->mutex);
+        pthread_cond_destroy(&journal->work);
+        pthread_cond_destroy(&journal->done);
+        close(journal->fd);
+        close(journal->directory);
+        free(copy);
+        free(journal);
+        errno = err;
+        return NULL;
+    }
+    return journal;
+}
+
+int journal_close(Journal* journal)
+{
+    pthread_mutex_lock(&journal->mutex);
+    journal->stopping = true;
+    journal->sync_wanted = journal->appended;
+    pthread_cond_signal(&journal->work);
+    pthread_mutex_unlock(&journal->mutex);
+    pthread_join(journal->thread, NULL);
+
+    int err = journal->error;
+    close(journal->fd);
+    close(journal->directory);
+    pthread_mutex_destroy(&journal->mutex);
+    pthread_cond_destroy(&journal->work);
+    pthread_cond_destroy(&journal->done);
+    free(journal->buffer.data);
+    free(journal->spare.data);
+    free(journal->prefix);
+    free(journal);
+    return err;
+}
+
+static bool reserve(Buffer* buffer, size_t length)
+{
+    if (buffer->capacity - buffer->length >= length)
+        return true;
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (capacity - buffer->length < length)
+        capacity *= 2;
+    char* data = realloc(buffer->data, capacity);
+    if (!data)
+        return false;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+uint64_t journal_append(Journal* journal, const void* record, size_t length)
+{
+    uint32_t header[2] = { (uint32_t)length, record ? crc32(record, length) : 0 };
+    pthread_mutex_lock(&journal->mutex);
+    if (journal->error == 0 && !record)
+        journal->error = ENOMEM;
+    if (journal->error == 0 && length > UINT32_MAX)
+        journal->error = EFBIG;
+    if (journal->error == 0 && !reserve(&journal->buffer, HEADER_SIZE + length))
+        journal->error = ENOMEM;
+    uint64_t position = UINT64_MAX; // Never reached, waiting for it gives the error.
+    if (journal->error == 0) {
+        memcpy(journal->buffer.data + journal->buffer.length, header, HEADER_SIZE);
+        memcpy(journal->buffer.data + journal->buffer.length + HEADER_SIZE, record, length);
+        if (journal->buffer.length == 0)
+            pthread_cond_signal(&journal->work);
+        journal->buffer.length += HEADER_SIZE + length;
+        journal->appended += HEADER_SIZE + length;
+        position = journal->appended;
+    }
+    pthread_mutex_unlock(&journal->mutex);
+    return position;
+}
+
+uint64_t journal_position(Journal* journal)
+{
+    pthread_mutex_lock(&journal->mutex);
+    uint64_t position = journal->appended;
+    pthread_mutex_unlock(&journal->mutex);
+    return position;
+}
+
+static bool is_reached(Journal* journal, uint64_t position, JournalDurability durability)
+{
+    switch (durability) {
+    case JOURNAL_BUFFERED:
+        return position <= journal->appended;
+    case JOURNAL_WRITTEN:
+        return position <= journal->written;
+    default:
+        return position <= journal->synced;
+    }
+}
+
+int journal_wait(Journal* journal, uint64_t position, JournalDurability durability)
+{
+    pthread_mutex_lock(&journal->mutex);
+    if (durability == JOURNAL_SYNCED && journal->sync_wanted < position && position != UINT64_MAX) {
+        journal->sync_wanted = position;
+        pthread_cond_signal(&journal->work);
+    }
+    while (!is_reached(journal, position, durability) && journal->error == 0)
+        pthread_cond_wait(&journal->done, &journal->mutex);
+    int err = is_reached(journal, position, durability) ? 0 : journal->error;
+    pthread_mutex_unlock(&journal->mutex);
+    return err;
+}
+
+int journal_rotate(Journal* journal, unsigned long* segment)
+{
+    pthread_mutex_lock(&journal->mutex);
+    while (journal->rotating && journal->error == 0) // Somebody else's.
+        pthread_cond_wait(&journal->done, &journal->mutex);
+    if (journal->error == 0) {
+        journal->rotating = true;
+        journal->rotate_at = journal->appended;
+        pthread_cond_signal(&journal->work);
+        while (journal->rotating && journal->error == 0)
+            pthread_cond_wait(&journal->done, &journal->mutex);
+    }
+    *segment = journal->segment;
+    int err = journal->error;
+    pthread_mutex_unlock(&journal->mutex);
+    return err;
+}
+
+int journal_drop(const char* prefix, unsigned long segment)
+{
+    // Segments are never skipped, so the older ones end at the first one that is not there.
+    for (unsigned long s = segment - 1; s > 0; --s) {
+        char* name = segment_name(prefix, s);
+        if (!name)
+            return ENOMEM;
+        int err = unlink(name) == 0 ? 0 : errno;
+        free(name);
+        if (err == ENOENT)
+            return 0;
+        if (err != 0)
+            return err;
+    }
+    return 0;
+}
+
+int journal_sync_directory(Journal* journal)
+{
+    return fsync(journal->directory) == 0 ? 0 : errno;
+}
+
+// Call the callback with every record of the segment in `data`. Set `*valid` to the length of the part that holds
+// whole records (the rest is torn or damaged).
+static int replay_segment(unsigned char* data, size_t size, JournalReplayCallback callback, void* context, size_t* valid)
+{
+    size_t offset = 0;
+    while (size - offset >= HEADER_SIZE) {
+        uint32_t header[2];
+        memcpy(header, data + offset, HEADER_SIZE);
+        if (header[0] == 0 || header[0] > size - offset - HEADER_SIZE)
+            break;
+        unsigned char* record = data + offset + HEADER_SIZE;
+        if (crc32(record, header[0]) != header[1])
+            break;
+        int err = callback(record, header[0], context);
+        if (err != 0)
+            return err;
+        offset += HEADER_SIZE + header[0];
+    }
+    *valid = offset;
+    return 0;
+}
+
+// Replay the segment open at `fd` (the last one, if `last`); cut off its torn end.
+static int replay_file(int fd, bool last, JournalReplayCallback callback, void* context)
+{
+    struct stat status;
+    if (fstat(fd, &status) != 0)
+        return errno;
+    if (status.st_size == 0)
+        return 0;
+    // A private mapping: the callback may modify the records, the file stays as it is.
+    unsigned char* data = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return errno;
+    madvise(data, status.st_size, MADV_SEQUENTIAL);
+    size_t valid;
+    int err = replay_segment(data, status.st_size, callback, context, &valid);
+    munmap(data, status.st_size);
+    if (err != 0 || valid == (size_t)status.st_size)
+        return err;
+    if (!last)
+        return EINVAL; // Only the end of the log can be torn by a crash, older segments were synced.
+    if (ftruncate(fd, valid) != 0 || fsync(fd) != 0)
+        return errno;
+    return 0;
+}
+
+int journal_replay(const char* prefix, unsigned long segment, JournalReplayCallback callback, void* context, unsigned long* last)
+{
+    *last = segment;
+    for (unsigned long s = segment;; ++s) {
+        char* name = segment_name(prefix, s);
+        char* next = segment_name(prefix, s + 1);
+        if (!name || !next) {
+            free(name);
+            free(next);
+            return ENOMEM;
+        }
+        int fd = open(name, O_RDWR);
+        int err = fd < 0 ? errno : 0;
+        bool is_last = access(next, F_OK) != 0;
+        free(name);
+        free(next);
+        if (err == ENOENT)
+            return 0;
+        if (err != 0)
+            return err;
+        err = replay_file(fd, is_last, callback, context);
+        close(fd);
+        if (err != 0)
+            return err;
+        *last = s;
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// An append-only log of records on disk, written by a background thread with group commit: records appended while
+// it writes (or syncs) the previous batch are written together, so concurrent appenders share one fdatasync.
+//
+// The log is split into segments, files named "<prefix>.<n>", so that a prefix of it can be dropped by deleting
+// files: see journal_rotate. A record is its length and a CRC32 of its bytes followed by them, so a record torn
+// by a crash is detected (and cut off) by journal_replay.
+typedef struct Journal Journal;
+
+// How far an appended record has to get before journal_wait returns.
+typedef enum JournalDurability {
+    JOURNAL_BUFFERED, // In memory, it is written right away but nobody waits for it (lost if the process dies).
+    JOURNAL_WRITTEN, // Written to the file (lost only if the system goes down).
+    JOURNAL_SYNCED, // Written and synced to the disk.
+} JournalDurability;
+
+// Called by journal_replay with every record of the log, in order. The record may be modified in place.
+// Returning anything else than 0 stops the replay, which returns it.
+typedef int (*JournalReplayCallback)(unsigned char* record, size_t length, void* context);
+
+// Call `callback` with every record of the segments of the log at `prefix`, from `segment` on (up to the first one
+// that does not exist). A torn record at the end of the last segment is cut off the file, together with everything
+// after it. Set `*last` to the last segment (`segment` if there are none).
+// Return 0, EINVAL if a segment other than the last one is damaged, or the errno of the file operation that failed.
+int journal_replay(const char* prefix, unsigned long segment, JournalReplayCallback callback, void* context, unsigned long* last);
+
+// Start appending to the segment `segment` of the log at `prefix` (creating it if needed).
+// Return NULL (with errno set) on failure.
+Journal* journal_open(const char* prefix, unsigned long segment);
+
+// Write and sync everything appended so far, stop the thread and free the journal.
+// Return 0, or the error that made the journal fail (see journal_wait).
+int journal_close(Journal* journal);
+
+// Append a record (of at most UINT32_MAX bytes) and return its position, for journal_wait. Never waits for the disk.
+// If `record` is NULL (it could not be made), the journal fails with ENOMEM.
+uint64_t journal_append(Journal* journal, const void* record, size_t length);
+
+// Return the position after the last record appended so far.
+uint64_t journal_position(Journal* journal);
+
+// Wait until the records up to `position` are as durable as `durability` asks for.
+// Return 0, or the errno of the write or sync that failed (or ENOMEM if a record could not be buffered) - after a
+// failure nothing is written anymore, so every later call fails too.
+int journal_wait(Journal* journal, uint64_t position, JournalDurability durability);
+
+// Move on to the next segment: the records appended so far stay in the older segments (written and synced),
+// the following ones go to the new one. Set `*segment` to the new one. Return 0, or the error as in journal_wait.
+int journal_rotate(Journal* journal, unsigned long* segment);
+
+// Delete the segments of the log at `prefix` older than `segment`. Return 0 or errno.
+int journal_drop(const char* prefix, unsigned long segment);
+
+// Sync the directory of the log, so that files created or renamed in it (next to the segments) are not lost.
+// Return 0 or errno.
+int journal_sync_directory(Journal* journal);
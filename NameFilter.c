@@ -0,0 +1,104 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "NameFilter.h"
+
+// Counters per name the filter is sized for (each counter is one byte).
+#define COUNTERS_PER_NAME 8
+
+// A counter with this value is saturated and never changes again.
+#define SATURATED UINT8_MAX
+
+struct NameFilter {
+    size_t capacity;
+    size_t mask; // Number of counters minus one, the number of counters is a power of 2.
+    NameFilter* previous;
+    atomic_uchar counters[];
+};
+
+static uint64_t get_hash(const char* name);
+
+NameFilter* nfilter_new(size_t capacity, NameFilter* previous)
+{
+    size_t n_counters = 1;
+    while (n_counters < capacity * COUNTERS_PER_NAME)
+        n_counters <<= 1;
+    NameFilter* filter = malloc(sizeof(NameFilter) + n_counters * sizeof(atomic_uchar));
+    if (!filter)
+        return NULL;
+    filter->capacity = capacity;
+    filter->mask = n_counters - 1;
+    filter->previous = previous;
+    for (size_t c = 0; c < n_counters; ++c)
+        atomic_init(&filter->counters[c], 0);
+    return filter;
+}
+
+void nfilter_free(NameFilter* filter)
+{
+    while (filter) {
+        NameFilter* previous = filter->previous;
+        free(filter);
+        filter = previous;
+    }
+}
+
+size_t nfilter_capacity(const NameFilter* filter)
+{
+    return filter ? filter->capacity : 0;
+}
+
+// The two counters of a name, from the two halves of its hash.
+static void get_counters(const NameFilter* filter, const char* name, size_t* first, size_t* second)
+{
+    uint64_t hash = get_hash(name);
+    *first = hash & filter->mask;
+    *second = (hash >> 32) & filter->mask;
+}
+
+// Writers are serialized, so a plain load and store is enough; the store is what readers synchronize with.
+static void add_to_counter(atomic_uchar* counter, int delta)
+{
+    unsigned char value = atomic_load_explicit(counter, memory_order_relaxed);
+    if (value == SATURATED)
+        return;
+    atomic_store(counter, value + delta);
+}
+
+void nfilter_add(NameFilter* filter, const char* name)
+{
+    size_t first, second;
+    get_counters(filter, name, &first, &second);
+    add_to_counter(&filter->counters[first], 1);
+    add_to_counter(&filter->counters[second], 1);
+}
+
+void nfilter_remove(NameFilter* filter, const char* name)
+{
+    size_t first, second;
+    get_counters(filter, name, &first, &second);
+    add_to_counter(&filter->counters[first], -1);
+    add_to_counter(&filter->counters[second], -1);
+}
+
+bool nfilter_may_contain(const NameFilter* filter, const char* name)
+{
+    if (!filter)
+        return false;
+    size_t first, second;
+    get_counters(filter, name, &first, &second);
+    return atomic_load(&filter->counters[first]) != 0 && atomic_load(&filter->counters[second]) != 0;
+}
+
+// FNV-1a.
+static uint64_t get_hash(const char* name)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    while (*name) {
+        hash ^= (unsigned char)*name;
+        hash *= 1099511628211ULL;
+        ++name;
+    }
+    return hash;
+}
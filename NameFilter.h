@@ -0,0 +1,31 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+// A counting Bloom filter over a set of folder names.
+// It never answers "absent" for a name that was added (and not removed since), so it can be
+// used to reject lookups of missing names early. Names can be removed, but counters that ever
+// overflowed stay saturated, which only makes the filter less selective.
+//
+// Adding and removing names has to be serialized by the caller; `nfilter_may_contain` can be
+// called concurrently with them, without any lock.
+typedef struct NameFilter NameFilter;
+
+// Create a new, empty filter sized for `capacity` names.
+// `previous` (may be NULL) is a filter this one replaces. Since a concurrent reader may still
+// be looking at it, it is not freed until this filter is freed.
+NameFilter* nfilter_new(size_t capacity, NameFilter* previous);
+
+// Free the filter, together with all the filters it replaced. `filter` may be NULL.
+void nfilter_free(NameFilter* filter);
+
+// Return the number of names the filter was sized for. `filter` may be NULL (capacity 0).
+size_t nfilter_capacity(const NameFilter* filter);
+
+void nfilter_add(NameFilter* filter, const char* name);
+
+void nfilter_remove(NameFilter* filter, const char* name);
+
+// Return false if `name` is certainly not in the set, true if it may be.
+// NULL stands for a filter of an empty set.
+bool nfilter_may_contain(const NameFilter* filter, const char* name);
@@ -0,0 +1,177 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PathCache.h"
+
+// Slots are protected by a fixed number of striped locks; slot s uses lock s % N_LOCKS.
+#define N_LOCKS 64
+
+typedef struct Dependency Dependency;
+
+struct Dependency {
+    void* value;
+    unsigned long generation; // Generation of `value` when the entry was stored.
+};
+
+typedef struct Entry Entry;
+
+struct Entry {
+    char* path; // NULL for an empty slot; allocated together with `values`, right after them.
+    Dependency* values; // The stored value is the last one.
+    size_t count;
+};
+
+struct PathCache {
+    Entry* slots;
+    size_t n_slots;
+    pthread_mutex_t locks[N_LOCKS];
+    void (*hold)(void*);
+    void (*release)(void*);
+    unsigned long (*generation)(void*);
+    atomic_size_t hits;
+    atomic_size_t misses;
+};
+
+static size_t get_hash(const char* path);
+
+PathCache* pcache_new(size_t capacity, void (*hold)(void*), void (*release)(void*),
+    unsigned long (*generation)(void*))
+{
+    PathCache* cache = malloc(sizeof(PathCache));
+    if (!cache)
+        return NULL;
+    if (capacity == 0)
+        capacity = 1;
+    cache->slots = calloc(capacity, sizeof(Entry));
+    if (!cache->slots) {
+        free(cache);
+        return NULL;
+    }
+    cache->n_slots = capacity;
+    for (int l = 0; l < N_LOCKS; ++l)
+        pthread_mutex_init(&cache->locks[l], NULL);
+    cache->hold = hold;
+    cache->release = release;
+    cache->generation = generation;
+    atomic_init(&cache->hits, 0);
+    atomic_init(&cache->misses, 0);
+    return cache;
+}
+
+// Must be called with the slot's lock held.
+static void drop_entry(PathCache* cache, Entry* entry)
+{
+    if (!entry->path)
+        return;
+    for (size_t d = 0; d < entry->count; ++d)
+        cache->release(entry->values[d].value);
+    free(entry->values);
+    entry->path = NULL;
+    entry->values = NULL;
+    entry->count = 0;
+}
+
+// Whether none of the values of the entry has changed since it was stored. Must be called with the slot's lock held.
+static bool is_valid(PathCache* cache, Entry* entry)
+{
+    for (size_t d = 0; d < entry->count; ++d) {
+        if (cache->generation(entry->values[d].value) != entry->values[d].generation)
+            return false;
+    }
+    return true;
+}
+
+void pcache_free(PathCache* cache)
+{
+    pcache_clear(cache);
+    for (int l = 0; l < N_LOCKS; ++l)
+        pthread_mutex_destroy(&cache->locks[l]);
+    free(cache->slots);
+    free(cache);
+}
+
+void* pcache_get(PathCache* cache, const char* path)
+{
+    size_t s = get_hash(path) % cache->n_slots;
+    Entry* entry = &cache->slots[s];
+    void* result = NULL;
+    pthread_mutex_lock(&cache->locks[s % N_LOCKS]);
+    if (entry->path && strcmp(entry->path, path) == 0) {
+        if (is_valid(cache, entry)) {
+            result = entry->values[entry->count - 1].value;
+            cache->hold(result);
+        } else {
+            drop_entry(cache, entry); // Stale, one of the values has changed since.
+        }
+    }
+    pthread_mutex_unlock(&cache->locks[s % N_LOCKS]);
+    if (result)
+        atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+    else
+        atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+    return result;
+}
+
+bool pcache_check(PathCache* cache, const char* path, void* value)
+{
+    size_t s = get_hash(path) % cache->n_slots;
+    Entry* entry = &cache->slots[s];
+    pthread_mutex_lock(&cache->locks[s % N_LOCKS]);
+    bool valid = entry->path && entry->values[entry->count - 1].value == value && strcmp(entry->path, path) == 0
+        && is_valid(cache, entry);
+    pthread_mutex_unlock(&cache->locks[s % N_LOCKS]);
+    return valid;
+}
+
+void pcache_insert(PathCache* cache, const char* path, void* const values[], size_t count)
+{
+    if (count == 0)
+        return;
+    size_t s = get_hash(path) % cache->n_slots;
+    Entry* entry = &cache->slots[s];
+    size_t path_size = strlen(path) + 1;
+    Dependency* copy = malloc(count * sizeof(Dependency) + path_size);
+    if (!copy)
+        return;
+    for (size_t d = 0; d < count; ++d) {
+        cache->hold(values[d]);
+        copy[d].value = values[d];
+        copy[d].generation = cache->generation(values[d]);
+    }
+    memcpy(copy + count, path, path_size);
+    pthread_mutex_lock(&cache->locks[s % N_LOCKS]);
+    drop_entry(cache, entry);
+    entry->path = (char*)(copy + count);
+    entry->values = copy;
+    entry->count = count;
+    pthread_mutex_unlock(&cache->locks[s % N_LOCKS]);
+}
+
+void pcache_clear(PathCache* cache)
+{
+    for (size_t s = 0; s < cache->n_slots; ++s) {
+        pthread_mutex_lock(&cache->locks[s % N_LOCKS]);
+        drop_entry(cache, &cache->slots[s]);
+        pthread_mutex_unlock(&cache->locks[s % N_LOCKS]);
+    }
+}
+
+void pcache_stats(PathCache* cache, size_t* hits, size_t* misses)
+{
+    *hits = atomic_load(&cache->hits);
+    *misses = atomic_load(&cache->misses);
+}
+
+// FNV-1a.
+static size_t get_hash(const char* path)
+{
+    size_t hash = 14695981039346656037ULL;
+    while (*path) {
+        hash ^= (unsigned char)*path;
+        hash *= 1099511628211ULL;
+        ++path;
+    }
+    return hash;
+}
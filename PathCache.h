@@ -0,0 +1,41 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+// A concurrent, bounded cache mapping full paths (C-strings) to values.
+// It is direct-mapped: every path has exactly one slot, inserting a path evicts whatever was there.
+// An entry keeps the value together with the values it depends on (e.g. the folders above a folder),
+// each one paired with its generation number. The entry is valid only as long as the current
+// generations of all of them (as reported by the `generation` callback) are still the same, so the
+// owner of a value invalidates every entry that goes through it at once by changing its generation,
+// without looking for them. Invalid entries are dropped when they are found, or evicted.
+typedef struct PathCache PathCache;
+
+// Create a new, empty cache with room for `capacity` entries.
+// Callbacks:
+// - `hold`: called on every value of an entry when it is stored, and on a value returned by `pcache_get`,
+// - `release`: called on every value of an entry when it is dropped,
+// - `generation`: returns the current generation of a held value.
+// All three may be called while the cache holds its internal locks.
+PathCache* pcache_new(size_t capacity, void (*hold)(void*), void (*release)(void*),
+    unsigned long (*generation)(void*));
+
+// Drop all entries and free the cache.
+void pcache_free(PathCache* cache);
+
+// Get the value stored under `path`, or NULL if not present or not valid anymore.
+// A returned value has been held once on behalf of the caller.
+void* pcache_get(PathCache* cache, const char* path);
+
+// Whether `path` still has a valid entry of `value` (e.g. one returned by `pcache_get` a moment ago).
+bool pcache_check(PathCache* cache, const char* path, void* value);
+
+// Store `values[count - 1]` under `path`, valid as long as all of the `count` values have their current generations.
+// (The caller can free `path` at any time - the cache internally uses a copy of it).
+void pcache_insert(PathCache* cache, const char* path, void* const values[], size_t count);
+
+// Drop every entry.
+void pcache_clear(PathCache* cache);
+
+// Set `*hits` and `*misses` to the number of `pcache_get` calls that found, and did not find, a valid entry.
+void pcache_stats(PathCache* cache, size_t* hits, size_t* misses);
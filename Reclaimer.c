@@ -0,0 +1,125 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "Reclaimer.h"
+
+struct Reclaimer {
+    ReclaimLink* _Atomic retired; // A stack, the latest object on top.
+    sem_t wakeup; // Posted once for every retired object (and once to stop).
+    atomic_bool stopping;
+    pthread_t thread;
+    void (*reclaim)(ReclaimLink*, void*);
+    void* context;
+    atomic_size_t queued;
+    atomic_size_t reclaimed;
+    atomic_ulong last_lag_us; // Written only by the thread (or by reclaimer_free, after it stopped).
+    atomic_ulong max_lag_us;
+};
+
+static unsigned long long now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (unsigned long long)time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+// Take all the retired objects at once and reclaim them, the oldest first.
+static bool reclaim_batch(Reclaimer* reclaimer)
+{
+    ReclaimLink* link = atomic_exchange(&reclaimer->retired, NULL);
+    if (!link)
+        return false;
+    ReclaimLink* oldest = NULL;
+    while (link) {
+        ReclaimLink* next = link->next;
+        link->next = oldest;
+        oldest = link;
+        link = next;
+    }
+    unsigned long long start = now(); // Once per batch, the objects of a batch wait about the same.
+    while (oldest) {
+        ReclaimLink* next = oldest->next; // The callback may free the object.
+        unsigned long lag = start > oldest->retired_at ? (start - oldest->retired_at) / 1000 : 0;
+        atomic_store(&reclaimer->last_lag_us, lag);
+        if (lag > atomic_load(&reclaimer->max_lag_us))
+            atomic_store(&reclaimer->max_lag_us, lag);
+        reclaimer->reclaim(oldest, reclaimer->context);
+        atomic_fetch_sub(&reclaimer->queued, 1);
+        atomic_fetch_add(&reclaimer->reclaimed, 1);
+        oldest = next;
+    }
+    return true;
+}
+
+static void* run(void* arg)
+{
+    Reclaimer* reclaimer = arg;
+    for (;;) {
+        while (sem_wait(&reclaimer->wakeup) != 0) // Only EINTR.
+            ;
+        if (!reclaim_batch(reclaimer) && atomic_load(&reclaimer->stopping))
+            return NULL;
+    }
+}
+
+Reclaimer* reclaimer_new(void (*reclaim)(ReclaimLink* link, void* context), void* context)
+{
+    Reclaimer* reclaimer = malloc(sizeof(Reclaimer));
+    if (!reclaimer)
+        return NULL;
+    atomic_init(&reclaimer->retired, NULL);
+    atomic_init(&reclaimer->stopping, false);
+    atomic_init(&reclaimer->queued, 0);
+    atomic_init(&reclaimer->reclaimed, 0);
+    atomic_init(&reclaimer->last_lag_us, 0);
+    atomic_init(&reclaimer->max_lag_us, 0);
+    reclaimer->reclaim = reclaim;
+    reclaimer->context = context;
+    if (sem_init(&reclaimer->wakeup, 0, 0) != 0) {
+        free(reclaimer);
+        return NULL;
+    }
+    if (pthread_create(&reclaimer->thread, NULL, run, reclaimer) != 0) {
+        sem_destroy(&reclaimer->wakeup);
+        free(reclaimer);
+        return NULL;
+    }
+    return reclaimer;
+}
+
+void reclaimer_free(Reclaimer* reclaimer)
+{
+    atomic_store(&reclaimer->stopping, true);
+    sem_post(&reclaimer->wakeup);
+    pthread_join(reclaimer->thread, NULL);
+    reclaim_batch(reclaimer); // Whatever was retired after the thread saw an empty stack.
+    sem_destroy(&reclaimer->wakeup);
+    free(reclaimer);
+}
+
+void reclaimer_retire(Reclaimer* reclaimer, ReclaimLink* link)
+{
+    link->retired_at = now();
+    atomic_fetch_add(&reclaimer->queued, 1);
+    ReclaimLink* top = atomic_load(&reclaimer->retired);
+    do
+        link->next = top;
+    while (!atomic_compare_exchange_weak(&reclaimer->retired, &top, link));
+    sem_post(&reclaimer->wakeup);
+}
+
+void reclaimer_stats(Reclaimer* reclaimer, size_t* queued, size_t* reclaimed,
+    unsigned long* last_lag_us, unsigned long* max_lag_us)
+{
+    if (queued)
+        *queued = atomic_load(&reclaimer->queued);
+    if (reclaimed)
+        *reclaimed = atomic_load(&reclaimer->reclaimed);
+    if (last_lag_us)
+        *last_lag_us = atomic_load(&reclaimer->last_lag_us);
+    if (max_lag_us)
+        *max_lag_us = atomic_load(&reclaimer->max_lag_us);
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Reclaims retired objects in batches on a background thread, so that whoever retires them
+// (usually while holding some lock) does not pay for freeing them.
+typedef struct Reclaimer Reclaimer;
+
+// Embedded in every object that can be retired; the reclaim callback gets it back.
+typedef struct ReclaimLink ReclaimLink;
+
+struct ReclaimLink {
+    ReclaimLink* next;
+    unsigned long long retired_at; // In nanoseconds, for measuring the lag.
+};
+
+// Create a reclaimer and start its thread, which calls `reclaim(link, context)` for every retired object.
+// Return NULL if the thread could not be started.
+Reclaimer* reclaimer_new(void (*reclaim)(ReclaimLink* link, void* context), void* context);
+
+// Reclaim everything retired so far, stop the thread and free the reclaimer.
+void reclaimer_free(Reclaimer* reclaimer);
+
+// Hand an object over to the reclaimer. Lock-free, never blocks.
+void reclaimer_retire(Reclaimer* reclaimer, ReclaimLink* link);
+
+// Set (those that are not NULL):
+// - `*queued` to the number of objects retired and not reclaimed yet,
+// - `*reclaimed` to the number of objects reclaimed so far,
+// - `*last_lag_us` and `*max_lag_us` to the time from retiring to reclaiming (in microseconds)
+//   of the latest reclaimed object and the maximum over all of them.
+void reclaimer_stats(Reclaimer* reclaimer, size_t* queued, size_t* reclaimed,
+    unsigned long* last_lag_us, unsigned long* max_lag_us);
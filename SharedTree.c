@@ -0,0 +1,546 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "SharedTree.h"
+#include "path_utils.h"
+
+// The layout of a segment: a Header at offset 0, then blocks of the allocator, each a power of two bytes long
+// (starting with a BlockHeader) and holding a Folder, the Entries of a folder or a name.
+
+#define SHARED_MAGIC "dirshm01"
+#define SHARED_MAGIC_LENGTH 8
+
+// The smallest block is 1 << MIN_BLOCK_SHIFT bytes.
+#define MIN_BLOCK_SHIFT 5
+#define BLOCK_SHIFTS 64
+
+// Subfolders a folder has room for when it gets its first one.
+#define FIRST_CAPACITY 4
+
+typedef struct Header Header;
+
+struct Header {
+    char magic[SHARED_MAGIC_LENGTH]; // Written last, once the tree is ready to be opened.
+    uint64_t size; // Of the whole segment.
+    uint64_t root; // Offset of the root's Folder.
+    pthread_mutex_t allocator; // Process-shared, for the fields below.
+    uint64_t top; // Nothing from here to the end of the segment was allocated yet.
+    uint64_t free_blocks[BLOCK_SHIFTS]; // The first free block of each size, linked through their first bytes.
+};
+
+typedef struct BlockHeader BlockHeader;
+
+struct BlockHeader {
+    uint64_t shift; // Of the block's size.
+    uint64_t padding; // So that what follows is aligned to 16 bytes.
+};
+
+typedef struct Folder Folder;
+
+struct Folder {
+    pthread_rwlock_t lock; // Process-shared.
+    uint64_t entries; // Offset of an array of `capacity` Entries, the first `count` of them sorted by name; 0 if there is none.
+    uint32_t count;
+    uint32_t capacity;
+};
+
+typedef struct Entry Entry;
+
+struct Entry {
+    uint64_t name; // Offset of the null-terminated name.
+    uint64_t folder;
+};
+
+struct SharedTree {
+    char* map;
+    size_t size;
+    Header* header;
+};
+
+static void* at(SharedTree* tree, uint64_t offset)
+{
+    return tree->map + offset;
+}
+
+// Return the offset of `bytes` bytes of the segment, or 0 if it is full.
+static uint64_t allocate(SharedTree* tree, size_t bytes)
+{
+    unsigned shift = MIN_BLOCK_SHIFT;
+    while (shift < BLOCK_SHIFTS - 1 && ((uint64_t)1 << shift) - sizeof(BlockHeader) < bytes)
+        ++shift;
+    Header* header = tree->header;
+    uint64_t block = 0;
+    pthread_mutex_lock(&header->allocator);
+    if (header->free_blocks[shift] != 0) {
+        block = header->free_blocks[shift];
+        header->free_blocks[shift] = *(uint64_t*)at(tree, block + sizeof(BlockHeader));
+    } else if (header->size - header->top >= ((uint64_t)1 << shift)) {
+        block = header->top;
+        header->top += (uint64_t)1 << shift;
+    }
+    pthread_mutex_unlock(&header->allocator);
+    if (block == 0)
+        return 0;
+    ((BlockHeader*)at(tree, block))->shift = shift;
+    return block + sizeof(BlockHeader);
+}
+
+static void deallocate(SharedTree* tree, uint64_t offset)
+{
+    uint64_t block = offset - sizeof(BlockHeader);
+    unsigned shift = ((BlockHeader*)at(tree, block))->shift;
+    Header* header = tree->header;
+    pthread_mutex_lock(&header->allocator);
+    *(uint64_t*)at(tree, offset) = header->free_blocks[shift];
+    header->free_blocks[shift] = block;
+    pthread_mutex_unlock(&header->allocator);
+}
+
+// Return the offset of a new, empty folder, or 0 if the segment is full.
+static uint64_t folder_new(SharedTree* tree)
+{
+    uint64_t offset = allocate(tree, sizeof(Folder));
+    if (offset == 0)
+        return 0;
+    Folder* folder = at(tree, offset);
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    // Readers come all the time on the folders near the root, a writer must not wait for them to stop.
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&folder->lock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+    folder->entries = 0;
+    folder->count = 0;
+    folder->capacity = 0;
+    return offset;
+}
+
+// Free an empty folder, which nobody else can reach.
+static void folder_free(SharedTree* tree, uint64_t offset)
+{
+    Folder* folder = at(tree, offset);
+    pthread_rwlock_destroy(&folder->lock);
+    if (folder->entries != 0)
+        deallocate(tree, folder->entries);
+    deallocate(tree, offset);
+}
+
+static Entry* entry_at(SharedTree* tree, Folder* folder, uint32_t index)
+{
+    return (Entry*)at(tree, folder->entries) + index;
+}
+
+// Binary search for the subfolder `name` of `folder`: return whether it is there, and set `*index` to its position
+// (or to the position where it would be inserted).
+static bool find_entry(SharedTree* tree, Folder* folder, const char* name, uint32_t* index)
+{
+    uint32_t low = 0;
+    uint32_t high = folder->count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        int cmp = strcmp(name, at(tree, entry_at(tree, folder, middle)->name));
+        if (cmp == 0) {
+            *index = middle;
+            return true;
+        }
+        if (cmp < 0)
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    *index = low;
+    return false;
+}
+
+// Make room for one more subfolder of `folder`. Return false if the segment is full.
+static bool reserve_entry(SharedTree* tree, Folder* folder)
+{
+    if (folder->count < folder->capacity)
+        return true;
+    uint32_t capacity = folder->capacity > 0 ? 2 * folder->capacity : FIRST_CAPACITY;
+    uint64_t entries = allocate(tree, capacity * sizeof(Entry));
+    if (entries == 0)
+        return false;
+    if (folder->entries != 0) {
+        memcpy(at(tree, entries), at(tree, folder->entries), folder->count * sizeof(Entry));
+        deallocate(tree, folder->entries);
+    }
+    folder->entries = entries;
+    folder->capacity = capacity;
+    return true;
+}
+
+// Put a subfolder at `index` of `folder`, which has room for it (see reserve_entry).
+static void insert_entry(SharedTree* tree, Folder* folder, uint32_t index, uint64_t name, uint64_t child)
+{
+    Entry* entry = entry_at(tree, folder, index);
+    memmove(entry + 1, entry, (folder->count - index) * sizeof(Entry));
+    entry->name = name;
+    entry->folder = child;
+    folder->count++;
+}
+
+static void remove_entry(SharedTree* tree, Folder* folder, uint32_t index)
+{
+    Entry* entry = entry_at(tree, folder, index);
+    memmove(entry, entry + 1, (folder->count - index - 1) * sizeof(Entry));
+    folder->count--;
+}
+
+// Return the offset of a copy of `name` in the segment, or 0 if it is full.
+static uint64_t name_new(SharedTree* tree, const char* name)
+{
+    size_t length = strlen(name);
+    uint64_t offset = allocate(tree, length + 1);
+    if (offset != 0)
+        memcpy(at(tree, offset), name, length + 1);
+    return offset;
+}
+
+static void unlock_all(Folder* held[], int count)
+{
+    while (count > 0)
+        pthread_rwlock_unlock(&held[--count]->lock);
+}
+
+// Lock the folders on `path` from the root down: the last one as a writer if `writer`, the others as readers.
+// Set `held` to them (one more than the components of the path) and `*count` to how many there are.
+// Return ENOENT (with nothing held) if there is no such folder.
+static int walk(SharedTree* tree, const char* path, bool writer, Folder* held[], int* count)
+{
+    Folder* folder = at(tree, tree->header->root);
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    const char* subpath = path;
+    *count = 0;
+    while ((subpath = split_path(subpath, component))) {
+        pthread_rwlock_rdlock(&folder->lock);
+        held[(*count)++] = folder;
+        uint32_t index;
+        if (!find_entry(tree, folder, component, &index)) {
+            unlock_all(held, *count);
+            return ENOENT;
+        }
+        folder = at(tree, entry_at(tree, folder, index)->folder);
+    }
+    if (writer)
+        pthread_rwlock_wrlock(&folder->lock);
+    else
+        pthread_rwlock_rdlock(&folder->lock);
+    held[(*count)++] = folder;
+    return 0;
+}
+
+// The folder at `path` relative to `folder`, which is held as a writer (so nothing below it has to be locked), or NULL.
+static Folder* descend(SharedTree* tree, Folder* folder, const char* path)
+{
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    const char* subpath = path;
+    while (folder && (subpath = split_path(subpath, component))) {
+        uint32_t index;
+        folder = find_entry(tree, folder, component, &index) ? at(tree, entry_at(tree, folder, index)->folder) : NULL;
+    }
+    return folder;
+}
+
+// Return the length of the path of the latest common ancestor of the folders at `first` and `second`.
+static size_t common_length(const char* first, const char* second)
+{
+    size_t length = 1;
+    for (size_t i = 0; first[i] != '\0' && first[i] == second[i]; ++i) {
+        if (first[i] == '/')
+            length = i + 1;
+    }
+    return length;
+}
+
+// Map the segment open at `fd` (which is closed), return NULL (with errno set) on failure.
+static SharedTree* map_segment(int fd, size_t size)
+{
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd); // The mapping stays.
+    if (map == MAP_FAILED) {
+        errno = err;
+        return NULL;
+    }
+    SharedTree* tree = malloc(sizeof(SharedTree));
+    if (!tree) {
+        munmap(map, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    tree->map = map;
+    tree->size = size;
+    tree->header = map;
+    return tree;
+}
+
+SharedTree* stree_new(const char* name, size_t size)
+{
+    if (size < sizeof(Header) + 2 * sizeof(Folder)) {
+        errno = ENOSPC;
+        return NULL;
+    }
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, size) != 0) {
+        int err = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = err;
+        return NULL;
+    }
+    SharedTree* tree = map_segment(fd, size);
+    if (!tree) {
+        int err = errno;
+        shm_unlink(name);
+        errno = err;
+        return NULL;
+    }
+
+    Header* header = tree->header;
+    header->size = size;
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&header->allocator, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+    header->top = (sizeof(Header) + 15) / 16 * 16;
+    memset(header->free_blocks, 0, sizeof(header->free_blocks));
+    header->root = folder_new(tree);
+    if (header->root == 0) {
+        stree_close(tree);
+        shm_unlink(name);
+        errno = ENOSPC;
+        return NULL;
+    }
+    atomic_thread_fence(memory_order_release); // Whoever sees the magic sees the tree.
+    memcpy(header->magic, SHARED_MAGIC, SHARED_MAGIC_LENGTH);
+    return tree;
+}
+
+SharedTree* stree_open(const char* name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    if (status.st_size < (off_t)sizeof(Header)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    SharedTree* tree = map_segment(fd, status.st_size);
+    if (!tree)
+        return NULL;
+    if (memcmp(tree->header->magic, SHARED_MAGIC, SHARED_MAGIC_LENGTH) != 0 || tree->header->size != tree->size) {
+        stree_close(tree);
+        errno = EINVAL;
+        return NULL;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    return tree;
+}
+
+void stree_close(SharedTree* tree)
+{
+    munmap(tree->map, tree->size);
+    free(tree);
+}
+
+int stree_unlink(const char* name)
+{
+    return shm_unlink(name) == 0 ? 0 : errno;
+}
+
+char* stree_list(SharedTree* tree, const char* path)
+{
+    if (!is_path_valid(path))
+        return NULL;
+    Folder* held[strlen(path)];
+    int count;
+    if (walk(tree, path, false, held, &count) != 0)
+        return NULL;
+    Folder* folder = held[count - 1];
+    size_t length = 0;
+    for (uint32_t i = 0; i < folder->count; ++i)
+        length += strlen(at(tree, entry_at(tree, folder, i)->name)) + 1;
+    char* listing = malloc(length + 1);
+    if (listing) {
+        char* end = listing;
+        for (uint32_t i = 0; i < folder->count; ++i) {
+            if (i > 0)
+                *end++ = ',';
+            const char* name = at(tree, entry_at(tree, folder, i)->name);
+            size_t name_length = strlen(name);
+            memcpy(end, name, name_length);
+            end += name_length;
+        }
+        *end = '\0';
+    }
+    unlock_all(held, count);
+    return listing;
+}
+
+int stree_create(SharedTree* tree, const char* path)
+{
+    if (!is_path_valid(path))
+        return EINVAL;
+    if (strlen(path) == 1)
+        return EEXIST;
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    char* parent_path = make_path_to_parent(path, component);
+    Folder* held[strlen(path)];
+    int count;
+    int err = walk(tree, parent_path, true, held, &count);
+    free(parent_path);
+    if (err != 0)
+        return err;
+
+    Folder* parent = held[count - 1];
+    uint32_t index;
+    if (find_entry(tree, parent, component, &index)) {
+        err = EEXIST;
+    } else {
+        uint64_t child = folder_new(tree);
+        uint64_t name = name_new(tree, component);
+        if (child != 0 && name != 0 && reserve_entry(tree, parent)) {
+            insert_entry(tree, parent, index, name, child);
+        } else {
+            if (child != 0)
+                folder_free(tree, child);
+            if (name != 0)
+                deallocate(tree, name);
+            err = ENOSPC;
+        }
+    }
+    unlock_all(held, count);
+    return err;
+}
+
+int stree_remove(SharedTree* tree, const char* path)
+{
+    if (strlen(path) == 1)
+        return EBUSY;
+    if (!is_path_valid(path))
+        return EINVAL;
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    char* parent_path = make_path_to_parent(path, component);
+    Folder* held[strlen(path)];
+    int count;
+    int err = walk(tree, parent_path, true, held, &count);
+    free(parent_path);
+    if (err != 0)
+        return err;
+
+    // Whoever works below the parent holds it as a reader, so nobody is in the folder (nor waits for it) now.
+    Folder* parent = held[count - 1];
+    uint32_t index;
+    if (!find_entry(tree, parent, component, &index)) {
+        err = ENOENT;
+    } else {
+        Entry entry = *entry_at(tree, parent, index);
+        if (((Folder*)at(tree, entry.folder))->count != 0) {
+            err = ENOTEMPTY;
+        } else {
+            remove_entry(tree, parent, index);
+            deallocate(tree, entry.name);
+            folder_free(tree, entry.folder);
+        }
+    }
+    unlock_all(held, count);
+    return err;
+}
+
+// The part of stree_move done while the latest common ancestor of both parents is held as a writer; the paths of
+// the parents are relative to it. The errors are the ones of tree_move, in the same order.
+static int moving(SharedTree* tree, Folder* ancestor, const char* source_parent, const char* source_name,
+    const char* target_parent, const char* target_name, const char* source, const char* target)
+{
+    Folder* from = descend(tree, ancestor, source_parent);
+    uint32_t source_index;
+    if (!from || !find_entry(tree, from, source_name, &source_index))
+        return ENOENT;
+    if (strcmp(source, target) == 0)
+        return EEXIST;
+    bool into_source = strncmp(target, source, strlen(source)) == 0;
+    if (!into_source && strncmp(source, target, strlen(target)) == 0)
+        return EEXIST; // The target is above the source, so it exists.
+    Folder* to = descend(tree, ancestor, target_parent);
+    uint32_t target_index;
+    if (!to)
+        return ENOENT;
+    if (find_entry(tree, to, target_name, &target_index))
+        return EEXIST;
+    if (into_source)
+        return -1; // The target is inside of the source.
+
+    uint64_t name = name_new(tree, target_name);
+    if (name == 0 || !reserve_entry(tree, to)) {
+        if (name != 0)
+            deallocate(tree, name);
+        return ENOSPC;
+    }
+    Entry moved = *entry_at(tree, from, source_index);
+    remove_entry(tree, from, source_index);
+    if (from == to && target_index > source_index)
+        --target_index;
+    insert_entry(tree, to, target_index, name, moved.folder);
+    deallocate(tree, moved.name);
+    return 0;
+}
+
+int stree_move(SharedTree* tree, const char* source, const char* target)
+{
+    if (strlen(source) == 1)
+        return EBUSY;
+    if (strlen(target) == 1)
+        return EEXIST;
+    if (!is_path_valid(source) || !is_path_valid(target))
+        return EINVAL;
+    char source_name[MAX_FOLDER_NAME_LENGTH + 1];
+    char target_name[MAX_FOLDER_NAME_LENGTH + 1];
+    char* source_parent = make_path_to_parent(source, source_name);
+    char* target_parent = make_path_to_parent(target, target_name);
+
+    // Nothing below the ancestor has to be locked: whoever works there holds it as a reader.
+    size_t common = common_length(source_parent, target_parent);
+    char ancestor_path[common + 1];
+    memcpy(ancestor_path, source_parent, common);
+    ancestor_path[common] = '\0';
+    Folder* held[common];
+    int count;
+    int err = walk(tree, ancestor_path, true, held, &count);
+    if (err == 0) {
+        err = moving(tree, held[count - 1], source_parent + common - 1, source_name, target_parent + common - 1,
+            target_name, source, target);
+        unlock_all(held, count);
+    }
+    free(source_parent);
+    free(target_parent);
+    return err;
+}
+
+void stree_usage(SharedTree* tree, size_t* used, size_t* size)
+{
+    pthread_mutex_lock(&tree->header->allocator);
+    *used = tree->header->top;
+    pthread_mutex_unlock(&tree->header->allocator);
+    *size = tree->size;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// A tree of folders that lives in a POSIX shared memory object (see shm_open), so that several processes can map it
+// and work on it at the same time, without copies. Everything in it is linked by offsets from the start of the
+// segment, never by pointers, so each process may map it at a different address; memory for folders and names comes
+// from an allocator inside the segment, so the segment has a fixed size chosen when it is made.
+//
+// Like in Tree, every folder has its own readers-writers lock (process-shared here, preferring writers): an operation
+// holds the folders on its path as a reader and the folder it changes as a writer. Locks are not released when a
+// process dies in the middle of an operation, so the workers sharing a tree have to be restarted together.
+//
+// Every folder keeps its subfolders in an array sorted by name, so listings need no sorting and lookups are binary
+// searches. Operations return the same errors as the operations of Tree.h, and ENOSPC if the segment is full.
+typedef struct SharedTree SharedTree;
+
+// Create the shared memory object `name` (as for shm_open, e.g. "/tree"; it must not exist yet) of `size` bytes
+// with an empty tree in it, and map it. Return NULL (with errno set, ENOSPC if `size` is too small even for the
+// root folder) on failure.
+SharedTree* stree_new(const char* name, size_t size);
+
+// Map the tree made by stree_new under `name` (in this process or in another one).
+// Return NULL (with errno set, EINVAL if it is not a shared tree) on failure.
+SharedTree* stree_open(const char* name);
+
+// Unmap the tree. It stays in the shared memory object for the other processes.
+void stree_close(SharedTree* tree);
+
+// Remove the shared memory object `name`; processes that have it mapped can go on using it. Return 0 or errno.
+int stree_unlink(const char* name);
+
+// Like tree_list: the sorted, comma-separated names of the subfolders of `path`, allocated in this process and
+// freed by the caller. Return NULL if the path is invalid or does not exist (or out of memory).
+char* stree_list(SharedTree* tree, const char* path);
+
+int stree_create(SharedTree* tree, const char* path);
+
+int stree_remove(SharedTree* tree, const char* path);
+
+int stree_move(SharedTree* tree, const char* source, const char* target);
+
+// Set `*used` to the number of bytes of the segment that hold folders and names (or are free to be reused
+// for them), and `*size` to the size of the whole segment.
+void stree_usage(SharedTree* tree, size_t* used, size_t* size);
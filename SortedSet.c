@@ -0,0 +1,454 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SortedSet.h"
+
+// An AVL tree. Every change is made in the newest state; a state that may still be read at a kept version is
+// frozen - the change starts a new state, copying the frozen nodes it has to modify (path copying).
+
+typedef struct Node Node;
+
+struct Node {
+    Node* left;
+    Node* right;
+    int height;
+    unsigned long version; // Of the change that made the node (or its copy).
+    Node* next_retired; // On the `retired` list of a state, once the node is not in the newest one.
+    void* value;
+    char key[];
+};
+
+typedef struct State State;
+
+// The set as it is from version `since` on, until the next newer state.
+// Readers at kept versions see only frozen states, which are never modified.
+struct State {
+    Node* root;
+    unsigned long since;
+    State* older;
+    Node* retired; // Nodes of older states that are not in this one, freed together with the older states.
+};
+
+struct SortedSet {
+    State* _Atomic newest;
+    size_t size; // Total number of keys in the set.
+    size_t keys_length; // Total length of keys in the set.
+    unsigned long version; // Of the following changes.
+    unsigned long frozen; // Nodes and states of versions up to this one are kept (nothing is, if it is 0).
+};
+
+// A single insertion or removal, made in `state`.
+typedef struct Change {
+    SortedSet* set;
+    State* state;
+} Change;
+
+SortedSet* sset_new()
+{
+    SortedSet* set = malloc(sizeof(SortedSet));
+    if (!set)
+        return NULL;
+    State* state = malloc(sizeof(State));
+    if (!state) {
+        free(set);
+        return NULL;
+    }
+    memset(state, 0, sizeof(State));
+    memset(set, 0, sizeof(SortedSet));
+    atomic_init(&set->newest, state);
+    return set;
+}
+
+static void free_nodes(Node* node)
+{
+    while (node) {
+        free_nodes(node->left);
+        Node* right = node->right;
+        free(node);
+        node = right;
+    }
+}
+
+static void free_retired(Node* node)
+{
+    while (node) {
+        Node* next = node->next_retired;
+        free(node);
+        node = next;
+    }
+}
+
+void sset_free(SortedSet* set)
+{
+    State* state = atomic_load(&set->newest);
+    free_nodes(state->root);
+    while (state) {
+        State* older = state->older;
+        free_retired(state->retired);
+        free(state);
+        state = older;
+    }
+    free(set);
+}
+
+static bool is_frozen(SortedSet* set, unsigned long version)
+{
+    return set->frozen != 0 && version <= set->frozen;
+}
+
+// Take `node` out of the newest state: free it, unless a kept state may still contain it.
+static void retire(Change* change, Node* node)
+{
+    if (!is_frozen(change->set, node->version)) {
+        free(node);
+        return;
+    }
+    node->next_retired = change->state->retired;
+    change->state->retired = node;
+}
+
+// Return `node`, or a copy of it (replacing it in the newest state) if it is frozen.
+static Node* writable(Change* change, Node* node)
+{
+    if (!is_frozen(change->set, node->version))
+        return node;
+    size_t size = sizeof(Node) + strlen(node->key) + 1;
+    Node* copy = malloc(size);
+    if (!copy) { // Half of the change is already made, it cannot be undone.
+        perror("Sorted set node copy failed");
+        exit(1);
+    }
+    memcpy(copy, node, size);
+    copy->version = change->set->version;
+    retire(change, node);
+    return copy;
+}
+
+static int height(Node* node)
+{
+    return node ? node->height : 0;
+}
+
+static void update_height(Node* node)
+{
+    int left = height(node->left);
+    int right = height(node->right);
+    node->height = (left > right ? left : right) + 1;
+}
+
+// A balanced tree of the `n` sorted keys, or NULL if `n` is 0 or out of memory (then `*failed` is set).
+static Node* build_nodes(const char* const keys[], void* const values[], size_t n, bool* failed)
+{
+    if (n == 0)
+        return NULL;
+    size_t middle = n / 2;
+    size_t key_length = strlen(keys[middle]);
+    Node* node = malloc(sizeof(Node) + key_length + 1);
+    if (!node) {
+        *failed = true;
+        return NULL;
+    }
+    node->version = 0;
+    node->value = values[middle];
+    memcpy(node->key, keys[middle], key_length + 1);
+    node->left = build_nodes(keys, values, middle, failed);
+    node->right = build_nodes(keys + middle + 1, values + middle + 1, n - middle - 1, failed);
+    update_height(node);
+    return node;
+}
+
+SortedSet* sset_new_sorted(const char* const keys[], void* const values[], size_t n)
+{
+    SortedSet* set = sset_new();
+    if (!set)
+        return NULL;
+    bool failed = false;
+    Node* root = build_nodes(keys, values, n, &failed);
+    if (failed) {
+        free_nodes(root);
+        sset_free(set);
+        return NULL;
+    }
+    atomic_load(&set->newest)->root = root;
+    set->size = n;
+    for (size_t i = 0; i < n; ++i)
+        set->keys_length += strlen(keys[i]);
+    return set;
+}
+
+// The rotations and rebalance take a `node` that is writable already.
+static Node* rotate_right(Change* change, Node* node)
+{
+    Node* left = writable(change, node->left);
+    node->left = left->right;
+    left->right = node;
+    update_height(node);
+    update_height(left);
+    return left;
+}
+
+static Node* rotate_left(Change* change, Node* node)
+{
+    Node* right = writable(change, node->right);
+    node->right = right->left;
+    right->left = node;
+    update_height(node);
+    update_height(right);
+    return right;
+}
+
+// Restore the balance of `node`, whose subtrees are balanced and differ in height by at most 2.
+static Node* rebalance(Change* change, Node* node)
+{
+    update_height(node);
+    int balance = height(node->left) - height(node->right);
+    if (balance > 1) {
+        if (height(node->left->left) < height(node->left->right))
+            node->left = rotate_left(change, writable(change, node->left));
+        return rotate_right(change, node);
+    }
+    if (balance < -1) {
+        if (height(node->right->right) < height(node->right->left))
+            node->right = rotate_right(change, writable(change, node->right));
+        return rotate_left(change, node);
+    }
+    return node;
+}
+
+static Node* find(Node* node, const char* key)
+{
+    while (node) {
+        int cmp = strcmp(key, node->key);
+        if (cmp == 0)
+            return node;
+        node = cmp < 0 ? node->left : node->right;
+    }
+    return NULL;
+}
+
+// Drop the states and nodes that are not needed for versions from `oldest` on: everything older than the
+// newest state that started at `oldest` or earlier.
+static void forget(SortedSet* set, unsigned long oldest)
+{
+    State* state = atomic_load(&set->newest);
+    while (state->since > oldest && state->older)
+        state = state->older;
+    free_retired(state->retired);
+    state->retired = NULL;
+    State* older = state->older;
+    if (older)
+        state->older = NULL; // Readers at kept versions stop at this state, at the latest.
+    while (older) {
+        State* next = older->older;
+        free_retired(older->retired);
+        free(older);
+        older = next;
+    }
+}
+
+void sset_set_version(SortedSet* set, unsigned long version, unsigned long oldest, unsigned long newest)
+{
+    set->version = version;
+    set->frozen = oldest <= newest ? newest : 0;
+    forget(set, oldest);
+}
+
+bool sset_forget(SortedSet* set, unsigned long oldest)
+{
+    forget(set, oldest);
+    return sset_kept(set);
+}
+
+bool sset_kept(SortedSet* set)
+{
+    State* state = atomic_load(&set->newest);
+    return state->older != NULL || state->retired != NULL;
+}
+
+// Start a change in the newest state, or in a new one after it if that one is frozen. False if out of memory.
+static bool start_change(SortedSet* set, Change* change)
+{
+    change->set = set;
+    change->state = atomic_load(&set->newest);
+    if (!is_frozen(set, change->state->since))
+        return true;
+    State* state = malloc(sizeof(State));
+    if (!state)
+        return false;
+    state->root = change->state->root;
+    state->since = set->version;
+    state->older = change->state;
+    state->retired = NULL;
+    change->state = state;
+    return true;
+}
+
+// Publish the (possibly new) newest state, with all of its nodes.
+static void finish_change(Change* change)
+{
+    atomic_store_explicit(&change->set->newest, change->state, memory_order_release);
+}
+
+// Insert `new_node` below `node`, where its key is not present. Return the new root of the subtree.
+static Node* insert_node(Change* change, Node* node, Node* new_node)
+{
+    if (!node)
+        return new_node;
+    node = writable(change, node);
+    if (strcmp(new_node->key, node->key) < 0)
+        node->left = insert_node(change, node->left, new_node);
+    else
+        node->right = insert_node(change, node->right, new_node);
+    return rebalance(change, node);
+}
+
+bool sset_insert(SortedSet* set, const char* key, void* value)
+{
+    if (find(atomic_load(&set->newest)->root, key))
+        return false; // Already exists.
+    size_t key_length = strlen(key);
+    Node* new_node = malloc(sizeof(Node) + key_length + 1);
+    if (!new_node)
+        return false;
+    new_node->left = NULL;
+    new_node->right = NULL;
+    new_node->height = 1;
+    new_node->version = set->version;
+    new_node->value = value;
+    memcpy(new_node->key, key, key_length + 1);
+
+    Change change;
+    if (!start_change(set, &change)) {
+        free(new_node);
+        return false;
+    }
+    change.state->root = insert_node(&change, change.state->root, new_node);
+    finish_change(&change);
+    set->size++;
+    set->keys_length += key_length;
+    return true;
+}
+
+// Detach the smallest node below `node` into `*min`. Return the new root of the subtree.
+static Node* remove_min(Change* change, Node* node, Node** min)
+{
+    if (!node->left) {
+        *min = node;
+        return node->right;
+    }
+    node = writable(change, node);
+    node->left = remove_min(change, node->left, min);
+    return rebalance(change, node);
+}
+
+// Remove the node with `key` (which is present) below `node` into `*removed`. Return the new root of the subtree.
+static Node* remove_node(Change* change, Node* node, const char* key, Node** removed)
+{
+    int cmp = strcmp(key, node->key);
+    if (cmp == 0) {
+        *removed = node;
+        if (!node->right)
+            return node->left;
+        Node* successor;
+        Node* right = remove_min(change, node->right, &successor);
+        successor = writable(change, successor);
+        successor->left = node->left;
+        successor->right = right;
+        return rebalance(change, successor);
+    }
+    node = writable(change, node);
+    if (cmp < 0)
+        node->left = remove_node(change, node->left, key, removed);
+    else
+        node->right = remove_node(change, node->right, key, removed);
+    return rebalance(change, node);
+}
+
+bool sset_remove(SortedSet* set, const char* key)
+{
+    if (!find(atomic_load(&set->newest)->root, key))
+        return false;
+    Change change;
+    if (!start_change(set, &change))
+        return false;
+    Node* removed = NULL;
+    change.state->root = remove_node(&change, change.state->root, key, &removed);
+    finish_change(&change);
+    set->size--;
+    set->keys_length -= strlen(removed->key);
+    retire(&change, removed);
+    return true;
+}
+
+size_t sset_size(SortedSet* set)
+{
+    return set->size;
+}
+
+size_t sset_keys_length(SortedSet* set)
+{
+    return set->keys_length;
+}
+
+// The root of the state at `version`.
+static Node* root_at(SortedSet* set, unsigned long version)
+{
+    State* state = atomic_load_explicit(&set->newest, memory_order_acquire);
+    while (state->since > version && state->older)
+        state = state->older;
+    return state->root;
+}
+
+void* sset_get_at(SortedSet* set, const char* key, unsigned long version)
+{
+    Node* node = find(root_at(set, version), key);
+    return node ? node->value : NULL;
+}
+
+static SortedSetIterator iterator_from(Node* root, const char* after)
+{
+    SortedSetIterator it;
+    it.depth = 0;
+    // Remember every node on the way down whose key is greater than `after`,
+    // the deepest one is the first key to visit.
+    for (Node* node = root; node;) {
+        if (!after || strcmp(node->key, after) > 0) {
+            it.path[it.depth++] = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return it;
+}
+
+SortedSetIterator sset_iterator(SortedSet* set, const char* after)
+{
+    return iterator_from(atomic_load(&set->newest)->root, after);
+}
+
+SortedSetIterator sset_iterator_at(SortedSet* set, const char* after, unsigned long version)
+{
+    return iterator_from(root_at(set, version), after);
+}
+
+bool sset_next(SortedSet* set, SortedSetIterator* it, const char** key)
+{
+    void* value;
+    return sset_next_value(set, it, key, &value);
+}
+
+bool sset_next_value(SortedSet* set, SortedSetIterator* it, const char** key, void** value)
+{
+    (void)set;
+    if (it->depth == 0)
+        return false;
+    Node* node = it->path[--it->depth];
+    *key = node->key;
+    *value = node->value;
+    for (Node* p = node->right; p; p = p->left)
+        it->path[it->depth++] = p;
+    return true;
+}
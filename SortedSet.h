@@ -0,0 +1,85 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Max height of the tree behind a SortedSet (it is balanced, this is enough for any set that fits in memory).
+#define SSET_MAX_HEIGHT 64
+
+// A set of keys kept in lexicographic (strcmp) order, each with a value.
+// Keys are C-strings (null-terminated char*), all distinct.
+//
+// Older states of the set can be kept for readers that do not lock it (see `sset_set_version`): a change does not
+// modify the nodes of a kept state, it copies them (only the ones on its path), so keeping a state costs memory
+// proportional to the changes made since then.
+typedef struct SortedSet SortedSet;
+
+// Create a new, empty set.
+SortedSet* sset_new();
+
+// Create a set of `n` keys given in increasing order, with their values, at once (in linear time).
+// Return NULL if out of memory. (The set internally uses copies of the keys).
+SortedSet* sset_new_sorted(const char* const keys[], void* const values[], size_t n);
+
+// Clear the set and free its memory, including the keys copied by sset_insert and the kept states.
+void sset_free(SortedSet* set);
+
+// Insert `key` with `value` and return true, or do nothing and return false if `key` is already in the set.
+// (The caller can free `key` at any time - the set internally uses a copy of it).
+bool sset_insert(SortedSet* set, const char* key, void* value);
+
+// Remove `key` and return true, or do nothing and return false if `key` was not present.
+bool sset_remove(SortedSet* set, const char* key);
+
+// Return the number of keys in the set.
+size_t sset_size(SortedSet* set);
+
+// Return the total length of all keys in the set (excluding terminating null characters).
+size_t sset_keys_length(SortedSet* set);
+
+// Make the following changes at `version` (greater than the version of every earlier change), keeping the states
+// of the set at versions from `oldest` to `newest` readable by sset_get_at and sset_iterator_at while they are made.
+// Nothing is kept if `oldest` > `newest`. What was kept only for versions older than `oldest` is freed.
+// Exits the process if it runs out of memory in the middle of a change that copies nodes.
+void sset_set_version(SortedSet* set, unsigned long version, unsigned long oldest, unsigned long newest);
+
+// Free what was kept only for versions older than `oldest`, return whether any older state is still kept.
+bool sset_forget(SortedSet* set, unsigned long oldest);
+
+// Return whether any state older than the current one is kept.
+bool sset_kept(SortedSet* set);
+
+// Return the value of `key` in the state of the set at `version`, or NULL if it was not there.
+// `version` has to be kept (see `sset_set_version`); this may be called at the same time as changes of the set.
+void* sset_get_at(SortedSet* set, const char* key, unsigned long version);
+
+typedef struct SortedSetIterator SortedSetIterator;
+
+// Return an iterator to the first key greater than `after`, or to the first key of the set if `after` is NULL.
+// `after` does not have to be in the set. See `sset_next`.
+SortedSetIterator sset_iterator(SortedSet* set, const char* after);
+
+// Like sset_iterator, but in the state of the set at `version`, which has to be kept (see `sset_get_at`).
+// The set can be changed meanwhile, the keys of the iteration stay valid as long as the state is kept.
+SortedSetIterator sset_iterator_at(SortedSet* set, const char* after, unsigned long version);
+
+// Set `*key` to the current key pointed by the iterator and move the iterator to the next key.
+// If there are no more keys, leaves `*key` unchanged and returns false.
+// Keys are not copied, they are only valid as long as they stay in the set.
+//
+// The set cannot be modified between calls to `sset_iterator` and `sset_next`.
+//
+// Usage: ```
+//     const char* key;
+//     SortedSetIterator it = sset_iterator(set, NULL);
+//     while (sset_next(set, &it, &key))
+//         foo(key);
+// ```
+bool sset_next(SortedSet* set, SortedSetIterator* it, const char** key);
+
+// Like sset_next, but also set `*value` to the value of the key.
+bool sset_next_value(SortedSet* set, SortedSetIterator* it, const char** key, void** value);
+
+struct SortedSetIterator {
+    void* path[SSET_MAX_HEIGHT]; // Nodes whose keys (and right subtrees) are still to be visited.
+    int depth;
+};
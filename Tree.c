@@ -1,12 +1,26 @@
 #include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
+#include "EventRing.h"
 #include "HashMap.h"
+#include "Journal.h"
+#include "NameFilter.h"
 #include "err.h"
 
+#include "PathCache.h"
+#include "Reclaimer.h"
+#include "SortedSet.h"
 #include "Tree.h"
+#include "TreeImage.h"
+#include "WorkPool.h"
 #include "path_utils.h"
 
 
@@ -17,10 +31,108 @@
 //When i reach the destination, then i can proceed to do the operation i wanted to
 //After i finished the operation, i call the function returningFromWork, which marks on every folder i have visited, that the reader/writer
 //has left
+//
+//Handles: the walk does not have to start at "/", it can start at any folder pinned by a TreeHandle. Because of that, a writer on
+//some folder no longer means that nobody else works below it, so every folder whose map is changed is locked as a writer by itself
+//(tree_move locks both parents, not only their latest common ancestor). Folders are reference counted: the parent's map holds one
+//reference and every open handle holds another one, so a removed folder stays in memory (marked as removed) until its last handle
+//is closed
+//
+//Path cache (optional): maps full paths to folders, so that a walk from "/" can start right at its destination, the same way as
+//from a handle. Entries hold references to the folder and to the folders above it, and remember their generations, which change when
+//a folder is removed or moved; so a move (or removal) makes every entry that goes through the folder invalid at once, wherever it
+//was made from, without looking for them. The entry is checked again once the folder is held, as nothing above it is held
+//
+//Versions (for tree_list_since): every name linked into or unlinked from a folder gives it a new version, taken from one counter for
+//all folders, so that a version never means two different states of two folders; the last CHANGE_LOG_LENGTH changes are remembered
+//
+//Watches: every folder keeps a list of its watches, changed only by its writer. An operation tells about its change the watches of the
+//folders it holds anyway (the parent as a writer, the ones above as readers), so recursive watches see only operations that walk through
+//their folder - while there are any, walks do not skip folders through the path cache. Events go into a lock-free ring of every watch
+//
+//Removing: a folder (or a whole subtree) is only taken out of its parent (and its top folder marked as removed) while the parent is held,
+//it is freed later by a background thread of the tree; the rest of the folders of a subtree are marked as removed there, the thread
+//waits for everyone still working in them through handles
+//
+//Listing: operations that only read a folder hold it as a reader, not as a writer, so they can list it at the same time. The listing
+//string is made once and kept in the folder until a subfolder is linked into it or unlinked from it (always by its writer)
+//
+//Snapshots: a snapshot is a version V of the whole tree. Linking and unlinking (the only changes of what can be listed) are counted
+//while they are in progress, and taking a snapshot waits only for the ones in progress, so each change happens either before V or
+//after it. The names of a folder are kept in a SortedSet that keeps its states at the versions of live snapshots, copying its nodes
+//when they change, so snapshots are read without any lock. Folders that keep older states are remembered, to forget them when
+//snapshots are freed, and a removed folder goes to the reclaimer only once no snapshot older than its removal is left
+//
+//Journal (only for trees made by tree_recover): every change is appended to the journal by the writer of the folders it changes, between
+//enteringChange and leavingChange, so the journal has the changes of each folder in their order, and each change is either before or after
+//the version of a snapshot. Folders are named in the journal by ids, given to them when they get into it (paths would not do, operations
+//through handles do not know them). A checkpoint is a snapshot of the tree with the ids; it starts a new segment of the journal before
+//the snapshot is taken, so on replay the changes of that segment that are in the checkpoint already are told apart by their versions
+//
+//Incremental checkpoints: the change that gets into the journal also marks the folders whose names it changed with its version, so an
+//incremental checkpoint writes only the folders marked after the version of the checkpoint before it; finding them still walks the
+//snapshot (there are no links to parents to mark the way from the root), but only they are written. When enough of them pile up, a
+//background thread merges them into the full checkpoint, so that recovery does not have to read them all
+//
+//Asynchronous operations (TreeQueue): run by the threads of their queue through the same walks, but where a blocking operation would
+//wait for a monitor, an asynchronous one returns EAGAIN, keeping everything it holds; then it is parked on the monitor, counted as a
+//waiting reader or writer, so it keeps later operations out the way a waiting thread would. Whoever lets it in (instead of waking a
+//thread) hands it back to its queue, to run it again from the start; the walk goes through the folders it holds without entering them
+//again. The operation is parked only after it has returned, so it never runs on two threads at once
+//
+//Batches (tree_apply_batch): the operations are grouped by the folder they hold (the listed one, or the parent of the created or removed
+//one), and the groups are applied in the sorted order of their folders, so the next group is usually below the folders above the last
+//one; those stay held as readers, and only the part of the path below them is walked. A folder is held once for its whole group, as a
+//writer if anything in it changes. Moves hold folders of their own, so nothing is held while they run
+
+
+//how many names tree_iterate copies while it holds the folder
+#define ITERATE_CHUNK_NAMES 64
+
+//tree_free uses a pool of threads only for trees with at least that many folders
+#define PARALLEL_FREE_FOLDERS 4096
+
+//how many of the latest changes of its names a folder remembers for tree_list_since
+#define CHANGE_LOG_LENGTH 32
+
+//in how many places the changes in progress are counted (by different threads), see enteringChange
+#define CHANGING_COUNTERS 16
+
+//the beginning of a file written by tree_save, see savingFolder
+#define SAVE_MAGIC "dirtree1"
+#define SAVE_MAGIC_LENGTH 8
+
+//how much of a saved tree is buffered before it is written
+#define SAVE_BUFFER_SIZE (1 << 20)
+
+//the beginning of a checkpoint of a journaled tree, see tree_checkpoint
+#define CHECKPOINT_MAGIC "dirckpt1"
+
+//the beginning of an incremental checkpoint, see tree_checkpoint_incremental
+#define INCREMENT_MAGIC "dirincr1"
+
+//after how many incremental checkpoints they are merged into the full one
+#define COMPACT_AFTER_INCREMENTS 8
 
 
 typedef struct Monitor Monitor;
 
+typedef struct Listing Listing;
+
+typedef struct Change Change;
+
+typedef struct ChangeLog ChangeLog;
+
+typedef struct Pending Pending;
+
+typedef struct HeldFolder HeldFolder;
+
+//the result of listing a folder, kept until one of its subfolders is linked or unlinked
+struct Listing {
+    size_t size; //including the null character
+    char text[];
+};
+
 struct Monitor {
     int readerNumber;
     int writerNumber;
@@ -31,13 +143,235 @@ struct Monitor {
     pthread_cond_t toWrite;
     bool writerActive;
     int readerActive;
+    Pending* parked; //asynchronous operations waiting for the monitor, oldest first; they are counted in readerWaiting and writerWaiting
+    int parkedReaders;
+    int parkedWriters;
+    bool parkedWriterLast; //which kind of waiting writer was let in last, when both kinds wait the other one goes next
+};
+
+//a name linked into or unlinked from a folder, which had the version `previous` before that
+struct Change {
+    unsigned long previous;
+    char* name;
+    bool added;
+};
+
+//the latest changes of a folder, oldest first starting at `first`
+struct ChangeLog {
+    Change changes[CHANGE_LOG_LENGTH];
+    int first;
+    int count;
 };
 
 struct Tree {
     HashMap* subfolders;
+    SortedSet* names; //the keys of subfolders in order (with the subfolders), so that listing does not have to sort them
     Monitor* monitor;
+    atomic_int references; //the parent's map, every open handle and every path cache entry
+    atomic_ulong generation; //changed when the folder is removed or moved
+    NameFilter* _Atomic filter; //names of the subfolders, NULL while there are none
+    Listing* _Atomic listing; //made by the first reader that lists the folder, NULL until then
+    unsigned long version; //changed only by the writer of this folder, with every name linked or unlinked
+    ChangeLog* changes; //NULL until the first change
+    TreeWatch* watches; //changed only by the writer of this folder
+    ReclaimLink retired; //for the reclaimer, once the folder is taken out of the tree
+    bool removed; //changed only by the writer of this folder
+    bool kept; //on the list of folders that keep older names for snapshots, changed only by the writer of this folder
+    Tree* nextKept;
+    unsigned long removedAt; //the version of its removal, while it waits for older snapshots to be freed
+    Tree* nextDeferred;
+    unsigned long id; //in the journal of the tree, 0 until the folder gets into it
+    atomic_ulong changedAt; //the version of the latest change of its names that got into the journal (or of its getting into it)
+};
+
+//how many changes are in progress, in its own cache line
+typedef struct Changing Changing;
+
+struct Changing {
+    atomic_int count;
+    char padding[64 - sizeof(atomic_int)];
+};
+
+//the Tree returned by tree_new is a folder with "/" in its map, the things that belong to the whole tree are kept right after it
+typedef struct TreeContext TreeContext;
+
+struct TreeContext {
+    Tree tree;
+    Monitor monitor;
+    PathCache* cache;
+    atomic_int recursiveWatches;
+    Reclaimer* reclaimer;
+    WorkPool* _Atomic pool; //made by the first tree_copy, if there is more than one processor
+    Changing changing[CHANGING_COUNTERS];
+    atomic_bool snapshotting; //a snapshot is being taken, changes wait before they start
+    pthread_mutex_t snapshotMutex; //for taking and freeing snapshots, and the list of deferred folders
+    TreeSnapshot* snapshots; //the live ones, newest first
+    atomic_ulong oldestSnapshot; //ULONG_MAX if there are no snapshots
+    atomic_ulong newestSnapshot; //0 if there are no snapshots
+    Tree* _Atomic kept; //folders that (may) keep older names for snapshots, each one holds a reference
+    Tree* deferred; //removed folders that older snapshots may still read
+    Journal* journal; //NULL unless the tree was made by tree_recover
+    char* journalPath;
+    TreeDurability durability; //of every change
+    atomic_ulong lastId; //given to a folder in the journal
+    pthread_mutex_t checkpointMutex; //for writing checkpoints, and the numbers below
+    unsigned long checkpointed; //the version of the latest checkpoint (of either kind), 0 if there is none
+    unsigned long increment; //the number of the latest incremental checkpoint
+    unsigned long merged; //the number of the latest incremental checkpoint that the full one includes
+    unsigned long fullCheckpoints; //written since the tree was recovered, a merge started before one of them is not needed
+    pthread_t compactor;
+    bool compactorStarted; //then it has to be joined
+    bool compacting; //the compactor is still merging
+};
+
+//where the versions of all folders come from
+static atomic_ulong lastVersion;
+
+//a folder is allocated together with its monitor
+typedef struct FolderMemory FolderMemory;
+
+struct FolderMemory {
+    Tree folder;
+    Monitor monitor;
+};
+
+struct TreeHandle {
+    Tree* tree;
+    Tree* folder;
+};
+
+struct TreeSnapshot {
+    Tree* tree;
+    unsigned long version;
+    TreeSnapshot* next;
+};
+
+struct TreeWatch {
+    Tree* tree;
+    Tree* folder;
+    bool recursive;
+    EventRing* ring;
+    atomic_bool lost; //an event could not be allocated
+    TreeWatch* next; //on the list of the folder
+};
+
+struct TreeQueue {
+    Tree* tree;
+    WorkPool* pool;
+    int fd; //an eventfd, readable while `completed` is not empty
+    pthread_mutex_t mutex;
+    pthread_cond_t idle; //signalled when nothing is in progress anymore
+    size_t inProgress; //submitted and not completed yet
+    Pending* completed; //oldest first
+    Pending* lastCompleted;
 };
 
+//a folder entered by an asynchronous operation, and how
+struct HeldFolder {
+    Tree* folder;
+    bool asWriter;
+};
+
+//an operation submitted to a queue, until its completion is taken
+struct Pending {
+    TreeQueue* queue;
+    char kind; //'l' for listing, 'c' for creating, 'r' for removing, 'm' for moving
+    char* path;
+    char* target; //only for moving
+    Tree* blockedOn; //the folder it could not enter (and holds a reference to), NULL if it has not been stopped by one
+    bool asWriter; //how it wanted to enter that folder
+    HeldFolder* held; //the folders it holds, in the order it entered them; kept while it is parked
+    int heldCount;
+    int replayed; //how many of them the walk has gone through again, since the operation was run again
+    TreeCompletion completion;
+    Pending* next; //on the list of the monitor it is parked on, then on the list of the completed ones
+};
+
+
+//the asynchronous operation run by this thread, NULL while it runs a blocking one
+static _Thread_local Pending* runningPending = NULL;
+
+void resuming(Pending* parked);
+
+void folderHold(void* folder);
+
+
+//whether the asynchronous operation run by this thread lets go of `m` (a blocking one always does): one that could not enter a folder
+//keeps everything it holds while it returns EAGAIN, like a thread that waits for the folder would
+bool lettingGo(Monitor* m){
+    Pending* pending = runningPending;
+    if(pending == NULL){
+        return true;
+    }
+    if(pending->blockedOn != NULL){
+        return false;
+    }
+    for(int h = pending->heldCount - 1; h >= 0; h--){
+        if(pending->held[h].folder->monitor == m){
+            memmove(&pending->held[h], &pending->held[h + 1], (pending->heldCount - h - 1) * sizeof(HeldFolder));
+            pending->heldCount--;
+            if(h < pending->replayed){
+                pending->replayed--;
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+
+//taking the parked operations that `m` is handed to off its list, counted as inside of the monitor: every reader, or the oldest
+//writer; the caller resumes them once it has let go of the mutex
+Pending* grantingParked(Monitor* m, bool writer){
+    Pending* granted = NULL;
+    Pending** last = &granted;
+    Pending** link = &m->parked;
+    while(*link != NULL){
+        Pending* pending = *link;
+        if(pending->asWriter != writer){
+            link = &pending->next;
+            continue;
+        }
+        *link = pending->next;
+        pending->next = NULL;
+        *last = pending;
+        last = &pending->next;
+        if(writer){
+            m->writerWaiting--;
+            m->parkedWriters--;
+            m->writerNumber++;
+            break;
+        }
+        m->readerWaiting--;
+        m->parkedReaders--;
+        m->readerNumber++;
+    }
+    return granted;
+}
+
+
+//letting in one of the writers that wait for `m`, a parked one or a waiting thread
+Pending* handingToWriter(Monitor* m){
+    bool threads = m->writerWaiting > m->parkedWriters;
+    if(m->parkedWriters > 0 && (threads == false || m->parkedWriterLast == false)){
+        m->parkedWriterLast = true;
+        return grantingParked(m, true);
+    }
+    m->parkedWriterLast = false;
+    m->writerActive = true;
+    pthread_cond_signal(&m->toWrite);
+    return NULL;
+}
+
+
+//letting in every reader that waits for `m`
+Pending* handingToReaders(Monitor* m){
+    Pending* granted = grantingParked(m, false);
+    m->readerActive = m->readerWaiting;
+    pthread_cond_broadcast(&m->toRead);
+    return granted;
+}
+
 
 void readerStart(Monitor* m){
     pthread_mutex_lock(&m->mutex);
@@ -55,17 +389,20 @@ void readerStart(Monitor* m){
 }
 
 void readerEnd(Monitor* m){
+    if(lettingGo(m) == false){
+        return;
+    }
     pthread_mutex_lock(&m->mutex);
     m->readerNumber--;
+    Pending* granted = NULL;
     if(m->readerNumber == 0 && m->readerActive == 0 && m->writerNumber == 0 && m->writerWaiting > 0 ){
-        m->writerActive = true;
-        pthread_cond_signal(&m->toWrite);
+        granted = handingToWriter(m);
     }
     else if(m->readerNumber == 0 && m->writerNumber == 0){
-        m->readerActive = m->readerWaiting;
-        pthread_cond_broadcast(&m->toRead);
+        granted = handingToReaders(m);
     }
     pthread_mutex_unlock(&m->mutex);
+    resuming(granted);
 }
 
 void writerStart(Monitor* m){
@@ -84,17 +421,92 @@ void writerStart(Monitor* m){
 }
 
 void writerEnd(Monitor* m){
+    if(lettingGo(m) == false){
+        return;
+    }
     pthread_mutex_lock(&m->mutex);
     m->writerNumber--;
+    Pending* granted = NULL;
     if(m->readerWaiting > 0 && m->writerNumber == 0 && m->readerNumber == 0){
-        m->readerActive = m->readerWaiting;
-        pthread_cond_broadcast(&m->toRead);
+        granted = handingToReaders(m);
     }
     else if(m->writerNumber == 0 && m->writerWaiting > 0 && m->readerNumber == 0){
-        m->writerActive = true;
-        pthread_cond_signal(&m->toWrite);
+        granted = handingToWriter(m);
+    }
+    pthread_mutex_unlock(&m->mutex);
+    resuming(granted);
+}
+
+
+//whether readerStart (or writerStart) would enter the monitor without waiting; the caller holds its mutex
+bool mayEnter(Monitor* m, bool asWriter){
+    if(m->writerNumber > 0 || m->writerWaiting > 0){
+        return false;
+    }
+    return asWriter == false || (m->readerNumber == 0 && m->readerWaiting == 0);
+}
+
+
+//letting go of the folders held by the asynchronous operation run by this thread that the walk has not gone through again
+void lettingGoRest(Pending* pending){
+    while(pending->heldCount > pending->replayed){
+        HeldFolder* last = &pending->held[pending->heldCount - 1];
+        if(last->asWriter){
+            writerEnd(last->folder->monitor);
+        }
+        else{
+            readerEnd(last->folder->monitor);
+        }
+    }
+}
+
+
+//readerStart or writerStart on the monitor of `folder`, but an asynchronous operation does not wait: if it cannot enter right away,
+//it remembers the folder (and holds it, so that it is not freed) to be parked on it, and false is returned - then the walk returns
+//EAGAIN, and what it lets go of on the way stays held (see lettingGo). When it is run again, the walk enters the folders it
+//holds in the same order (nobody can change the maps of the folders above them), and these are simply gone through
+bool entering(Tree* folder, bool asWriter){
+    Pending* pending = runningPending;
+    if(pending == NULL){
+        if(asWriter){
+            writerStart(folder->monitor);
+        }
+        else{
+            readerStart(folder->monitor);
+        }
+        return true;
+    }
+    if(pending->blockedOn != NULL){
+        return false;
+    }
+    if(pending->replayed < pending->heldCount){
+        HeldFolder* next = &pending->held[pending->replayed];
+        if(next->folder == folder && next->asWriter == asWriter){
+            pending->replayed++;
+            return true;
+        }
+        lettingGoRest(pending); //the walk went another way this time
+    }
+    Monitor* m = folder->monitor;
+    pthread_mutex_lock(&m->mutex);
+    bool entered = mayEnter(m, asWriter);
+    if(entered && asWriter){
+        m->writerNumber++;
+    }
+    else if(entered){
+        m->readerNumber++;
     }
     pthread_mutex_unlock(&m->mutex);
+    if(entered){
+        pending->held[pending->heldCount++] = (HeldFolder) {folder, asWriter};
+        pending->replayed = pending->heldCount;
+    }
+    else{
+        folderHold(folder);
+        pending->blockedOn = folder;
+        pending->asWriter = asWriter;
+    }
+    return entered;
 }
 
 
@@ -145,6 +557,9 @@ char* latestCommonAncestor(const char* path1, const char* path2){
     }
 
     char* path = malloc(sizeof(char)*(commonLen + 1));
+    if(path == NULL){
+        return NULL;
+    }
     strncpy(path, path1, commonLen);
     path[commonLen] = '\0';
 
@@ -154,6 +569,9 @@ char* latestCommonAncestor(const char* path1, const char* path2){
 
 
 void returningFromWork(Tree* foldersArray[], int lastPointersIndex, bool isSuccesful){
+    if(lastPointersIndex < 0){ //nothing was visited (walk that started at an already held folder)
+        return;
+    }
     if(isSuccesful){ //isSuccesful means, that the operation did not end with any error thus we managed to get to the final destination
         writerEnd(foldersArray[lastPointersIndex]->monitor);
         for(int i = lastPointersIndex - 1; i >= 0; i--){
@@ -168,85 +586,107 @@ void returningFromWork(Tree* foldersArray[], int lastPointersIndex, bool isSucce
 }
 
 
-
-//following the sequence of folders, eventually waiting on them, in order (hopefully) to reach the final destination
-int goingToWork(Tree* tree, const char* path, Tree* foldersArray[], int* i){
-    *i = 0;
-    Tree* pointer = tree;
-    pointer = hmap_get(pointer->subfolders, "/"); //moving to subfolders of "/" (first pointer at NULL)
-    foldersArray[*i] = pointer;
-    if(strlen(path) == 1){
-        writerStart(pointer->monitor);
-        return 0;
-    }
-
-    char folderTarget[MAX_FOLDER_NAME_LENGTH + 1];
-    char* pathToParent = make_path_to_parent(path, folderTarget);
-    size_t len = strlen(pathToParent);
+//whether `name` may be a subfolder; read without any lock, we only have to be sure that the folder is not freed meanwhile
+bool mayContain(Tree* folder, const char* name){
+    return nfilter_may_contain(atomic_load(&folder->filter), name);
+}
 
 
-    if(len == 1){ //path to parent like "/", we block the parent to make sure we can pursue any action on a child and the object is not going to disappear
-        readerStart(pointer->monitor);
-        pointer = hmap_get(pointer->subfolders, folderTarget);
-        if(pointer == NULL){
-            free(pathToParent);
-            return ENOENT; //subfolder not present
+//following the sequence of folders below `from`, which the caller already holds, so it is neither locked again nor put into the array
+//every folder on the way is entered as a reader, the last one as a writer (unless `asWriter` is false, then it is a reader too,
+//and returningFromWork has to be told that the operation was not succesful); on ENOENT everything visited so far is released (on
+//EAGAIN it is let go of the same way, but stays held, see entering); if `path` is "/" (or on failure) nothing is held and *i is -1
+//`expected` (or NULL) is a name the destination has to contain for the operation to make sense; like the next name on the path,
+//it is checked with the folder's filter before we wait for the folder, so that missing paths fail without locking the last level
+int goingFurther(Tree* from, const char* path, const char* expected, bool asWriter, Tree* foldersArray[], int* i){
+    *i = -1;
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    const char* subpath = split_path(path, component);
+    Tree* pointer = from;
+    while(subpath != NULL){
+        Tree* folder = hmap_get(pointer->subfolders, component);
+        if(folder == NULL){
+            returningFromWork(foldersArray, *i, false);
+            *i = -1;
+            return ENOENT;
+        }
+        subpath = split_path(subpath, component);
+        const char* next = subpath != NULL ? component : expected;
+        if(next != NULL && mayContain(folder, next) == false){ //the folder cannot go away, we still hold its parent
+            returningFromWork(foldersArray, *i, false);
+            *i = -1;
+            return ENOENT;
+        }
+        if(entering(folder, subpath == NULL && asWriter) == false){ //the last one as a writer: final destination
+            returningFromWork(foldersArray, *i, false);
+            *i = -1;
+            return EAGAIN;
         }
-        writerStart(pointer->monitor);
         (*i)++;
-        foldersArray[*i] = pointer;
-        free(pathToParent);
-        return 0;
+        foldersArray[*i] = folder;
+        pointer = folder;
     }
+    return 0;
+}
 
 
-    readerStart(pointer->monitor);
-    const char* name_start = pathToParent + 1; //element after "/"
-    while (name_start < pathToParent + len) {
-        char* name_end = strchr(name_start, '/'); // end of current path component, at '/'.
-        int lenTemp = 0;
-        for (const char* p = name_start; p != name_end; ++p){
-            lenTemp++;
+//following the sequence of folders, eventually waiting on them, in order (hopefully) to reach the final destination
+//`start` is the folder that `path` is relative to ("/" for the whole tree, or the folder of a handle), `path` has to be valid
+//on success foldersArray[0..*i] are held (the last one as a writer, if `asWriter`), on ENOENT (or EAGAIN, as in goingFurther) nothing is held
+//`expected` and `asWriter` are as in goingFurther
+int goingToWork(Tree* start, const char* path, const char* expected, bool asWriter, Tree* foldersArray[], int* i){
+    *i = 0;
+    foldersArray[*i] = start;
+    if(strlen(path) == 1){
+        if(expected != NULL && mayContain(start, expected) == false){
+            return ENOENT;
         }
-
-        char folderName[lenTemp + 1];
-        strncpy(folderName, name_start, lenTemp);
-        folderName[lenTemp] = '\0';
-
-        pointer = hmap_get(pointer->subfolders, folderName);
-        if(pointer == NULL){
-            free(pathToParent);
+        if(entering(start, asWriter) == false){
+            return EAGAIN;
+        }
+        if(start->removed){ //only possible for the folder of a handle
+            returningFromWork(foldersArray, 0, asWriter);
             return ENOENT;
         }
-        (*i)++;
-        foldersArray[*i] = pointer; //adding folder to array
-        readerStart(pointer->monitor);
-        name_start = name_end + 1;
+        return 0;
     }
 
-
-    Tree* folder = hmap_get(pointer->subfolders, folderTarget);
-    if(folder == NULL){
-        free(pathToParent);
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    split_path(path, component);
+    if(mayContain(start, component) == false){
         return ENOENT;
     }
-    (*i)++;
-    foldersArray[*i] = folder; //adding another folder to my array
-    writerStart(folder->monitor);
-    free(pathToParent);
+    if(entering(start, false) == false){
+        return EAGAIN;
+    }
+    if(start->removed){
+        readerEnd(start->monitor);
+        return ENOENT;
+    }
+    int further;
+    int err = goingFurther(start, path, expected, asWriter, foldersArray + 1, &further);
+    if(err != 0){
+        readerEnd(start->monitor);
+        return err;
+    }
+    *i += further + 1;
     return 0;
 }
 
 
 //initializing all of the monitors components
-void monitorInitialization(Tree* tree){
-    tree->monitor = malloc(sizeof(Monitor));
+void monitorInitialization(Tree* tree, Monitor* monitor){
+    tree->monitor = monitor;
     tree->monitor->readerNumber = 0;
     tree->monitor->writerNumber = 0;
     tree->monitor->writerWaiting = 0;
     tree->monitor->readerWaiting = 0;
     tree->monitor->readerActive = 0;
     tree->monitor->writerActive = false;
+    tree->monitor->parked = NULL;
+    tree->monitor->parkedReaders = 0;
+    tree->monitor->parkedWriters = 0;
+    tree->monitor->parkedWriterLast = false;
     if (pthread_mutex_init(&tree->monitor->mutex, 0) != 0){
         perror("Mutex failed\n");
         exit(1);
@@ -262,471 +702,3454 @@ void monitorInitialization(Tree* tree){
 }
 
 
-Tree* tree_new(){
-    Tree* tree = (Tree*) malloc(sizeof(Tree));
-    if (!tree){
+//new empty folder, with the one reference that belongs to its parent's map; NULL if out of memory
+Tree* folderNew(){
+    FolderMemory* memory = malloc(sizeof(FolderMemory));
+    if(!memory){
+        return NULL;
+    }
+    Tree* folder = &memory->folder;
+    folder->subfolders = hmap_new();
+    folder->names = sset_new();
+    if(folder->subfolders == NULL || folder->names == NULL){
+        if(folder->subfolders != NULL){
+            hmap_free(folder->subfolders);
+        }
+        if(folder->names != NULL){
+            sset_free(folder->names);
+        }
+        free(memory);
         return NULL;
     }
-    HashMap* map = hmap_new();
-    tree->subfolders = map;
+    monitorInitialization(folder, &memory->monitor);
+    atomic_init(&folder->references, 1);
+    atomic_init(&folder->generation, 0);
+    atomic_init(&folder->filter, NULL);
+    atomic_init(&folder->listing, NULL);
+    folder->version = atomic_fetch_add(&lastVersion, 1) + 1;
+    folder->changes = NULL;
+    folder->watches = NULL;
+    folder->removed = false;
+    folder->kept = false;
+    folder->id = 0;
+    atomic_init(&folder->changedAt, folder->version);
+    return folder;
+}
 
-    monitorInitialization(tree);
 
-    Tree* child = (Tree*) malloc(sizeof(Tree));
+void folderFree(Tree* folder){
+    pthread_mutex_destroy(&folder->monitor->mutex);
+    pthread_cond_destroy(&folder->monitor->toRead);
+    pthread_cond_destroy(&folder->monitor->toWrite);
+    hmap_free(folder->subfolders);
+    sset_free(folder->names);
+    nfilter_free(atomic_load(&folder->filter));
+    free(atomic_load(&folder->listing));
+    if(folder->changes != NULL){
+        for(int c = 0; c < folder->changes->count; c++){
+            free(folder->changes->changes[(folder->changes->first + c) % CHANGE_LOG_LENGTH].name);
+        }
+        free(folder->changes);
+    }
+    free(folder); //with its monitor
+}
 
-    child->subfolders = hmap_new();
-    hmap_insert(map, "/", child);
 
-    monitorInitialization(child);
-    return tree;
+//dropping one reference, the last one frees the (already removed, thus empty) folder
+void folderRelease(Tree* folder){
+    if(atomic_fetch_sub(&folder->references, 1) == 1){
+        folderFree(folder);
+    }
 }
 
 
-void tree_free(Tree* tree){
-    HashMap* map = tree->subfolders;
-    if(hmap_size(map) == 0){
-        pthread_mutex_destroy(&tree->monitor->mutex);
-        pthread_cond_destroy(&tree->monitor->toRead);
-        pthread_cond_destroy(&tree->monitor->toWrite);
-        free(tree->monitor);
-        hmap_free(map);
-        free(tree);
+//giving `folder` (of which we are the writer) a new version, return the one it had
+unsigned long advancingVersion(Tree* folder){
+    unsigned long previous = folder->version;
+    folder->version = atomic_fetch_add(&lastVersion, 1) + 1;
+    return previous;
+}
+
+
+//remembering what has changed at the new version of `folder` (of which we are the writer), which had the version `previous` before;
+//without memory it is not remembered, which makes every earlier version of the folder too old for tree_list_since
+void recordingChange(Tree* folder, unsigned long previous, const char* name, bool added){
+    if(folder->changes == NULL){
+        folder->changes = malloc(sizeof(ChangeLog));
+        if(folder->changes == NULL){
+            return;
+        }
+        folder->changes->first = 0;
+        folder->changes->count = 0;
+    }
+    ChangeLog* log = folder->changes;
+    char* copy = strdup(name);
+    if(copy == NULL){ //forgetting everything, the log must not have gaps
+        for(int c = 0; c < log->count; c++){
+            free(log->changes[(log->first + c) % CHANGE_LOG_LENGTH].name);
+        }
+        log->first = 0;
+        log->count = 0;
         return;
     }
-    const char* key;
-    void* value;
-    HashMapIterator it = hmap_iterator(map);
-    while (hmap_next(map, &it, &key, &value)){
-        tree_free(value);
-        hmap_remove(map, key);
+    Change* change;
+    if(log->count == CHANGE_LOG_LENGTH){ //forgetting the oldest one
+        change = &log->changes[log->first];
+        free(change->name);
+        log->first = (log->first + 1) % CHANGE_LOG_LENGTH;
     }
-    pthread_mutex_destroy(&tree->monitor->mutex);
-    pthread_cond_destroy(&tree->monitor->toRead);
-    pthread_cond_destroy(&tree->monitor->toWrite);
-    free(tree->monitor);
-    hmap_free(map);
-    free(tree);
+    else{
+        change = &log->changes[(log->first + log->count) % CHANGE_LOG_LENGTH];
+        log->count++;
+    }
+    change->previous = previous;
+    change->name = copy;
+    change->added = added;
 }
 
 
-char* tree_list(Tree* tree, const char* path){
-    size_t helpme = strlen(path);
-    Tree* foldersArray[helpme]; //arrary with pointer to folders, in which we changed sth in their monitor
-    int i;
+void folderHold(void* folder);
 
-    if(goingToWork(tree, path, foldersArray, &i) == ENOENT){
-        returningFromWork(foldersArray, i, false);
-        return NULL;
-    }
+TreeContext* contextOf(Tree* tree);
 
 
-    if(is_path_valid(path) == false){
-        returningFromWork(foldersArray, i, true);
-        return NULL;
+//the names of `folder` (of which we are the writer) are about to change at its new version; their states at the versions of the
+//live snapshots of `tree` are kept (if `tree` is NULL, nobody else sees the folder yet)
+void versioningNames(Tree* tree, Tree* folder){
+    if(tree == NULL){
+        sset_set_version(folder->names, folder->version, ULONG_MAX, 0);
+        return;
     }
+    TreeContext* context = contextOf(tree);
+    sset_set_version(folder->names, folder->version, atomic_load(&context->oldestSnapshot), atomic_load(&context->newestSnapshot));
+}
 
-    size_t len = strlen(path);
 
-    if(len == 1){ //path like "/", only direct subfolders
-        Tree* pointer = tree;
-        pointer = hmap_get(pointer->subfolders, "/"); //moving to subfolders of "/" (first pointer at NULL)
-        HashMap* rootMap = pointer->subfolders; //map of roots subfolders
-        char* stringMap = make_map_contents_string(rootMap);
-        returningFromWork(foldersArray, i, true);
-        return stringMap;
+//putting `folder` on the list of folders that keep older names, unless it is there already (we are its writer, or it is not in the
+//tree anymore); the list is changed without a lock, as it is done while snapshots wait for the change
+void rememberingKept(TreeContext* context, Tree* folder){
+    Tree* head = atomic_load(&context->kept);
+    do{
+        folder->nextKept = head;
+    } while(atomic_compare_exchange_weak(&context->kept, &head, folder) == false);
+}
+
+
+//after changing the names of `folder` (of which we are the writer)
+void keepingNames(Tree* tree, Tree* folder){
+    if(tree == NULL || folder->kept || sset_kept(folder->names) == false){
+        return;
     }
+    folder->kept = true;
+    folderHold(folder);
+    rememberingKept(contextOf(tree), folder);
+}
 
-    const char* name_start = path + 1; //element after "/"
 
-    Tree* pointer = tree;
-    pointer = hmap_get(pointer->subfolders, "/");
-    while (name_start < path + len) {
-        char* name_end = strchr(name_start, '/'); // End of current path component, at '/'.
-        char temp[255];
-        int lenTemp = 0;
-        for (const char* p = name_start; p != name_end; ++p){
-            temp[lenTemp] = *p;
-            lenTemp++;
+//putting `folder` into the map of `parent` under `name`, false if out of memory (then nothing is changed)
+//the filter learns the name first, so that it never rejects a folder that is already there
+bool addingName(Tree* parent, const char* name, Tree* folder){
+    NameFilter* filter = atomic_load(&parent->filter);
+    size_t size = hmap_size(parent->subfolders) + 1;
+    if(nfilter_capacity(filter) < size){ //a bigger filter, the old one is freed together with it (someone may still be reading it)
+        NameFilter* bigger = nfilter_new(2 * size, filter);
+        if(bigger == NULL && filter == NULL){
+            return false;
         }
-        char folderName[lenTemp];
-        memcpy(folderName, temp, lenTemp);
-        pointer = hmap_get(pointer->subfolders, folderName);
-        if(pointer == NULL){
-            returningFromWork(foldersArray, i, true);
-            return NULL;
+        const char* key;
+        void* value;
+        HashMapIterator it = hmap_iterator(parent->subfolders);
+        while (bigger != NULL && hmap_next(parent->subfolders, &it, &key, &value)){
+            nfilter_add(bigger, key);
+        }
+        if(bigger != NULL){ //otherwise the old one is kept, too small it only rejects fewer missing names
+            atomic_store(&parent->filter, bigger);
+            filter = bigger;
         }
-        name_start = name_end + 1;
     }
-
-    HashMap* map = pointer->subfolders;
-    char* res = make_map_contents_string(map);
-    returningFromWork(foldersArray, i, true);
-    return res;
+    nfilter_add(filter, name);
+    if(hmap_insert(parent->subfolders, name, folder) == false){
+        nfilter_remove(filter, name);
+        return false;
+    }
+    return true;
 }
 
 
-int tree_create(Tree* tree, const char* path){
-    size_t helpme = strlen(path);
-    Tree* foldersArray[helpme];
-    int i;
+//taking `name` out of the map of `parent` and out of its filter
+void removingName(Tree* parent, const char* name){
+    hmap_remove(parent->subfolders, name);
+    nfilter_remove(atomic_load(&parent->filter), name);
+}
 
-    if(strlen(path) == 1){ //path = "/"
-        return EEXIST;
-    }
 
-    char ehhh[MAX_FOLDER_NAME_LENGTH + 1];
-    char* pathToParent = make_path_to_parent(path, ehhh);
-    if(goingToWork(tree, pathToParent, foldersArray, &i) == ENOENT){
-        free(pathToParent);
-        returningFromWork(foldersArray, i, false);
-        return ENOENT;
+//putting `folder` into `parent` (of which we are the writer) under `name`
+//`tree` is the tree of `parent`, or NULL if nobody else sees `parent` yet; changes of the tree happen between enteringChange and leavingChange
+//return 0, or ENOMEM (then nothing is changed)
+int linking(Tree* tree, Tree* parent, const char* name, Tree* folder){
+    if(addingName(parent, name, folder) == false){
+        return ENOMEM;
     }
-
-    free(pathToParent);
-    if(is_path_valid(path) == false){
-        returningFromWork(foldersArray, i, true);
-        return EINVAL;
+    unsigned long previous = advancingVersion(parent);
+    versioningNames(tree, parent);
+    if(sset_insert(parent->names, name, folder) == false){ //nobody has seen the new version, the folder gets its old one back
+        parent->version = previous;
+        removingName(parent, name);
+        return ENOMEM;
     }
+    recordingChange(parent, previous, name, true);
+    keepingNames(tree, parent);
+    free(atomic_exchange(&parent->listing, NULL)); //no reader can be using it, we are the writer
+    return 0;
+}
 
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    char* newPath = make_path_to_parent(path, component);
-    size_t len = strlen(newPath);
-    if(len == 1){ //path like "/"
-        Tree* pointer = tree;
-        pointer = hmap_get(pointer->subfolders, "/");
-        if(hmap_get(pointer->subfolders, component) != NULL){
-            free(newPath);
-            returningFromWork(foldersArray, i, true);
-            return EEXIST;
-        }
-        Tree* newFolder = (Tree*) malloc(sizeof(Tree));
-        char temp[MAX_FOLDER_NAME_LENGTH + 1];
-        strncpy(temp, component, MAX_FOLDER_NAME_LENGTH + 1);
-        newFolder->subfolders = hmap_new();
-        hmap_insert(pointer->subfolders, component, newFolder);
-        monitorInitialization(newFolder);
-        free(newPath);
-        returningFromWork(foldersArray, i, true);
-        return 0;
-    }
 
-    const char* name_start = newPath + 1; //element after "/"
-    Tree* pointer = tree;
-    pointer = hmap_get(pointer->subfolders, "/");
+//linking into a new folder that nobody has seen yet (a copy, or a chain of missing folders): it gets no new version nor change log, its
+//names are how everyone sees it first; return 0 or ENOMEM, like linking
+int attaching(Tree* parent, const char* name, Tree* folder){
+    if(addingName(parent, name, folder) == false){
+        return ENOMEM;
+    }
+    if(sset_insert(parent->names, name, folder) == false){
+        removingName(parent, name);
+        return ENOMEM;
+    }
+    return 0;
+}
 
-    while (name_start < newPath + len) {
-        char* name_end = strchr(name_start, '/'); // End of current path component, at '/'.
-        int lenTemp = 0; //name length of the current folder
-        for (const char* p = name_start; p != name_end; ++p){
-            lenTemp++;
-        }
 
-        char folderName[lenTemp + 1];
-        strncpy(folderName, name_start, lenTemp);
-        folderName[lenTemp] = '\0';
+//taking the folder `name` out of the map of `parent` (of which we are the writer), `tree` as in linking
+void unlinking(Tree* tree, Tree* parent, const char* name){
+    unsigned long previous = advancingVersion(parent);
+    recordingChange(parent, previous, name, false);
+    versioningNames(tree, parent);
+    sset_remove(parent->names, name);
+    keepingNames(tree, parent);
+    removingName(parent, name);
+    free(atomic_exchange(&parent->listing, NULL));
+}
 
-        pointer = hmap_get(pointer->subfolders, folderName);
-        if(pointer == NULL){
-            free(newPath);
-            returningFromWork(foldersArray, i, true);
-            return ENOENT;
-        }
-        name_start = name_end + 1;
-    }
 
+void folderHold(void* folder){
+    atomic_fetch_add(&((Tree*) folder)->references, 1);
+}
 
-    HashMap* map = pointer->subfolders;
-    if(hmap_get(map, component) != NULL){
-        free(newPath);
-        returningFromWork(foldersArray, i, true);
-        return EEXIST;
-    }
 
-    Tree* node = (Tree*) malloc(sizeof(Tree));
-    char temp2[MAX_FOLDER_NAME_LENGTH + 1]; //memory allocation for new name
-    strncpy(temp2, component, MAX_FOLDER_NAME_LENGTH + 1);
-    node->subfolders = hmap_new();
-    hmap_insert(map, component, node);
-    monitorInitialization(node);
-    free(newPath);
-    returningFromWork(foldersArray, i, true);
-    return 0;
+void folderDrop(void* folder){
+    folderRelease(folder);
 }
 
 
+unsigned long folderGeneration(void* folder){
+    return atomic_load(&((Tree*) folder)->generation);
+}
 
-int tree_remove(Tree* tree, const char* path){
-    size_t helpme = strlen(path);
-    Tree* foldersArray[helpme];
-    int i;
 
-    size_t lenCheck = strlen(path);
-    if(lenCheck == 1){ //root given
-        return EBUSY;
-    }
+Tree* rootOf(Tree* tree){
+    return hmap_get(tree->subfolders, "/");
+}
 
-    char ehhh[MAX_FOLDER_NAME_LENGTH + 1];
-    char* pathToParent = make_path_to_parent(path, ehhh);
-    if(goingToWork(tree, pathToParent, foldersArray, &i) == ENOENT){
-        free(pathToParent);
-        returningFromWork(foldersArray, i, false);
-        return ENOENT;
-    }
 
-    free(pathToParent);
+TreeContext* contextOf(Tree* tree){
+    return (TreeContext*) tree;
+}
 
-    if(is_path_valid(path) == false){
-        returningFromWork(foldersArray, i, true);
-        return EINVAL;
-    }
 
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    char* newPath = make_path_to_parent(path, component);
-    size_t len = strlen(newPath);
+//which counter of the changes in progress this thread uses
+static _Thread_local int changingCounter = -1;
 
+static atomic_int lastChangingCounter;
 
-    if(len == 1){ //path to parent like "/"
-        Tree* pointer = tree;
-        pointer = hmap_get(pointer->subfolders, "/");
-        Tree* folderToRemove
-        = hmap_get(pointer->subfolders, component);
-        if(folderToRemove == NULL){
-            free(newPath);
-            returningFromWork(foldersArray, i, true);
-            return ENOENT;
-        }
-        HashMap* foldersMap = folderToRemove->subfolders;
-        if(hmap_size(foldersMap) != 0){
-            free(newPath);
+
+//a change of the tree (linking or unlinking folders held as writers) starts; while a snapshot is being taken it waits, so that
+//the change is made either entirely before the version of the snapshot or entirely after it
+void enteringChange(Tree* tree){
+    TreeContext* context = contextOf(tree);
+    if(changingCounter < 0){
+        changingCounter = atomic_fetch_add(&lastChangingCounter, 1) % CHANGING_COUNTERS;
+    }
+    atomic_int* count = &context->changing[changingCounter].count;
+    for(;;){
+        atomic_fetch_add(count, 1);
+        if(atomic_load(&context->snapshotting) == false){
+            return;
+        }
+        atomic_fetch_sub(count, 1);
+        while(atomic_load(&context->snapshotting)){
+            sched_yield();
+        }
+    }
+}
+
+
+void leavingChange(Tree* tree){
+    atomic_fetch_sub(&contextOf(tree)->changing[changingCounter].count, 1);
+}
+
+
+//handing a removed folder (unlinked at `version`) over to the reclaimer, unless a snapshot older than that may still read it,
+//then it is handed over when such snapshots are freed
+void retiring(Tree* tree, Tree* folder, unsigned long version){
+    TreeContext* context = contextOf(tree);
+    pthread_mutex_lock(&context->snapshotMutex);
+    if(atomic_load(&context->oldestSnapshot) < version){
+        folder->removedAt = version;
+        folder->nextDeferred = context->deferred;
+        context->deferred = folder;
+        pthread_mutex_unlock(&context->snapshotMutex);
+        return;
+    }
+    pthread_mutex_unlock(&context->snapshotMutex);
+    reclaimer_retire(context->reclaimer, &folder->retired); //together with the reference of the parent's map
+}
+
+
+void savingNumber(FILE* file, size_t number);
+
+void savingName(FILE* file, const char* name);
+
+void savingFolder(FILE* file, Tree* folder, unsigned long version, bool withIds);
+
+
+//giving ids to `folder` and everything inside of it, a subtree that gets into the journal right now with the change at `version`
+void numberingFolders(TreeContext* context, Tree* folder, unsigned long version){
+    folder->id = atomic_fetch_add(&context->lastId, 1) + 1;
+    atomic_store(&folder->changedAt, version); //a copy may have been made before the latest checkpoint
+    const char* key;
+    void* value;
+    HashMapIterator it = hmap_iterator(folder->subfolders);
+    while (hmap_next(folder->subfolders, &it, &key, &value)){
+        numberingFolders(context, value, version);
+    }
+}
+
+
+//Journal records: a letter for the kind of the change, its version (the one of the folder changed last), then the folders it changed
+//as their ids, each one followed by a name written like in a saved tree:
+//- 'l' parent, name, then the folder linked under it with everything inside of it, as savingFolder writes it with ids
+//- 'u' parent, name of the folder unlinked from it
+//- 'm' source parent, name, target parent, name
+//appending the change just made to the journal of the tree (see the comment at the top); `folder` is the linked one, `targetParent`
+//and `target` are only for moves. Return its position in the journal, 0 if the tree has no journal
+uint64_t journaling(Tree* tree, char kind, Tree* parent, const char* name, Tree* folder, Tree* targetParent, const char* target){
+    TreeContext* context = contextOf(tree);
+    if(context->journal == NULL){
+        return 0;
+    }
+    atomic_store(&parent->changedAt, parent->version); //for the next incremental checkpoint
+    if(kind == 'm'){
+        atomic_store(&targetParent->changedAt, targetParent->version);
+    }
+    char* record = NULL;
+    size_t length = 0;
+    FILE* file = open_memstream(&record, &length);
+    if(file == NULL){
+        return journal_append(context->journal, NULL, 0); //the journal fails, it would miss a change
+    }
+    unsigned long version = parent->version;
+    if(kind == 'm' && targetParent->version > version){
+        version = targetParent->version;
+    }
+    putc(kind, file);
+    savingNumber(file, version);
+    savingNumber(file, parent->id);
+    savingName(file, name);
+    if(kind == 'l'){ //nobody else can reach the folder before we let the parent go
+        numberingFolders(context, folder, parent->version);
+        savingFolder(file, folder, ULONG_MAX, true);
+    }
+    if(kind == 'm'){
+        savingNumber(file, targetParent->id);
+        savingName(file, target);
+    }
+    bool failed = ferror(file) != 0;
+    if(fclose(file) != 0){
+        failed = true;
+    }
+    uint64_t position = journal_append(context->journal, failed ? NULL : record, length);
+    free(record);
+    return position;
+}
+
+
+//waiting (after letting the folders go) until the change at `position` in the journal is as durable as the tree asks for
+int waitingForJournal(Tree* tree, uint64_t position){
+    TreeContext* context = contextOf(tree);
+    if(context->journal == NULL){
+        return 0;
+    }
+    return journal_wait(context->journal, position, (JournalDurability) context->durability); //in the same order
+}
+
+
+//goingToWork for operations of the whole tree (or of a handle, when `start` is not the root): when `path` is a full path,
+//the path cache may let us skip the walk and start right at the destination
+int goingToWorkFrom(Tree* tree, Tree* start, const char* path, const char* expected, bool asWriter, Tree* foldersArray[], int* i){
+    PathCache* cache = contextOf(tree)->cache;
+    //an asynchronous operation walks the same way every time it is run again, see entering
+    if(cache == NULL || start != rootOf(tree) || strlen(path) == 1 || atomic_load(&contextOf(tree)->recursiveWatches) > 0
+            || runningPending != NULL){
+        return goingToWork(start, path, expected, asWriter, foldersArray, i);
+    }
+
+    //nothing above the cached folder is held, so one of its ancestors may be moved before we get to it; the entry remembers the
+    //generations of all of them, and the folder is trusted only if it is still valid once we hold the folder (a move changes the
+    //generation of the moved folder before it is unlinked)
+    Tree* folder = pcache_get(cache, path);
+    if(folder != NULL){
+        int err = ENOENT; //then we walk from the start
+        if(expected != NULL && mayContain(folder, expected) == false){
+            if(pcache_check(cache, path, folder)){
+                folderRelease(folder);
+                return ENOENT;
+            }
+        }
+        else{
+            err = goingToWork(folder, "/", NULL, asWriter, foldersArray, i);
+            if(err == 0 && pcache_check(cache, path, folder) == false){
+                returningFromWork(foldersArray, *i, asWriter);
+                err = ENOENT;
+            }
+        }
+        folderRelease(folder);
+        if(err != ENOENT){
+            return err;
+        }
+        //removed or moved after it was found in the cache, maybe there is a new one at that path
+    }
+
+    int err = goingToWork(start, path, expected, asWriter, foldersArray, i);
+    if(err != 0){
+        return err;
+    }
+    //nobody can move nor remove anything on the path while we hold it; the root, which never moves, is left out
+    void* folders[*i];
+    for(int f = 0; f < *i; f++){
+        folders[f] = foldersArray[f + 1];
+    }
+    pcache_insert(cache, path, folders, *i);
+    return 0;
+}
+
+
+//the folder is about to be removed or moved, so the cache entries of the paths that go through it are not valid anymore
+void invalidatingCache(Tree* folder){
+    atomic_fetch_add(&folder->generation, 1);
+}
+
+
+//the pool of the tree, NULL if it does not pay off (there is only one processor)
+WorkPool* poolOf(Tree* tree){
+    TreeContext* context = contextOf(tree);
+    WorkPool* pool = atomic_load(&context->pool);
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(pool != NULL || threads < 2){
+        return pool;
+    }
+    WorkPool* made = wpool_new(threads);
+    if(made == NULL){
+        return NULL;
+    }
+    if(atomic_compare_exchange_strong(&context->pool, &pool, made) == false){ //somebody made it first
+        wpool_free(made);
+        return pool;
+    }
+    return made;
+}
+
+
+//how many folders below the start of `path` its destination is
+int depthOf(const char* path){
+    int depth = 0;
+    for(const char* p = path + 1; *p != '\0'; p++){
+        if(*p == '/'){
+            depth++;
+        }
+    }
+    return depth;
+}
+
+
+//`path` relative to the folder `depth` levels below its start (a suffix of it)
+const char* below(const char* path, int depth){
+    for(int d = 0; d < depth; d++){
+        path = strchr(path + 1, '/');
+    }
+    return path;
+}
+
+
+//telling the watches of `folder` (which we hold, `depth` levels below the start) about `source` disappearing from `sourceParent`
+//and/or `target` appearing in `targetParent` (paths relative to the start, or NULL); a watch that sees both gets a move
+void notifying(Tree* folder, int depth, const char* source, Tree* sourceParent, const char* target, Tree* targetParent){
+    for(TreeWatch* watch = folder->watches; watch != NULL; watch = watch->next){
+        bool seesSource = source != NULL && (watch->recursive || folder == sourceParent);
+        bool seesTarget = target != NULL && (watch->recursive || folder == targetParent);
+        TreeEventType type;
+        const char* path;
+        const char* second = NULL;
+        if(seesSource && seesTarget){
+            type = TREE_EVENT_MOVE;
+            path = below(source, depth);
+            second = below(target, depth);
+        }
+        else if(seesSource){
+            type = TREE_EVENT_REMOVE;
+            path = below(source, depth);
+        }
+        else if(seesTarget){
+            type = TREE_EVENT_CREATE;
+            path = below(target, depth);
+        }
+        else{
+            continue;
+        }
+
+        size_t pathSize = strlen(path) + 1;
+        size_t secondSize = second != NULL ? strlen(second) + 1 : 0;
+        TreeEvent* event = malloc(sizeof(TreeEvent) + pathSize + secondSize); //the paths right after it, freed together
+        if(event == NULL){
+            atomic_store(&watch->lost, true);
+            continue;
+        }
+        char* data = (char*) (event + 1);
+        memcpy(data, path, pathSize);
+        event->type = type;
+        event->path = data;
+        event->target = NULL;
+        if(second != NULL){
+            memcpy(data + pathSize, second, secondSize);
+            event->target = data + pathSize;
+        }
+        if(ering_push(watch->ring, event) == false){
+            free(event);
+        }
+    }
+}
+
+
+//notifying every folder of foldersArray[0..last], the last one being `lastDepth` levels below the start
+void notifyingAll(Tree* foldersArray[], int last, int lastDepth, const char* source, Tree* sourceParent, const char* target, Tree* targetParent){
+    for(int j = last; j >= 0; j--){
+        notifying(foldersArray[j], lastDepth - (last - j), source, sourceParent, target, targetParent);
+    }
+}
+
+
+//marking the folders below `folder` (a removed one, that nobody can change anymore) as removed, then dropping the reference of its
+//parent's map to it; the folders that are not held by anyone else are freed on the way (most of the time, `folder` is empty)
+void reclaimingSubtree(Tree* folder){
+    const char* key;
+    void* value;
+    HashMapIterator it = hmap_iterator(folder->subfolders);
+    while (hmap_next(folder->subfolders, &it, &key, &value)){
+        Tree* child = value;
+        writerStart(child->monitor); //somebody may be working inside of it through a handle
+        child->removed = true;
+        atomic_fetch_add(&child->generation, 1);
+        notifying(child, 0, "/", child, NULL, NULL);
+        writerEnd(child->monitor);
+        reclaimingSubtree(child);
+    }
+    folderRelease(folder);
+}
+
+
+void reclaiming(ReclaimLink* link, void* context){
+    (void) context;
+    reclaimingSubtree((Tree*) ((char*) link - offsetof(Tree, retired)));
+}
+
+
+Tree* tree_new(){
+    TreeContext* context = malloc(sizeof(TreeContext));
+    if (!context){
+        return NULL;
+    }
+    Tree* tree = &context->tree;
+    tree->subfolders = hmap_new();
+    tree->names = NULL; //never listed
+    monitorInitialization(tree, &context->monitor);
+    atomic_init(&tree->references, 1);
+    atomic_init(&tree->generation, 0);
+    atomic_init(&tree->filter, NULL);
+    atomic_init(&tree->listing, NULL);
+    tree->version = 0;
+    tree->changes = NULL;
+    tree->watches = NULL;
+    tree->removed = false;
+    tree->kept = false;
+    tree->id = 0;
+    atomic_init(&tree->changedAt, 0);
+    context->cache = NULL;
+    atomic_init(&context->recursiveWatches, 0);
+    atomic_init(&context->pool, NULL);
+    for(int c = 0; c < CHANGING_COUNTERS; c++){
+        atomic_init(&context->changing[c].count, 0);
+    }
+    atomic_init(&context->snapshotting, false);
+    pthread_mutex_init(&context->snapshotMutex, NULL);
+    context->snapshots = NULL;
+    atomic_init(&context->oldestSnapshot, ULONG_MAX);
+    atomic_init(&context->newestSnapshot, 0);
+    atomic_init(&context->kept, NULL);
+    context->deferred = NULL;
+    context->journal = NULL;
+    context->journalPath = NULL;
+    context->durability = TREE_DURABILITY_NONE;
+    atomic_init(&context->lastId, 0);
+    pthread_mutex_init(&context->checkpointMutex, NULL);
+    context->checkpointed = 0;
+    context->increment = 0;
+    context->merged = 0;
+    context->fullCheckpoints = 0;
+    context->compactorStarted = false;
+    context->compacting = false;
+    context->reclaimer = reclaimer_new(reclaiming, NULL);
+    if(context->reclaimer == NULL){
+        hmap_free(tree->subfolders);
+        free(context);
+        return NULL;
+    }
+
+    Tree* child = folderNew();
+    if(child == NULL){
+        reclaimer_free(context->reclaimer);
+        hmap_free(tree->subfolders);
+        free(context);
+        return NULL;
+    }
+    hmap_insert(tree->subfolders, "/", child);
+    return tree;
+}
+
+
+void freeingTask(WorkPool* pool, void* folder);
+
+
+//freeing `folder` with everything below it; with a pool, every folder that has subfolders of its own is freed by a separate task,
+//so that idle threads can take them over
+void folderFreeRecursively(Tree* folder, WorkPool* pool){
+    const char* key;
+    void* value;
+    HashMapIterator it = hmap_iterator(folder->subfolders);
+    while (hmap_next(folder->subfolders, &it, &key, &value)){
+        Tree* child = value;
+        if(pool == NULL || hmap_size(child->subfolders) == 0 || wpool_submit(pool, freeingTask, child) == false){
+            folderFreeRecursively(child, pool);
+        }
+    }
+    folderFree(folder);
+}
+
+
+void freeingTask(WorkPool* pool, void* folder){
+    folderFreeRecursively(folder, pool);
+}
+
+
+//whether there are at least `limit` folders below `folder`, without counting further than that
+bool hasFolders(Tree* folder, size_t* limit){
+    const char* key;
+    void* value;
+    HashMapIterator it = hmap_iterator(folder->subfolders);
+    while (*limit > 0 && hmap_next(folder->subfolders, &it, &key, &value)){
+        (*limit)--;
+        hasFolders(value, limit);
+    }
+    return *limit == 0;
+}
+
+
+void tree_free(Tree* tree){
+    TreeContext* context = contextOf(tree);
+    if(context->compactorStarted){
+        pthread_join(context->compactor, NULL);
+    }
+    if(context->journal != NULL){ //writing what is left of it
+        journal_close(context->journal);
+    }
+    free(context->journalPath);
+    reclaimer_free(context->reclaimer); //waits for the subtrees that are still being removed
+    if(context->cache != NULL){ //first, as it may hold the last references to removed folders
+        pcache_free(context->cache);
+    }
+    Tree* kept = atomic_load(&context->kept); //there are no snapshots anymore, only the references of the list are left
+    while(kept != NULL){
+        Tree* next = kept->nextKept;
+        folderRelease(kept);
+        kept = next;
+    }
+
+    Tree* root = rootOf(tree);
+    size_t limit = PARALLEL_FREE_FOLDERS;
+    WorkPool* pool = atomic_load(&context->pool);
+    if(pool == NULL && sysconf(_SC_NPROCESSORS_ONLN) > 1 && hasFolders(root, &limit)){
+        pool = wpool_new(sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    if(pool != NULL){
+        if(wpool_submit(pool, freeingTask, root) == false){
+            folderFreeRecursively(root, pool);
+        }
+        wpool_free(pool); //after all of the tasks are done
+    }
+    else{
+        folderFreeRecursively(root, NULL);
+    }
+
+    hmap_free(tree->subfolders);
+    pthread_mutex_destroy(&context->snapshotMutex);
+    pthread_mutex_destroy(&context->checkpointMutex);
+    pthread_mutex_destroy(&tree->monitor->mutex);
+    pthread_cond_destroy(&tree->monitor->toRead);
+    pthread_cond_destroy(&tree->monitor->toWrite);
+    free(context);
+}
+
+
+void tree_enable_path_cache(Tree* tree, size_t capacity){
+    TreeContext* context = contextOf(tree);
+    if(context->cache != NULL){
+        pcache_free(context->cache);
+    }
+    context->cache = pcache_new(capacity, folderHold, folderDrop, folderGeneration);
+}
+
+
+void tree_reclaim_stats(Tree* tree, size_t* queued, size_t* reclaimed, unsigned long* lastLagUs, unsigned long* maxLagUs){
+    reclaimer_stats(contextOf(tree)->reclaimer, queued, reclaimed, lastLagUs, maxLagUs);
+}
+
+
+void tree_path_cache_stats(Tree* tree, size_t* hits, size_t* misses){
+    PathCache* cache = contextOf(tree)->cache;
+    if(cache == NULL){
+        *hits = 0;
+        *misses = 0;
+        return;
+    }
+    pcache_stats(cache, hits, misses);
+}
+
+
+//size of the listing of a folder, the same as make_map_contents_string would give (including the ending null character)
+size_t listingSize(Tree* folder){
+    size_t size = sset_size(folder->names);
+    if(size == 0){
+        return 1;
+    }
+    return sset_keys_length(folder->names) + size; //commas and the null character
+}
+
+
+//writing the sorted, comma-separated names of the subfolders into `buffer` of at least listingSize bytes
+void listingWrite(Tree* folder, char* buffer){
+    char* position = buffer;
+    const char* key;
+    SortedSetIterator it = sset_iterator(folder->names, NULL);
+    while(sset_next(folder->names, &it, &key)){
+        if(position != buffer){
+            *position = ',';
+            position++;
+        }
+        size_t keylen = strlen(key);
+        memcpy(position, key, keylen);
+        position += keylen;
+    }
+    *position = '\0';
+}
+
+
+//the listing of `folder`, of which we are at least a reader; made only once between changes of the folder, even though
+//many readers may ask for it at the same time (the ones that lose the race free their copy); NULL if out of memory
+Listing* listingOf(Tree* folder){
+    Listing* memo = atomic_load(&folder->listing);
+    if(memo != NULL){
+        return memo;
+    }
+    size_t size = listingSize(folder);
+    Listing* made = malloc(sizeof(Listing) + size);
+    if(made == NULL){
+        return NULL;
+    }
+    made->size = size;
+    listingWrite(folder, made->text);
+    if(atomic_compare_exchange_strong(&folder->listing, &memo, made)){
+        return made;
+    }
+    free(made);
+    return memo;
+}
+
+
+char* listing(Tree* tree, Tree* start, const char* path){
+    if(is_path_valid(path) == false){
+        return NULL;
+    }
+
+    size_t helpme = strlen(path);
+    Tree* foldersArray[helpme]; //arrary with pointer to folders, in which we changed sth in their monitor
+    int i;
+    if(goingToWorkFrom(tree, start, path, NULL, false, foldersArray, &i) != 0){
+        return NULL;
+    }
+
+    Listing* memo = listingOf(foldersArray[i]);
+    char* res = NULL;
+    if(memo != NULL){
+        res = malloc(memo->size);
+    }
+    if(res != NULL){
+        memcpy(res, memo->text, memo->size);
+    }
+    returningFromWork(foldersArray, i, false); //we were only a reader
+    return res;
+}
+
+
+int listingInto(Tree* tree, Tree* start, const char* path, char* buffer, size_t capacity, size_t* needed){
+    if(is_path_valid(path) == false){
+        return EINVAL;
+    }
+
+    size_t helpme = strlen(path);
+    Tree* foldersArray[helpme];
+    int i;
+    if(goingToWorkFrom(tree, start, path, NULL, false, foldersArray, &i) == ENOENT){
+        return ENOENT;
+    }
+
+    Listing* memo = listingOf(foldersArray[i]);
+    if(memo == NULL){
+        returningFromWork(foldersArray, i, false); //we were only a reader
+        return ENOMEM;
+    }
+    if(needed != NULL){
+        *needed = memo->size;
+    }
+    if(buffer == NULL || capacity < memo->size){
+        returningFromWork(foldersArray, i, false); //we were only a reader
+        return ERANGE;
+    }
+    memcpy(buffer, memo->text, memo->size);
+    returningFromWork(foldersArray, i, false); //we were only a reader
+    return 0;
+}
+
+
+//errno is set when NULL is returned, as a NULL `*next` means that it was the last page
+char* listingPage(Tree* tree, Tree* start, const char* path, const char* after, size_t limit, char** next){
+    *next = NULL;
+    if(limit == 0 || is_path_valid(path) == false){ //an empty page could not tell if there is more
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t helpme = strlen(path);
+    Tree* foldersArray[helpme];
+    int i;
+    if(goingToWorkFrom(tree, start, path, NULL, false, foldersArray, &i) == ENOENT){
+        errno = ENOENT;
+        return NULL;
+    }
+    SortedSet* names = foldersArray[i]->names;
+
+    //first the size of the page, then the page itself, only `limit` names are visited (after finding the first one)
+    size_t size = 1;
+    size_t count = 0;
+    const char* key;
+    SortedSetIterator it = sset_iterator(names, after);
+    while(count < limit && sset_next(names, &it, &key)){
+        size += strlen(key) + (count > 0 ? 1 : 0);
+        count++;
+    }
+
+    char* res = malloc(size);
+    if(res == NULL){
+        returningFromWork(foldersArray, i, false); //we were only a reader
+        errno = ENOMEM;
+        return NULL;
+    }
+    char* position = res;
+    const char* last = NULL;
+    it = sset_iterator(names, after);
+    for(size_t n = 0; n < count && sset_next(names, &it, &key); n++){
+        if(n > 0){
+            *position = ',';
+            position++;
+        }
+        size_t keylen = strlen(key);
+        memcpy(position, key, keylen);
+        position += keylen;
+        last = key;
+    }
+    *position = '\0';
+
+    if(last != NULL && sset_next(names, &it, &key)){ //there is more, the token is the last name of this page
+        *next = strdup(last);
+        if(*next == NULL){ //without it the page would look like the last one
+            free(res);
+            res = NULL;
+            errno = ENOMEM;
+        }
+    }
+    returningFromWork(foldersArray, i, false); //we were only a reader
+    return res;
+}
+
+
+//sorted, comma-separated `names` (only the first `count` of them), freed by the caller
+char* joining(const char** names, int count){
+    sort_names(names, count);
+    size_t size = 1;
+    for(int n = 0; n < count; n++){
+        size += strlen(names[n]) + (n > 0 ? 1 : 0);
+    }
+    char* res = malloc(size);
+    if(res == NULL){
+        return NULL;
+    }
+    char* position = res;
+    for(int n = 0; n < count; n++){
+        if(n > 0){
+            *position = ',';
+            position++;
+        }
+        size_t keylen = strlen(names[n]);
+        memcpy(position, names[n], keylen);
+        position += keylen;
+    }
+    *position = '\0';
+    return res;
+}
+
+
+//the names added to and removed from `folder` (which we hold) since the change at `from` in its log; a name that changed many times
+//is compared only between then and now, so a name that was added and removed again is not reported at all
+int changesSince(Tree* folder, int from, char** added, char** removed){
+    ChangeLog* log = folder->changes;
+    const char* addedNames[CHANGE_LOG_LENGTH];
+    const char* removedNames[CHANGE_LOG_LENGTH];
+    int addedCount = 0;
+    int removedCount = 0;
+    for(int c = from; c < log->count; c++){
+        Change* change = &log->changes[(log->first + c) % CHANGE_LOG_LENGTH];
+        bool seen = false; //only the first change of a name tells whether it was there at `since`
+        for(int earlier = from; earlier < c && seen == false; earlier++){
+            seen = strcmp(log->changes[(log->first + earlier) % CHANGE_LOG_LENGTH].name, change->name) == 0;
+        }
+        if(seen){
+            continue;
+        }
+        bool before = change->added == false;
+        bool now = hmap_get(folder->subfolders, change->name) != NULL;
+        if(now && before == false){
+            addedNames[addedCount++] = change->name;
+        }
+        else if(before && now == false){
+            removedNames[removedCount++] = change->name;
+        }
+    }
+    *added = joining(addedNames, addedCount);
+    *removed = joining(removedNames, removedCount);
+    if(*added == NULL || *removed == NULL){
+        free(*added);
+        free(*removed);
+        *added = NULL;
+        *removed = NULL;
+        return ENOMEM;
+    }
+    return 0;
+}
+
+
+int listingSince(Tree* tree, Tree* start, const char* path, unsigned long since, unsigned long* version, char** added, char** removed){
+    *added = NULL;
+    *removed = NULL;
+    if(is_path_valid(path) == false){
+        return EINVAL;
+    }
+
+    size_t helpme = strlen(path);
+    Tree* foldersArray[helpme];
+    int i;
+    if(goingToWorkFrom(tree, start, path, NULL, false, foldersArray, &i) == ENOENT){
+        return ENOENT;
+    }
+    Tree* folder = foldersArray[i];
+    *version = folder->version;
+
+    int err = ESTALE;
+    if(since == folder->version){
+        err = 0;
+    }
+    else if(folder->changes != NULL){
+        for(int c = 0; c < folder->changes->count; c++){
+            if(folder->changes->changes[(folder->changes->first + c) % CHANGE_LOG_LENGTH].previous == since){
+                err = changesSince(folder, c, added, removed);
+                break;
+            }
+        }
+    }
+    if(err == ESTALE){ //too old, the whole listing instead
+        Listing* memo = listingOf(folder);
+        *added = memo != NULL ? malloc(memo->size) : NULL;
+        if(*added == NULL){
+            err = ENOMEM;
+        }
+        else{
+            memcpy(*added, memo->text, memo->size);
+        }
+    }
+    returningFromWork(foldersArray, i, false); //we were only a reader
+    return err;
+}
+
+
+//copying the next names (greater than `cursor`, or from the first one if it is NULL) of the folder, which we hold, into `chunk`
+//as consecutive null-terminated strings; return how many were copied, at most ITERATE_CHUNK_NAMES
+int iteratingChunk(Tree* folder, const char* cursor, char chunk[]){
+    int count = 0;
+    char* position = chunk;
+    const char* key;
+    SortedSetIterator it = sset_iterator(folder->names, cursor);
+    while(count < ITERATE_CHUNK_NAMES && sset_next(folder->names, &it, &key)){
+        size_t keylen = strlen(key);
+        memcpy(position, key, keylen + 1);
+        position += keylen + 1;
+        count++;
+    }
+    return count;
+}
+
+
+//the folder is held only while a chunk of names is copied, then it is released for the callbacks; it keeps a reference,
+//like a handle, so the next chunk starts right at it, after the last name reported
+int iterating(Tree* tree, Tree* start, const char* path, TreeIterateCallback callback, void* context){
+    if(is_path_valid(path) == false){
+        return EINVAL;
+    }
+
+    size_t helpme = strlen(path);
+    Tree* foldersArray[helpme];
+    int i;
+    if(goingToWorkFrom(tree, start, path, NULL, false, foldersArray, &i) == ENOENT){
+        return ENOENT;
+    }
+    Tree* folder = foldersArray[i];
+    folderHold(folder);
+
+    char chunk[ITERATE_CHUNK_NAMES * (MAX_FOLDER_NAME_LENGTH + 1)];
+    char cursor[MAX_FOLDER_NAME_LENGTH + 1];
+    int count = iteratingChunk(folder, NULL, chunk);
+    returningFromWork(foldersArray, i, false); //we were only a reader
+
+    bool isContinued = true;
+    while(count > 0 && isContinued){
+        const char* name = chunk;
+        for(int n = 0; n < count && isContinued; n++){
+            isContinued = callback(name, context);
+            strcpy(cursor, name);
+            name += strlen(name) + 1;
+        }
+        if(isContinued == false || count < ITERATE_CHUNK_NAMES){
+            break;
+        }
+        if(goingToWork(folder, "/", NULL, false, foldersArray, &i) == ENOENT){ //removed meanwhile, nothing more to report
+            break;
+        }
+        count = iteratingChunk(folder, cursor, chunk);
+        returningFromWork(foldersArray, i, false); //we were only a reader
+    }
+
+    folderRelease(folder);
+    return 0;
+}
+
+
+//the part of creating done while the parent of `path` (foldersArray[i]) is held as a writer, `component` is the name of the new folder;
+//sets `*position` to the one of the change in the journal
+int creatingIn(Tree* tree, Tree* foldersArray[], int i, const char* path, const char* component, uint64_t* position){
+    HashMap* map = foldersArray[i]->subfolders;
+    if(hmap_get(map, component) != NULL){
+        return EEXIST;
+    }
+
+    Tree* folder = folderNew();
+    if(folder == NULL){
+        return ENOMEM;
+    }
+    enteringChange(tree);
+    if(linking(tree, foldersArray[i], component, folder) != 0){
+        leavingChange(tree);
+        folderFree(folder);
+        return ENOMEM;
+    }
+    *position = journaling(tree, 'l', foldersArray[i], component, folder, NULL, NULL);
+    leavingChange(tree);
+    notifyingAll(foldersArray, i, depthOf(path) - 1, NULL, NULL, path, foldersArray[i]);
+    return 0;
+}
+
+
+int creating(Tree* tree, Tree* start, const char* path){
+    if(strlen(path) == 1){ //path = "/"
+        return EEXIST;
+    }
+    if(is_path_valid(path) == false){
+        return EINVAL;
+    }
+
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    char* pathToParent = make_path_to_parent(path, component);
+    if(pathToParent == NULL){
+        return ENOMEM;
+    }
+    size_t helpme = strlen(pathToParent);
+    Tree* foldersArray[helpme];
+    int i;
+    int err = goingToWorkFrom(tree, start, pathToParent, NULL, true, foldersArray, &i);
+    free(pathToParent);
+    if(err != 0){
+        return err;
+    }
+
+    uint64_t position = 0;
+    err = creatingIn(tree, foldersArray, i, path, component, &position);
+    returningFromWork(foldersArray, i, true);
+    if(err != 0){
+        return err;
+    }
+    return waitingForJournal(tree, position);
+}
+
+
+//creating `path` with all the missing folders on the way: we go down as a reader as long as the folders exist, then only the last
+//existing one is held as a writer, the missing ones are put together before anyone can see them and linked into it at once
+int creatingAll(Tree* tree, Tree* start, const char* path){
+    if(is_path_valid(path) == false){
+        return EINVAL;
+    }
+
+    size_t helpme = strlen(path);
+    Tree* foldersArray[helpme];
+    int i;
+    for(;;){
+        if(goingToWork(start, "/", NULL, false, foldersArray, &i) == ENOENT){
+            return ENOENT;
+        }
+        char component[MAX_FOLDER_NAME_LENGTH + 1];
+        const char* subpath = split_path(path, component);
+        const char* missing = NULL; //the part of `path` starting at the first missing folder
+        while(subpath != NULL){
+            Tree* folder = hmap_get(foldersArray[i]->subfolders, component);
+            if(folder == NULL){
+                missing = subpath - strlen(component) - 1;
+                break;
+            }
+            i++;
+            foldersArray[i] = folder;
+            readerStart(folder->monitor);
+            subpath = split_path(subpath, component);
+        }
+        if(missing == NULL){ //it is already there
+            returningFromWork(foldersArray, i, false); //we were only a reader
+            return 0;
+        }
+
+        //the parent of the folder cannot be moved nor removed while we hold its own parent, only `start` (if it is the folder
+        //of a handle) can be removed meanwhile, and somebody could create the missing folder - then we try again
+        Tree* parent = foldersArray[i];
+        readerEnd(parent->monitor);
+        writerStart(parent->monitor);
+        if(parent->removed){
+            returningFromWork(foldersArray, i, true);
+            return ENOENT;
+        }
+        if(hmap_get(parent->subfolders, component) != NULL){
+            returningFromWork(foldersArray, i, true);
+            continue;
+        }
+
+        //the missing chain is built aside, nobody sees it until it is linked into `parent`
+        Tree* top = folderNew();
+        Tree* folder = top;
+        char name[MAX_FOLDER_NAME_LENGTH + 1];
+        const char* rest = split_path(missing, NULL);
+        while(folder != NULL && (rest = split_path(rest, name)) != NULL){
+            Tree* child = folderNew();
+            if(child != NULL && attaching(folder, name, child) != 0){
+                folderFree(child);
+                child = NULL;
+            }
+            folder = child;
+        }
+        if(folder == NULL){
+            returningFromWork(foldersArray, i, true);
+            if(top != NULL){
+                folderFreeRecursively(top, NULL);
+            }
+            return ENOMEM;
+        }
+        enteringChange(tree);
+        if(linking(tree, parent, component, top) != 0){
+            leavingChange(tree);
             returningFromWork(foldersArray, i, true);
-            return ENOTEMPTY;
+            folderFreeRecursively(top, NULL);
+            return ENOMEM;
+        }
+        uint64_t position = journaling(tree, 'l', parent, component, top, NULL, NULL);
+        leavingChange(tree);
+
+        //telling the watches about every new folder, the top one first; `created` is `path` cut right after it
+        char created[helpme + 1];
+        memcpy(created, path, helpme + 1);
+        size_t length = missing - path + 1;
+        int depth = depthOf(path) - depthOf(missing);
+        Tree* createdParent = parent;
+        rest = missing;
+        while((rest = split_path(rest, name)) != NULL){
+            length += strlen(name) + 1;
+            char cut = created[length];
+            created[length] = '\0';
+            notifyingAll(foldersArray, i, depth, NULL, NULL, created, createdParent);
+            created[length] = cut;
+            createdParent = hmap_get(createdParent->subfolders, name); //nobody else can reach it yet
+        }
+        returningFromWork(foldersArray, i, true);
+        return waitingForJournal(tree, position);
+    }
+}
+
+
+//the part of removing done while the parent of `path` (foldersArray[i]) is held as a writer, `component` is the name of the folder;
+//sets `*removed` to the folder taken out of it and `*removedAt` to the version of that, to retire it once the parent is let go,
+//and `*position` to the one of the change in the journal
+int removingFrom(Tree* tree, Tree* foldersArray[], int i, const char* path, const char* component, bool recursively,
+        Tree** removed, unsigned long* removedAt, uint64_t* position){
+    Tree* parent = foldersArray[i];
+    Tree* folderToRemove = hmap_get(parent->subfolders, component);
+    if(folderToRemove == NULL){
+        return ENOENT;
+    }
+
+    //somebody may be working inside of it through a handle, we have to wait for them
+    if(entering(folderToRemove, true) == false){
+        return EAGAIN;
+    }
+    if(recursively == false && hmap_size(folderToRemove->subfolders) != 0){ //folder to delete not empty
+        writerEnd(folderToRemove->monitor);
+        return ENOTEMPTY;
+    }
+    folderToRemove->removed = true;
+    invalidatingCache(folderToRemove); //the folders inside of it are not marked as removed yet, but their paths go through it
+    notifying(folderToRemove, depthOf(path), path, folderToRemove, NULL, NULL); //its own watches see it go away as "/"
+    writerEnd(folderToRemove->monitor);
+
+    enteringChange(tree);
+    unlinking(tree, parent, component);
+    *removedAt = parent->version;
+    *position = journaling(tree, 'u', parent, component, NULL, NULL, NULL);
+    leavingChange(tree);
+    notifyingAll(foldersArray, i, depthOf(path) - 1, path, parent, NULL, NULL);
+    *removed = folderToRemove;
+    return 0;
+}
+
+
+//the folder is only taken out of its parent, freeing it (and, if `recursively`, the folders inside of it) is left to the reclaimer,
+//after we let the parent go
+int removing(Tree* tree, Tree* start, const char* path, bool recursively){
+    if(strlen(path) == 1){ //root given
+        return EBUSY;
+    }
+    if(is_path_valid(path) == false){
+        return EINVAL;
+    }
+
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    char* pathToParent = make_path_to_parent(path, component);
+    if(pathToParent == NULL){
+        return ENOMEM;
+    }
+    size_t helpme = strlen(pathToParent);
+    Tree* foldersArray[helpme];
+    int i;
+    int err = goingToWorkFrom(tree, start, pathToParent, component, true, foldersArray, &i);
+    free(pathToParent);
+    if(err != 0){
+        return err;
+    }
+
+    Tree* removed;
+    unsigned long removedAt;
+    uint64_t position;
+    err = removingFrom(tree, foldersArray, i, path, component, recursively, &removed, &removedAt, &position);
+    returningFromWork(foldersArray, i, true);
+    if(err != 0){
+        return err;
+    }
+    retiring(tree, removed, removedAt);
+    return waitingForJournal(tree, position);
+}
+
+
+//one tree_copy, which waits until `pending` tasks drop to 0
+typedef struct Copying Copying;
+
+struct Copying {
+    WorkPool* pool; //NULL if everything is copied by the thread of tree_copy
+    atomic_int pending;
+    atomic_bool failed; //out of memory, the copy is incomplete
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+};
+
+typedef struct CopyingTask CopyingTask;
+
+struct CopyingTask {
+    Copying* job;
+    Tree* source; //held, so that it is not freed even if it is removed meanwhile
+    Tree* copy;
+};
+
+void copyingTask(WorkPool* pool, void* arg);
+
+
+//copying the subfolders of `source` (which we hold a reference to, but not its lock) into the new folder `copy`, which nobody else
+//sees yet; the source folder is held as a reader only while its map is copied, then its subfolders are copied by separate tasks
+//(if there is a pool), so a folder changed meanwhile is copied either before or after the change
+void copyingFolder(Copying* job, Tree* source, Tree* copy){
+    readerStart(source->monitor);
+    size_t count = source->removed ? 0 : hmap_size(source->subfolders);
+    CopyingTask* children = malloc(count * sizeof(CopyingTask) + 1);
+    if(children == NULL){
+        count = 0;
+        atomic_store(&job->failed, true);
+    }
+    const char* key;
+    void* value;
+    size_t c = 0;
+    HashMapIterator it = hmap_iterator(source->subfolders);
+    while (c < count && hmap_next(source->subfolders, &it, &key, &value)){
+        Tree* child = folderNew();
+        if(child != NULL && attaching(copy, key, child) != 0){
+            folderFree(child);
+            child = NULL;
+        }
+        if(child == NULL){
+            atomic_store(&job->failed, true);
+            break;
+        }
+        folderHold(value);
+        children[c] = (CopyingTask) {job, value, child};
+        c++;
+    }
+    readerEnd(source->monitor);
+
+    for(size_t n = 0; n < c; n++){
+        bool submitted = false;
+        if(job->pool != NULL && atomic_load(&children[n].source->filter) != NULL){ //it has (or had) subfolders
+            CopyingTask* task = malloc(sizeof(CopyingTask));
+            if(task != NULL){
+                *task = children[n];
+                atomic_fetch_add(&job->pending, 1);
+                submitted = wpool_submit(job->pool, copyingTask, task);
+                if(submitted == false){
+                    atomic_fetch_sub(&job->pending, 1); //we are still pending ourselves, so it does not drop to 0
+                    free(task);
+                }
+            }
+        }
+        if(submitted == false){
+            copyingFolder(job, children[n].source, children[n].copy);
+            folderRelease(children[n].source);
+        }
+    }
+    free(children);
+}
+
+
+void copyingTask(WorkPool* pool, void* arg){
+    (void) pool;
+    CopyingTask* task = arg;
+    Copying* job = task->job;
+    copyingFolder(job, task->source, task->copy);
+    folderRelease(task->source);
+    free(task);
+    if(atomic_fetch_sub(&job->pending, 1) == 1){
+        pthread_mutex_lock(&job->mutex);
+        pthread_cond_signal(&job->done);
+        pthread_mutex_unlock(&job->mutex);
+    }
+}
+
+
+//a copy of everything inside of `source` (which we hold a reference to) in a new folder, which nobody else sees yet;
+//NULL if out of memory
+Tree* copyingSubtree(Tree* tree, Tree* source){
+    Tree* copy = folderNew();
+    if(copy == NULL){
+        return NULL;
+    }
+    Copying job;
+    job.pool = poolOf(tree);
+    atomic_init(&job.pending, 1); //us, until we copy the top folder
+    atomic_init(&job.failed, false);
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_cond_init(&job.done, NULL);
+
+    copyingFolder(&job, source, copy);
+    pthread_mutex_lock(&job.mutex);
+    atomic_fetch_sub(&job.pending, 1);
+    while(atomic_load(&job.pending) > 0){
+        pthread_cond_wait(&job.done, &job.mutex);
+    }
+    pthread_mutex_unlock(&job.mutex);
+    pthread_mutex_destroy(&job.mutex);
+    pthread_cond_destroy(&job.done);
+
+    if(atomic_load(&job.failed)){
+        folderFreeRecursively(copy, NULL);
+        return NULL;
+    }
+    return copy;
+}
+
+
+//the copy is made without holding anything but the folder being copied at the moment, the target parent is held as a writer only
+//for linking the copy into it
+//copying `source` (from `fromStart` in `from`) to `target` (from `start` in `tree`), which is the same tree or another one
+int copying(Tree* from, Tree* fromStart, const char* source, Tree* tree, Tree* start, const char* target){
+    if(strlen(target) == 1){
+        return EEXIST;
+    }
+    if(is_path_valid(source) == false || is_path_valid(target) == false){
+        return EINVAL;
+    }
+
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    char* pathToParent = make_path_to_parent(target, component);
+    if(pathToParent == NULL){
+        return ENOMEM;
+    }
+    size_t helpme = strlen(pathToParent) + strlen(source);
+    Tree* foldersArray[helpme];
+    int i;
+
+    //checking the target first, a copy that cannot be linked anywhere would be a waste
+    int err = goingToWorkFrom(tree, start, pathToParent, NULL, false, foldersArray, &i);
+    if(err == 0){
+        if(hmap_get(foldersArray[i]->subfolders, component) != NULL){
+            err = EEXIST;
+        }
+        returningFromWork(foldersArray, i, false); //we were only a reader
+    }
+    if(err == 0){
+        err = goingToWorkFrom(from, fromStart, source, NULL, false, foldersArray, &i);
+    }
+    if(err != 0){
+        free(pathToParent);
+        return err;
+    }
+    Tree* folder = foldersArray[i];
+    folderHold(folder);
+    returningFromWork(foldersArray, i, false); //we were only a reader
+
+    Tree* copy = copyingSubtree(from, folder);
+    folderRelease(folder);
+    if(copy == NULL){
+        free(pathToParent);
+        return ENOMEM;
+    }
+
+    err = goingToWorkFrom(tree, start, pathToParent, NULL, true, foldersArray, &i);
+    free(pathToParent);
+    if(err == 0 && hmap_get(foldersArray[i]->subfolders, component) != NULL){ //created meanwhile
+        returningFromWork(foldersArray, i, true);
+        err = EEXIST;
+    }
+    if(err != 0){
+        folderFreeRecursively(copy, NULL);
+        return err;
+    }
+    enteringChange(tree);
+    if(linking(tree, foldersArray[i], component, copy) != 0){
+        leavingChange(tree);
+        returningFromWork(foldersArray, i, true);
+        folderFreeRecursively(copy, NULL);
+        return ENOMEM;
+    }
+    uint64_t position = journaling(tree, 'l', foldersArray[i], component, copy, NULL, NULL);
+    leavingChange(tree);
+    notifyingAll(foldersArray, i, depthOf(target) - 1, NULL, NULL, target, foldersArray[i]);
+    returningFromWork(foldersArray, i, true);
+    return waitingForJournal(tree, position);
+}
+
+
+int moving(Tree* tree, Tree* start, const char* source, const char* target){
+    size_t lenSource = strlen(source);
+    if(lenSource == 1){ //root given
+        return EBUSY;
+    }
+
+    size_t lenTarget = strlen(target);
+    if(lenTarget == 1){
+        return EEXIST;
+    }
+
+    if(is_path_valid(source) == false || is_path_valid(target) == false){
+        return EINVAL;
+    }
+
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    char* pathSourceParent = make_path_to_parent(source, component);
+    char componentTarget[MAX_FOLDER_NAME_LENGTH + 1];
+    char* pathTargetParent = make_path_to_parent(target, componentTarget);
+    char* toLatestAncestor = pathSourceParent && pathTargetParent ? latestCommonAncestor(source, target) : NULL;
+    if(toLatestAncestor == NULL){
+        free(pathSourceParent);
+        free(pathTargetParent);
+        return ENOMEM;
+    }
+    size_t lenAncestor = strlen(toLatestAncestor);
+    int depthAncestor = depthOf(toLatestAncestor);
+    Tree* tablicaKolejnychFolderow[lenAncestor];
+    int i;
+    int err = goingToWorkFrom(tree, start, toLatestAncestor, NULL, true, tablicaKolejnychFolderow, &i);
+    free(toLatestAncestor);
+    if(err != 0){
+        free(pathSourceParent);
+        free(pathTargetParent);
+        return err;
+    }
+    Tree* ancestor = tablicaKolejnychFolderow[i];
+
+    //besides the latest common ancestor, both parents (and the folders between) have to be held, as handles can reach them
+    //without going through the ancestor; the two paths split right below the ancestor
+    Tree* sourceFolders[lenSource];
+    Tree* targetFolders[lenTarget];
+    int s = -1;
+    int t = -1;
+    uint64_t position = 0;
+
+    if(lenSource == lenAncestor){ //source is the ancestor, so the target is the source itself or lies inside of it
+        if(lenTarget == lenAncestor){
+            err = EEXIST;
+        }
+        else if((err = goingFurther(ancestor, pathTargetParent + lenAncestor - 1, NULL, true, targetFolders, &t)) != 0){
+            //ENOENT, or EAGAIN
+        }
+        else{
+            Tree* targetParent = t >= 0 ? targetFolders[t] : ancestor;
+            if(hmap_get(targetParent->subfolders, componentTarget) != NULL){
+                err = EEXIST;
+            }
+            else{
+                err = -1; //source is subfolder of the target
+            }
+        }
+    }
+    else if((err = goingFurther(ancestor, pathSourceParent + lenAncestor - 1, component, true, sourceFolders, &s)) != 0){
+        //ENOENT, or EAGAIN
+    }
+    else{
+        Tree* sourceParent = s >= 0 ? sourceFolders[s] : ancestor;
+        Tree* folderToMove = hmap_get(sourceParent->subfolders, component);
+        if(folderToMove == NULL){
+            err = ENOENT;
+        }
+        else if(lenTarget == lenAncestor){ //target is an ancestor of the source, so it exists
+            err = EEXIST;
+        }
+        else if((err = goingFurther(ancestor, pathTargetParent + lenAncestor - 1, NULL, true, targetFolders, &t)) != 0){
+            //ENOENT, or EAGAIN
+        }
+        else{
+            Tree* targetParent = t >= 0 ? targetFolders[t] : ancestor;
+            if(hmap_get(targetParent->subfolders, componentTarget) != NULL){
+                err = EEXIST;
+            }
+            else{
+                invalidatingCache(folderToMove);
+                //both at once, a snapshot must not see the folder in neither place; linking first, as only it can fail
+                enteringChange(tree);
+                err = linking(tree, targetParent, componentTarget, folderToMove);
+                if(err == 0){
+                    unlinking(tree, sourceParent, component);
+                    position = journaling(tree, 'm', sourceParent, component, NULL, targetParent, componentTarget);
+                }
+                leavingChange(tree);
+            }
+            if(err == 0){
+                notifyingAll(tablicaKolejnychFolderow, i, depthAncestor, source, sourceParent, target, targetParent);
+                notifyingAll(sourceFolders, s, depthOf(pathSourceParent), source, sourceParent, NULL, NULL);
+                notifyingAll(targetFolders, t, depthOf(pathTargetParent), NULL, NULL, target, targetParent);
+            }
+        }
+    }
+
+    free(pathSourceParent);
+    free(pathTargetParent);
+    returningFromWork(targetFolders, t, true);
+    returningFromWork(sourceFolders, s, true);
+    returningFromWork(tablicaKolejnychFolderow, i, true);
+    if(err == 0){
+        err = waitingForJournal(tree, position);
+    }
+    return err;
+}
+
+
+//an operation of a batch, with the folder it works in (see tree_apply_batch)
+typedef struct BatchEntry BatchEntry;
+
+struct BatchEntry {
+    const char* folder; //the listed folder, or the parent of the created or removed one
+    char* parent; //the parent, which has to be freed; NULL for listings
+    size_t index; //in the batch
+};
+
+//tree_apply_batch in progress: the folders held from "/" down (as readers), for the next group of operations
+typedef struct Batch Batch;
+
+struct Batch {
+    Tree* tree;
+    const TreeBatchOp* ops;
+    TreeBatchResult* results;
+    Tree** folders;
+    int held; //folders[0..held - 1] are held
+    const char* heldFolder; //they are the folders above it
+    Tree** removed; //to be retired once nothing is held, at removedAt
+    unsigned long* removedAt;
+    size_t removedCount;
+    uint64_t position; //the latest change in the journal
+};
+
+
+int comparingEntries(const void* a, const void* b){
+    const BatchEntry* first = a;
+    const BatchEntry* second = b;
+    int order = strcmp(first->folder, second->folder); //as '/' is before any letter, folders below one come right after it
+    if(order != 0){
+        return order;
+    }
+    return first->index < second->index ? -1 : first->index > second->index;
+}
+
+
+//the depth of the deepest folder that both `path1` and `path2` are (or are below)
+int commonDepth(const char* path1, const char* path2){
+    int depth = 0;
+    for(size_t c = 1; path1[c] != '\0' && path1[c] == path2[c]; c++){
+        if(path1[c] == '/'){
+            depth++;
+        }
+    }
+    return depth;
+}
+
+
+void releasingBatch(Batch* batch, int keep){
+    for(int k = batch->held - 1; k >= keep; k--){
+        readerEnd(batch->folders[k]->monitor);
+    }
+    batch->held = keep;
+}
+
+
+//applying the `count` operations on the same folder, in their order
+void applyingGroup(Batch* batch, BatchEntry entries[], size_t count){
+    const char* folder = entries[0].folder;
+    bool asWriter = false;
+    for(size_t k = 0; k < count; k++){
+        if(batch->ops[entries[k].index].kind != TREE_BATCH_LIST){
+            asWriter = true;
+        }
+    }
+
+    //the folders above both this folder and the previous one are held already, the folder itself never is (we may need a writer)
+    int depth = depthOf(folder);
+    int keep = commonDepth(batch->heldFolder, folder) + 1;
+    if(keep > depth){
+        keep = depth;
+    }
+    if(keep > batch->held){
+        keep = batch->held;
+    }
+    releasingBatch(batch, keep);
+    int err;
+    int i;
+    if(keep == 0){
+        err = goingToWork(rootOf(batch->tree), folder, NULL, asWriter, batch->folders, &i);
+    }
+    else{
+        const char* below = folder;
+        for(int d = 1; d < keep; d++){ //the path below folders[keep - 1]
+            below = strchr(below + 1, '/');
+        }
+        int further;
+        err = goingFurther(batch->folders[keep - 1], below, NULL, asWriter, batch->folders + keep, &further);
+        i = keep + further;
+    }
+    if(err != 0){ //ENOENT, the ones that are kept stay held
+        for(size_t k = 0; k < count; k++){
+            batch->results[entries[k].index].result = ENOENT;
+        }
+        return;
+    }
+
+    Tree* target = batch->folders[i];
+    for(size_t k = 0; k < count; k++){
+        const TreeBatchOp* op = &batch->ops[entries[k].index];
+        TreeBatchResult* result = &batch->results[entries[k].index];
+        if(op->kind == TREE_BATCH_LIST){
+            Listing* memo = listingOf(target);
+            result->listing = memo != NULL ? malloc(memo->size) : NULL;
+            if(result->listing != NULL){
+                memcpy(result->listing, memo->text, memo->size);
+            }
+            result->result = result->listing != NULL ? 0 : ENOMEM;
+            continue;
+        }
+        char component[MAX_FOLDER_NAME_LENGTH + 1];
+        size_t length = strlen(op->path) - strlen(folder) - 1;
+        memcpy(component, op->path + strlen(folder), length);
+        component[length] = '\0';
+        uint64_t position = 0;
+        if(op->kind == TREE_BATCH_CREATE){
+            result->result = creatingIn(batch->tree, batch->folders, i, op->path, component, &position);
+        }
+        else{
+            Tree** removed = &batch->removed[batch->removedCount];
+            unsigned long* removedAt = &batch->removedAt[batch->removedCount];
+            result->result = removingFrom(batch->tree, batch->folders, i, op->path, component, false, removed,
+                removedAt, &position);
+            if(result->result == 0){
+                batch->removedCount++;
+            }
+        }
+        if(position > batch->position){
+            batch->position = position;
+        }
+    }
+    if(asWriter){
+        writerEnd(target->monitor);
+    }
+    else{
+        readerEnd(target->monitor);
+    }
+    batch->held = i;
+    batch->heldFolder = folder;
+}
+
+
+//applying the operations between two moves (or the ends of the batch), grouped by their folders
+void applyingSegment(Batch* batch, BatchEntry entries[], size_t count){
+    qsort(entries, count, sizeof(BatchEntry), comparingEntries);
+    size_t first = 0;
+    for(size_t k = 1; k <= count; k++){
+        if(k == count || strcmp(entries[k].folder, entries[first].folder) != 0){
+            applyingGroup(batch, entries + first, k - first);
+            first = k;
+        }
+    }
+    releasingBatch(batch, 0);
+}
+
+
+int tree_apply_batch(Tree* tree, const TreeBatchOp ops[], size_t n, TreeBatchResult results[]){
+    BatchEntry* entries = malloc((n + 1) * sizeof(BatchEntry));
+    Tree** removed = malloc((n + 1) * sizeof(Tree*));
+    unsigned long* removedAt = malloc((n + 1) * sizeof(unsigned long));
+    bool failed = entries == NULL || removed == NULL || removedAt == NULL;
+    size_t count = 0;
+    for(size_t k = 0; k < n && failed == false; k++){
+        const TreeBatchOp* op = &ops[k];
+        results[k].result = 0;
+        results[k].listing = NULL;
+        if(op->kind == TREE_BATCH_MOVE){
+            continue;
+        }
+        if(op->kind != TREE_BATCH_LIST && strlen(op->path) == 1){
+            results[k].result = op->kind == TREE_BATCH_CREATE ? EEXIST : EBUSY;
+        }
+        else if(is_path_valid(op->path) == false){
+            results[k].result = EINVAL;
+        }
+        else if(op->kind == TREE_BATCH_LIST){
+            entries[count++] = (BatchEntry) { op->path, NULL, k };
+        }
+        else{
+            char* parent = make_path_to_parent(op->path, NULL);
+            failed = parent == NULL;
+            entries[count++] = (BatchEntry) { parent, parent, k };
+        }
+    }
+    if(failed){
+        for(size_t e = 0; e < count; e++){
+            free(entries[e].parent);
+        }
+        free(entries);
+        free(removed);
+        free(removedAt);
+        return ENOMEM;
+    }
+
+    Tree* folders[MAX_PATH_LENGTH / 2 + 1];
+    Batch batch = { tree, ops, results, folders, 0, "/", removed, removedAt, 0, 0 };
+    //the entries are in the order of the batch, the ones of each segment are sorted before it is applied
+    size_t first = 0;
+    for(size_t k = 0; k < n; k++){
+        if(ops[k].kind != TREE_BATCH_MOVE){
+            continue;
+        }
+        size_t last = first;
+        while(last < count && entries[last].index < k){
+            last++;
+        }
+        applyingSegment(&batch, entries + first, last - first);
+        first = last;
+        results[k].result = moving(tree, rootOf(tree), ops[k].path, ops[k].target);
+    }
+    applyingSegment(&batch, entries + first, count - first);
+
+    for(size_t r = 0; r < batch.removedCount; r++){
+        retiring(tree, removed[r], removedAt[r]);
+    }
+    int err = waitingForJournal(tree, batch.position);
+    for(size_t k = 0; k < n && err != 0; k++){
+        if(results[k].result == 0 && (ops[k].kind == TREE_BATCH_CREATE || ops[k].kind == TREE_BATCH_REMOVE)){
+            results[k].result = err; //made in memory only, like tree_create tells
+        }
+    }
+    for(size_t e = 0; e < count; e++){
+        free(entries[e].parent);
+    }
+    free(entries);
+    free(removed);
+    free(removedAt);
+    return 0;
+}
+
+
+char* tree_list(Tree* tree, const char* path){
+    return listing(tree, rootOf(tree), path);
+}
+
+
+int tree_create(Tree* tree, const char* path){
+    return creating(tree, rootOf(tree), path);
+}
+
+
+int tree_create_all(Tree* tree, const char* path){
+    return creatingAll(tree, rootOf(tree), path);
+}
+
+
+int tree_remove(Tree* tree, const char* path){
+    return removing(tree, rootOf(tree), path, false);
+}
+
+
+int tree_remove_recursive(Tree* tree, const char* path){
+    return removing(tree, rootOf(tree), path, true);
+}
+
+
+int tree_move(Tree* tree, const char* source, const char* target){
+    return moving(tree, rootOf(tree), source, target);
+}
+
+
+int tree_copy(Tree* tree, const char* source, const char* target){
+    return copying(tree, rootOf(tree), source, tree, rootOf(tree), target);
+}
+
+
+int tree_copy_between(Tree* from, const char* source, Tree* to, const char* target){
+    return copying(from, rootOf(from), source, to, rootOf(to), target);
+}
+
+
+int tree_list_into(Tree* tree, const char* path, char* buffer, size_t capacity, size_t* needed){
+    return listingInto(tree, rootOf(tree), path, buffer, capacity, needed);
+}
+
+
+char* tree_list_page(Tree* tree, const char* path, const char* after, size_t limit, char** next){
+    return listingPage(tree, rootOf(tree), path, after, limit, next);
+}
+
+
+int tree_iterate(Tree* tree, const char* path, TreeIterateCallback callback, void* context){
+    return iterating(tree, rootOf(tree), path, callback, context);
+}
+
+
+int tree_list_since(Tree* tree, const char* path, unsigned long since, unsigned long* version, char** added, char** removed){
+    return listingSince(tree, rootOf(tree), path, since, version, added, removed);
+}
+
+
+TreeHandle* tree_open(Tree* tree, const char* path){
+    if(is_path_valid(path) == false){
+        return NULL;
+    }
+
+    size_t helpme = strlen(path);
+    Tree* foldersArray[helpme];
+    int i;
+    if(goingToWorkFrom(tree, rootOf(tree), path, NULL, false, foldersArray, &i) == ENOENT){
+        return NULL;
+    }
+
+    TreeHandle* handle = malloc(sizeof(TreeHandle));
+    if(handle == NULL){
+        returningFromWork(foldersArray, i, false); //we were only a reader
+        return NULL;
+    }
+    handle->tree = tree;
+    handle->folder = foldersArray[i];
+    atomic_fetch_add(&handle->folder->references, 1); //the folder cannot be removed meanwhile, as we hold it
+    returningFromWork(foldersArray, i, false); //we were only a reader
+    return handle;
+}
+
+
+void tree_close(TreeHandle* handle){
+    folderRelease(handle->folder);
+    free(handle);
+}
+
+
+char* tree_list_at(TreeHandle* handle, const char* path){
+    return listing(handle->tree, handle->folder, path);
+}
+
+
+int tree_list_into_at(TreeHandle* handle, const char* path, char* buffer, size_t capacity, size_t* needed){
+    return listingInto(handle->tree, handle->folder, path, buffer, capacity, needed);
+}
+
+
+char* tree_list_page_at(TreeHandle* handle, const char* path, const char* after, size_t limit, char** next){
+    return listingPage(handle->tree, handle->folder, path, after, limit, next);
+}
+
+
+int tree_iterate_at(TreeHandle* handle, const char* path, TreeIterateCallback callback, void* context){
+    return iterating(handle->tree, handle->folder, path, callback, context);
+}
+
+
+int tree_list_since_at(TreeHandle* handle, const char* path, unsigned long since, unsigned long* version, char** added, char** removed){
+    return listingSince(handle->tree, handle->folder, path, since, version, added, removed);
+}
+
+
+TreeWatch* watching(Tree* tree, Tree* start, const char* path, bool recursive, size_t capacity){
+    if(is_path_valid(path) == false){
+        return NULL;
+    }
+    TreeWatch* watch = malloc(sizeof(TreeWatch));
+    if(watch == NULL){
+        return NULL;
+    }
+    watch->ring = ering_new(capacity);
+    if(watch->ring == NULL){
+        free(watch);
+        return NULL;
+    }
+    watch->tree = tree;
+    watch->recursive = recursive;
+    atomic_init(&watch->lost, false);
+    if(recursive){ //before we get there, so that no walk that ends below it skips the folder from now on
+        atomic_fetch_add(&contextOf(tree)->recursiveWatches, 1);
+    }
+
+    size_t helpme = strlen(path);
+    Tree* foldersArray[helpme];
+    int i;
+    if(goingToWorkFrom(tree, start, path, NULL, true, foldersArray, &i) == ENOENT){
+        if(recursive){
+            atomic_fetch_sub(&contextOf(tree)->recursiveWatches, 1);
+        }
+        ering_free(watch->ring);
+        free(watch);
+        return NULL;
+    }
+    watch->folder = foldersArray[i];
+    atomic_fetch_add(&watch->folder->references, 1);
+    watch->next = watch->folder->watches;
+    watch->folder->watches = watch;
+    returningFromWork(foldersArray, i, true);
+    return watch;
+}
+
+
+TreeWatch* tree_watch(Tree* tree, const char* path, bool recursive, size_t capacity){
+    return watching(tree, rootOf(tree), path, recursive, capacity);
+}
+
+
+TreeWatch* tree_watch_at(TreeHandle* handle, const char* path, bool recursive, size_t capacity){
+    return watching(handle->tree, handle->folder, path, recursive, capacity);
+}
+
+
+size_t tree_watch_read(TreeWatch* watch, TreeEvent* events[], size_t max, bool* overflowed){
+    size_t count = 0;
+    void* event;
+    while(count < max && ering_drain(watch->ring, &event, 1) == 1){
+        events[count] = event;
+        count++;
+    }
+    if(overflowed != NULL){
+        bool lost = atomic_exchange(&watch->lost, false);
+        *overflowed = ering_overflowed(watch->ring) || lost;
+    }
+    return count;
+}
+
+
+void tree_unwatch(TreeWatch* watch){
+    Tree* folder = watch->folder;
+    writerStart(folder->monitor); //even if the folder was removed meanwhile, nobody can be notifying it then
+    TreeWatch** link = &folder->watches;
+    while(*link != watch){
+        link = &(*link)->next;
+    }
+    *link = watch->next;
+    writerEnd(folder->monitor);
+    if(watch->recursive){
+        atomic_fetch_sub(&contextOf(watch->tree)->recursiveWatches, 1);
+    }
+    folderRelease(folder);
+
+    void* event;
+    while(ering_drain(watch->ring, &event, 1) == 1){
+        free(event);
+    }
+    ering_free(watch->ring);
+    free(watch);
+}
+
+
+int tree_create_at(TreeHandle* handle, const char* path){
+    return creating(handle->tree, handle->folder, path);
+}
+
+
+int tree_create_all_at(TreeHandle* handle, const char* path){
+    return creatingAll(handle->tree, handle->folder, path);
+}
+
+
+int tree_remove_at(TreeHandle* handle, const char* path){
+    return removing(handle->tree, handle->folder, path, false);
+}
+
+
+int tree_remove_recursive_at(TreeHandle* handle, const char* path){
+    return removing(handle->tree, handle->folder, path, true);
+}
+
+
+int tree_move_at(TreeHandle* handle, const char* source, const char* target){
+    return moving(handle->tree, handle->folder, source, target);
+}
+
+
+int tree_copy_at(TreeHandle* handle, const char* source, const char* target){
+    return copying(handle->tree, handle->folder, source, handle->tree, handle->folder, target);
+}
+
+
+TreeSnapshot* tree_snapshot(Tree* tree){
+    TreeContext* context = contextOf(tree);
+    TreeSnapshot* snapshot = malloc(sizeof(TreeSnapshot));
+    if(snapshot == NULL){
+        return NULL;
+    }
+    snapshot->tree = tree;
+    pthread_mutex_lock(&context->snapshotMutex);
+    atomic_store(&context->snapshotting, true);
+    for(int c = 0; c < CHANGING_COUNTERS; c++){ //waiting only for the changes that have already started
+        while(atomic_load(&context->changing[c].count) > 0){
+            sched_yield();
+        }
+    }
+    snapshot->version = atomic_load(&lastVersion);
+    snapshot->next = context->snapshots;
+    context->snapshots = snapshot;
+    if(snapshot->next == NULL){
+        atomic_store(&context->oldestSnapshot, snapshot->version);
+    }
+    atomic_store(&context->newestSnapshot, snapshot->version);
+    atomic_store(&context->snapshotting, false);
+    pthread_mutex_unlock(&context->snapshotMutex);
+    return snapshot;
+}
+
+
+//forgetting the older names that live snapshots do not need anymore, in every folder on the kept list; the ones that still keep
+//some are put back on it
+void forgettingKept(TreeContext* context){
+    Tree* folder = atomic_exchange(&context->kept, NULL);
+    while(folder != NULL){
+        Tree* next = folder->nextKept;
+        writerStart(folder->monitor);
+        bool kept = sset_forget(folder->names, atomic_load(&context->oldestSnapshot));
+        folder->kept = kept;
+        writerEnd(folder->monitor);
+        if(kept){
+            rememberingKept(context, folder);
+        }
+        else{
+            folderRelease(folder);
+        }
+        folder = next;
+    }
+}
+
+
+void tree_snapshot_free(TreeSnapshot* snapshot){
+    TreeContext* context = contextOf(snapshot->tree);
+    pthread_mutex_lock(&context->snapshotMutex);
+    TreeSnapshot** link = &context->snapshots;
+    while(*link != snapshot){
+        link = &(*link)->next;
+    }
+    *link = snapshot->next;
+    TreeSnapshot* oldest = context->snapshots;
+    while(oldest != NULL && oldest->next != NULL){
+        oldest = oldest->next;
+    }
+    atomic_store(&context->newestSnapshot, context->snapshots != NULL ? context->snapshots->version : 0);
+    atomic_store(&context->oldestSnapshot, oldest != NULL ? oldest->version : ULONG_MAX);
+
+    //removed folders that no snapshot can read anymore
+    Tree* retired = NULL;
+    Tree** deferred = &context->deferred;
+    while(*deferred != NULL){
+        Tree* folder = *deferred;
+        if(folder->removedAt <= atomic_load(&context->oldestSnapshot)){
+            *deferred = folder->nextDeferred;
+            folder->nextDeferred = retired;
+            retired = folder;
+        }
+        else{
+            deferred = &folder->nextDeferred;
+        }
+    }
+    pthread_mutex_unlock(&context->snapshotMutex);
+
+    while(retired != NULL){
+        Tree* next = retired->nextDeferred;
+        reclaimer_retire(context->reclaimer, &retired->retired);
+        retired = next;
+    }
+    forgettingKept(context);
+    free(snapshot);
+}
+
+
+//the folder at `path` (a valid one) in the snapshot, NULL if there was no such folder; nothing is locked, the names of every folder
+//on the way are read in their state at the version of the snapshot
+Tree* snapshotFolder(TreeSnapshot* snapshot, const char* path){
+    Tree* folder = rootOf(snapshot->tree);
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    const char* subpath = split_path(path, component);
+    while(subpath != NULL){
+        folder = sset_get_at(folder->names, component, snapshot->version);
+        if(folder == NULL){
+            return NULL;
+        }
+        subpath = split_path(subpath, component);
+    }
+    return folder;
+}
+
+
+char* tree_snapshot_list(TreeSnapshot* snapshot, const char* path){
+    if(is_path_valid(path) == false){
+        return NULL;
+    }
+    Tree* folder = snapshotFolder(snapshot, path);
+    if(folder == NULL){
+        return NULL;
+    }
+
+    size_t size = 0;
+    const char* key;
+    SortedSetIterator it = sset_iterator_at(folder->names, NULL, snapshot->version);
+    while(sset_next(folder->names, &it, &key)){
+        size += strlen(key) + 1; //with a comma or the null character
+    }
+    char* result = malloc(size > 0 ? size : 1);
+    if(result == NULL){
+        return NULL;
+    }
+    char* position = result;
+    it = sset_iterator_at(folder->names, NULL, snapshot->version);
+    while(sset_next(folder->names, &it, &key)){
+        if(position != result){
+            *position = ',';
+            position++;
+        }
+        size_t keylen = strlen(key);
+        memcpy(position, key, keylen);
+        position += keylen;
+    }
+    *position = '\0';
+    return result;
+}
+
+
+int tree_snapshot_iterate(TreeSnapshot* snapshot, const char* path, TreeIterateCallback callback, void* context){
+    if(is_path_valid(path) == false){
+        return EINVAL;
+    }
+    Tree* folder = snapshotFolder(snapshot, path);
+    if(folder == NULL){
+        return ENOENT;
+    }
+    const char* key;
+    SortedSetIterator it = sset_iterator_at(folder->names, NULL, snapshot->version);
+    while(sset_next(folder->names, &it, &key)){
+        if(callback(key, context) == false){
+            break;
+        }
+    }
+    return 0;
+}
+
+
+//Saved trees: SAVE_MAGIC, then the folders in preorder - a folder is the number of its subfolders, followed by every subfolder
+//(in sorted order) as the length of its name (one byte), the name and the folder itself. Numbers are written in groups of 7 bits,
+//the lowest first, with the highest bit set in every byte but the last one
+void savingNumber(FILE* file, size_t number){
+    while(number >= 0x80){
+        putc((int) (number & 0x7f) | 0x80, file);
+        number >>= 7;
+    }
+    putc((int) number, file);
+}
+
+
+void savingName(FILE* file, const char* name){
+    size_t length = strlen(name);
+    putc((int) length, file);
+    fwrite(name, 1, length, file);
+}
+
+
+//writing the subfolders of `folder` as they are at `version` of a snapshot, read without any lock; `withIds` for checkpoints and the
+//journal, every folder is preceded by its id then
+void savingFolder(FILE* file, Tree* folder, unsigned long version, bool withIds){
+    if(withIds){
+        savingNumber(file, folder->id);
+    }
+    size_t count = 0;
+    const char* key;
+    void* child;
+    SortedSetIterator it = sset_iterator_at(folder->names, NULL, version);
+    while(sset_next(folder->names, &it, &key)){
+        count++;
+    }
+    savingNumber(file, count);
+    it = sset_iterator_at(folder->names, NULL, version);
+    while(sset_next_value(folder->names, &it, &key, &child)){
+        savingName(file, key);
+        savingFolder(file, child, version, withIds);
+    }
+}
+
+
+//syncing and closing a file written by tree_save (or tree_checkpoint), return 0 or the errno of the first write that failed
+int closingSaved(FILE* file){
+    int err = 0;
+    if(fflush(file) != 0 || fsync(fileno(file)) != 0){
+        err = errno;
+    }
+    else if(ferror(file)){ //an earlier write failed
+        err = EIO;
+    }
+    if(fclose(file) != 0 && err == 0){
+        err = errno;
+    }
+    return err;
+}
+
+
+int tree_save(Tree* tree, const char* path){
+    FILE* file = fopen(path, "wb");
+    if(file == NULL){
+        return errno;
+    }
+    setvbuf(file, NULL, _IOFBF, SAVE_BUFFER_SIZE);
+    TreeSnapshot* snapshot = tree_snapshot(tree); //writers go on while we write
+    if(snapshot == NULL){
+        fclose(file);
+        return ENOMEM;
+    }
+    fwrite(SAVE_MAGIC, 1, SAVE_MAGIC_LENGTH, file);
+    savingFolder(file, rootOf(tree), snapshot->version, false);
+    tree_snapshot_free(snapshot);
+    return closingSaved(file);
+}
+
+
+//reading a number written by savingNumber, false if it does not end before `end` (or does not fit)
+bool loadingNumber(const unsigned char** position, const unsigned char* end, size_t* number){
+    *number = 0;
+    for(unsigned shift = 0; shift < 8 * sizeof(size_t); shift += 7){
+        if(*position == end){
+            return false;
+        }
+        unsigned char byte = **position;
+        (*position)++;
+        *number |= (size_t) (byte & 0x7f) << shift;
+        if((byte & 0x80) == 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+
+//reading a name written by savingName, terminated in place (over its length); NULL if it is not a valid one
+char* loadingName(const unsigned char** position, const unsigned char* end){
+    size_t length = *position < end ? **position : 0;
+    if(length == 0 || length > MAX_FOLDER_NAME_LENGTH || (size_t) (end - *position) < length + 1){
+        return NULL;
+    }
+    char* name = (char*) *position; //the image is ours to change
+    memmove(name, name + 1, length);
+    name[length] = '\0';
+    *position += length + 1;
+    for(size_t l = 0; l < length; l++){
+        if(name[l] < 'a' || name[l] > 'z'){
+            return NULL;
+        }
+    }
+    return name;
+}
+
+
+//a tree rebuilt from its checkpoints and journal: its folders by their ids (NULL where there is none, or it was removed), with the ids
+//of the folders they are in (0 for the root, and while they are in none)
+typedef struct Recovery Recovery;
+
+struct Recovery {
+    Tree** folders;
+    unsigned long* parents;
+    size_t capacity;
+    unsigned long lastId; //the greatest one seen
+    unsigned long since; //the version of the latest checkpoint, the changes up to it are in it already
+    unsigned long lastVersion; //the greatest one seen
+    unsigned long segment; //of the journal, the first one after the latest checkpoint
+    unsigned long increment; //the number of the latest incremental checkpoint read
+    unsigned long merged; //the number of the latest incremental checkpoint that the full one includes
+    bool clean; //the folders read now are in a checkpoint, they are not changed since then (see changedAt)
+};
+
+
+//return 0, EINVAL if the id is not a valid one or it is taken already, or ENOMEM
+int rememberingFolder(Recovery* recovery, size_t id, Tree* folder){
+    if(id == 0 || id == SIZE_MAX){
+        return EINVAL;
+    }
+    if(id >= recovery->capacity){
+        size_t capacity = recovery->capacity > 0 ? 2 * recovery->capacity : 1024;
+        while(capacity <= id){
+            capacity *= 2;
+        }
+        Tree** folders = realloc(recovery->folders, capacity * sizeof(Tree*));
+        if(folders != NULL){
+            recovery->folders = folders;
+        }
+        unsigned long* parents = realloc(recovery->parents, capacity * sizeof(unsigned long));
+        if(parents != NULL){
+            recovery->parents = parents;
+        }
+        if(folders == NULL || parents == NULL){
+            return ENOMEM;
+        }
+        memset(folders + recovery->capacity, 0, (capacity - recovery->capacity) * sizeof(Tree*));
+        recovery->capacity = capacity;
+    }
+    if(recovery->folders[id] != NULL){
+        return EINVAL;
+    }
+    recovery->folders[id] = folder;
+    recovery->parents[id] = 0;
+    folder->id = id;
+    if(recovery->clean){
+        atomic_store(&folder->changedAt, 0);
+    }
+    if(id > recovery->lastId){
+        recovery->lastId = id;
+    }
+    return 0;
+}
+
+
+//making the sorted set and the filter of `folder` (which nobody else sees) for its `count` subfolders, given sorted by their names
+//return 0 or ENOMEM (then the folder is left as it was)
+int fillingFolder(Tree* folder, const char** names, void** children, size_t count){
+    NameFilter* filter = count > 0 ? nfilter_new(2 * count, NULL) : NULL;
+    SortedSet* sorted = sset_new_sorted(names, children, count);
+    if((count > 0 && filter == NULL) || sorted == NULL){
+        nfilter_free(filter);
+        if(sorted != NULL){
+            sset_free(sorted);
+        }
+        return ENOMEM;
+    }
+    for(size_t c = 0; c < count; c++){
+        nfilter_add(filter, names[c]);
+    }
+    nfilter_free(atomic_load(&folder->filter));
+    atomic_store(&folder->filter, filter);
+    sset_free(folder->names);
+    folder->names = sorted;
+    return 0;
+}
+
+
+//reading the subfolders of `folder` (a new one, which nobody else sees, so nothing is locked) with everything below them from a saved
+//tree at `*position`; the names come sorted, so they are put into the folder at once: its sorted set is built already balanced, its filter
+//is made for all of them. Names are terminated in place, over their lengths. `pathLength` is the length of the path of `folder`
+//with `recovery`, every folder comes with its id (see savingFolder) and is remembered there
+//return 0, EINVAL if the saved tree is corrupt, or ENOMEM (then the folders read so far are in the map of `folder`)
+int loadingFolder(Tree* folder, unsigned char** position, unsigned char* end, size_t pathLength, Recovery* recovery){
+    size_t count;
+    if(recovery != NULL){
+        size_t id;
+        if(loadingNumber((const unsigned char**) position, end, &id) == false){
+            return EINVAL;
+        }
+        int err = rememberingFolder(recovery, id, folder);
+        if(err != 0){
+            return err;
+        }
+    }
+    if(loadingNumber((const unsigned char**) position, end, &count) == false || count > (size_t) (end - *position) / 2){
+        return EINVAL; //every subfolder takes at least 2 bytes
+    }
+    if(count == 0){
+        return 0;
+    }
+    const char** names = malloc(count * sizeof(char*));
+    void** children = malloc(count * sizeof(void*));
+    int err = names == NULL || children == NULL ? ENOMEM : 0;
+    for(size_t c = 0; c < count && err == 0; c++){
+        size_t length = *position < end ? **position : 0;
+        char* name = loadingName((const unsigned char**) position, end);
+        if(name == NULL || pathLength + length + 1 > MAX_PATH_LENGTH || (c > 0 && strcmp(names[c - 1], name) >= 0)){
+            err = EINVAL;
+            break;
+        }
+        Tree* child = folderNew();
+        if(child == NULL){
+            err = ENOMEM;
+            break;
+        }
+        hmap_insert(folder->subfolders, name, child);
+        names[c] = name;
+        children[c] = child;
+        err = loadingFolder(child, position, end, pathLength + length + 1, recovery);
+        if(err == 0 && recovery != NULL){
+            recovery->parents[child->id] = folder->id;
+        }
+    }
+
+    if(err == 0){
+        err = fillingFolder(folder, names, children, count);
+    }
+    free(names);
+    free(children);
+    return err;
+}
+
+
+//the whole file at `path` in memory, freed by the caller; NULL if it cannot be read, then `*err` is set (EINVAL if it changes meanwhile)
+unsigned char* readingFile(const char* path, size_t* size, int* err){
+    FILE* file = fopen(path, "rb");
+    if(file == NULL){
+        *err = errno;
+        return NULL;
+    }
+    long length = -1;
+    if(fseek(file, 0, SEEK_END) == 0){
+        length = ftell(file);
+    }
+    unsigned char* image = length >= 0 ? malloc(length + 1) : NULL;
+    *err = 0;
+    if(length < 0){
+        *err = errno;
+    }
+    else if(image == NULL){
+        *err = ENOMEM;
+    }
+    else{
+        rewind(file);
+        if(fread(image, 1, length, file) != (size_t) length){
+            *err = ferror(file) ? EIO : EINVAL;
         }
+    }
+    fclose(file);
+    if(*err != 0){
+        free(image);
+        return NULL;
+    }
+    *size = length;
+    return image;
+}
+
+
+Tree* tree_load(const char* path){
+    size_t size;
+    int err;
+    unsigned char* image = readingFile(path, &size, &err);
+    if(image == NULL){
+        errno = err;
+        return NULL;
+    }
 
-        hmap_free(folderToRemove->subfolders);
-        pthread_mutex_destroy(&folderToRemove->monitor->mutex);
-        pthread_cond_destroy(&folderToRemove->monitor->toRead);
-        pthread_cond_destroy(&folderToRemove->monitor->toWrite);
-        free(folderToRemove->monitor);
-        free(folderToRemove);
-        hmap_remove(pointer->subfolders, component);
-        free(newPath);
-        returningFromWork(foldersArray, i, true);
-        return 0;
+    Tree* tree = NULL;
+    if(size < SAVE_MAGIC_LENGTH || memcmp(image, SAVE_MAGIC, SAVE_MAGIC_LENGTH) != 0){
+        err = EINVAL;
+    }
+    if(err == 0){
+        tree = tree_new();
+        err = tree == NULL ? ENOMEM : 0;
+    }
+    if(err == 0){
+        unsigned char* position = image + SAVE_MAGIC_LENGTH;
+        err = loadingFolder(rootOf(tree), &position, image + size, 1, NULL);
+        if(err == 0 && position != image + size){
+            err = EINVAL;
+        }
+    }
+    free(image);
+    if(err != 0){
+        if(tree != NULL){
+            tree_free(tree);
+        }
+        errno = err;
+        return NULL;
     }
+    return tree;
+}
 
 
-    const char* name_start = newPath + 1; //element after "/"
-    Tree* pointer = tree;
-    pointer = hmap_get(pointer->subfolders, "/");
-    while (name_start < newPath + len) {
-        char* name_end = strchr(name_start, '/'); // end of current path component, at '/'.
-        int lenTemp = 0;
-        for (const char* p = name_start; p != name_end; ++p){
-            lenTemp++;
+//writing the subfolders of `folder` (as they are at `version` of a snapshot) into the image, before the folder itself;
+//return the offset of the folder in the image, 0 if out of memory
+uint64_t imagingFolder(TreeImageWriter* writer, Tree* folder, unsigned long version){
+    size_t count = 0;
+    const char* key;
+    void* child;
+    SortedSetIterator it = sset_iterator_at(folder->names, NULL, version);
+    while(sset_next(folder->names, &it, &key)){
+        count++;
+    }
+    const char** names = malloc(count * sizeof(char*) + 1);
+    uint64_t* offsets = malloc(count * sizeof(uint64_t) + 1);
+    uint64_t offset = 0;
+    if(names != NULL && offsets != NULL){
+        size_t c = 0;
+        it = sset_iterator_at(folder->names, NULL, version);
+        while(sset_next_value(folder->names, &it, &key, &child)){
+            names[c] = key; //valid as long as the snapshot
+            offsets[c] = imagingFolder(writer, child, version);
+            if(offsets[c] == 0){
+                break;
+            }
+            c++;
+        }
+        if(c == count){
+            offset = timage_writer_add(writer, names, offsets, count);
         }
+    }
+    free(names);
+    free(offsets);
+    return offset;
+}
 
-        char folderName[lenTemp + 1];
-        strncpy(folderName, name_start, lenTemp);
-        folderName[lenTemp] = '\0';
+int tree_save_image(Tree* tree, const char* path){
+    TreeImageWriter* writer = timage_writer_new(path);
+    if(writer == NULL){
+        return errno;
+    }
+    TreeSnapshot* snapshot = tree_snapshot(tree); //writers go on while we write
+    uint64_t root = 0;
+    if(snapshot != NULL){
+        root = imagingFolder(writer, rootOf(tree), snapshot->version);
+        tree_snapshot_free(snapshot);
+    }
+    int err = timage_writer_finish(writer, root);
+    return root == 0 ? ENOMEM : err;
+}
 
-        pointer = hmap_get(pointer->subfolders, folderName);
-        if(pointer == NULL){
-            free(newPath);
-            returningFromWork(foldersArray, i, true);
-            return ENOENT;
-        }
-        name_start = name_end + 1;
+
+Tree* recoveredFolder(Recovery* recovery, size_t id){
+    return id < recovery->capacity ? recovery->folders[id] : NULL;
+}
+
+
+//`folder` with everything inside of it is removed, its ids cannot be used by the following changes
+void forgettingFolders(Recovery* recovery, Tree* folder){
+    recovery->folders[folder->id] = NULL;
+    const char* key;
+    void* value;
+    HashMapIterator it = hmap_iterator(folder->subfolders);
+    while (hmap_next(folder->subfolders, &it, &key, &value)){
+        forgettingFolders(recovery, value);
     }
+}
 
-    Tree* folderToRemove = hmap_get(pointer->subfolders, component);
-    if(folderToRemove == NULL){
-        free(newPath);
-        returningFromWork(foldersArray, i, true);
-        return ENOENT;
+
+//applying a change read from the journal (see journaling) to the tree being recovered, which nobody else sees yet, so nothing is locked;
+//changes that are in the checkpoint already, or that were made inside of a removed folder, are skipped
+int replayingChange(unsigned char* record, size_t length, void* context){
+    Recovery* recovery = context;
+    const unsigned char* position = record + 1;
+    const unsigned char* end = record + length;
+    size_t version;
+    size_t parentId;
+    char* name = NULL;
+    if(loadingNumber(&position, end, &version) == false || loadingNumber(&position, end, &parentId) == false
+       || (name = loadingName(&position, end)) == NULL){
+        return EINVAL;
     }
-    HashMap* foldersMap = folderToRemove->subfolders;
-    if(hmap_size(foldersMap) != 0){ //folder to delete not empty
-        free(newPath);
-        returningFromWork(foldersArray, i, true);
-        return ENOTEMPTY;
+    if(version > recovery->lastVersion){
+        recovery->lastVersion = version;
+    }
+    Tree* parent = recoveredFolder(recovery, parentId);
+    if(version <= recovery->since || parent == NULL){
+        return 0;
     }
 
-    //free the deleted folder
-    hmap_free(folderToRemove->subfolders);
-    pthread_mutex_destroy(&folderToRemove->monitor->mutex);
-    pthread_cond_destroy(&folderToRemove->monitor->toRead);
-    pthread_cond_destroy(&folderToRemove->monitor->toWrite);
-    free(folderToRemove->monitor);
-    free(folderToRemove);
-    hmap_remove(pointer->subfolders, component);
-    free(newPath);
-    returningFromWork(foldersArray, i, true);
+    if(record[0] == 'l'){
+        Tree* folder = folderNew();
+        if(folder == NULL){
+            return ENOMEM;
+        }
+        unsigned char* rest = (unsigned char*) position;
+        int err = loadingFolder(folder, &rest, record + length, 1, recovery);
+        if(err == 0 && (rest != record + length || hmap_get(parent->subfolders, name) != NULL)){
+            err = EINVAL;
+        }
+        if(err == 0 && linking(NULL, parent, name, folder) != 0){
+            forgettingFolders(recovery, folder);
+            err = ENOMEM;
+        }
+        if(err != 0){
+            folderFreeRecursively(folder, NULL);
+            return err;
+        }
+        recovery->parents[folder->id] = parent->id;
+        atomic_store(&parent->changedAt, parent->version);
+        return 0;
+    }
+
+    Tree* folder = hmap_get(parent->subfolders, name);
+    Tree* targetParent = NULL;
+    char* target = NULL;
+    if(record[0] == 'm'){
+        size_t targetId;
+        if(loadingNumber(&position, end, &targetId) == false || (target = loadingName(&position, end)) == NULL){
+            return EINVAL;
+        }
+        targetParent = recoveredFolder(recovery, targetId);
+        if(targetParent != NULL && hmap_get(targetParent->subfolders, target) != NULL){
+            return EINVAL;
+        }
+    }
+    else if(record[0] != 'u'){
+        return EINVAL;
+    }
+    if(folder == NULL || position != end){
+        return EINVAL;
+    }
+    if(targetParent != NULL && linking(NULL, targetParent, target, folder) != 0){
+        return ENOMEM;
+    }
+    unlinking(NULL, parent, name);
+    atomic_store(&parent->changedAt, parent->version);
+    if(targetParent != NULL){
+        recovery->parents[folder->id] = targetParent->id;
+        atomic_store(&targetParent->changedAt, targetParent->version);
+    }
+    else{ //removed, or moved into a removed folder
+        forgettingFolders(recovery, folder);
+        folderFreeRecursively(folder, NULL);
+    }
     return 0;
 }
 
 
+//making sure that the versions given from now on are greater than `version`
+void raisingVersion(unsigned long version){
+    unsigned long last = atomic_load(&lastVersion);
+    while(last < version && atomic_compare_exchange_weak(&lastVersion, &last, version) == false){
+    }
+}
 
-bool is_substring(const char* first, const char* second){ //first is the source, second - the destination
-    size_t lenFirst = strlen(first);
-    size_t lenSecond = strlen(second);
 
-    if(lenFirst > lenSecond){
-        return false;
+//`path` followed by `suffix`, freed by the caller; NULL if out of memory
+char* pathWith(const char* path, const char* suffix){
+    size_t length = strlen(path);
+    char* joined = malloc(length + strlen(suffix) + 1);
+    if(joined != NULL){
+        memcpy(joined, path, length);
+        strcpy(joined + length, suffix);
     }
+    return joined;
+}
 
-    char string[lenFirst + 1];
-    strncpy(string, second, lenFirst);
-    string[lenFirst] = '\0';
-    if(strcmp(first, string) == 0){
-        return true;
+
+//the file of the incremental checkpoint `number` of the tree at `path`, freed by the caller; NULL if out of memory
+char* incrementPath(const char* path, unsigned long number){
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".checkpoint.%lu", number);
+    return pathWith(path, suffix);
+}
+
+
+//setting `*folder` to the folder `id` of the tree being recovered, a new (empty) one if there is none yet; return 0, EINVAL or ENOMEM
+int recoveringFolder(Recovery* recovery, size_t id, Tree** folder){
+    *folder = recoveredFolder(recovery, id);
+    if(*folder != NULL){
+        return 0;
     }
-    return false;
+    *folder = folderNew();
+    if(*folder == NULL){
+        return ENOMEM;
+    }
+    int err = rememberingFolder(recovery, id, *folder);
+    if(err != 0){
+        folderFree(*folder);
+    }
+    return err;
 }
 
 
+//applying the next folder of an incremental checkpoint (see loadingCheckpoints): it gets the subfolders it has there, and the ones it had
+//before go to the list of `dropped` folders (linked through nextDeferred, which nobody uses while the tree is recovered), unless another
+//folder of the checkpoint has claimed them already
+int applyingFolder(Recovery* recovery, Tree* root, const unsigned char** position, const unsigned char* end, Tree** dropped){
+    size_t id;
+    size_t count;
+    if(loadingNumber(position, end, &id) == false || loadingNumber(position, end, &count) == false
+       || count > (size_t) (end - *position) / 3){
+        return EINVAL; //every subfolder takes at least 3 bytes
+    }
+    Tree* folder;
+    int err = recoveringFolder(recovery, id, &folder);
+    if(err != 0 || count == 0){
+        count = 0;
+    }
+    const char** names = count > 0 ? malloc(count * sizeof(char*)) : NULL;
+    void** children = count > 0 ? malloc(count * sizeof(void*)) : NULL;
+    if(count > 0 && (names == NULL || children == NULL)){
+        err = ENOMEM;
+    }
+    for(size_t c = 0; c < count && err == 0; c++){
+        size_t childId;
+        Tree* child;
+        char* name = loadingName(position, end);
+        if(name == NULL || (c > 0 && strcmp(names[c - 1], name) >= 0) || loadingNumber(position, end, &childId) == false
+           || childId == id || childId == root->id){
+            err = EINVAL;
+            break;
+        }
+        err = recoveringFolder(recovery, childId, &child);
+        names[c] = name;
+        children[c] = child;
+    }
 
-int tree_move(Tree* tree, const char* source, const char* target){
+    if(err == 0){
+        err = fillingFolder(folder, names, children, count);
+    }
+    if(err == 0){
+        const char* key;
+        void* value;
+        HashMapIterator it = hmap_iterator(folder->subfolders);
+        while (hmap_next(folder->subfolders, &it, &key, &value)){
+            Tree* child = value;
+            if(recovery->parents[child->id] == folder->id){
+                recovery->parents[child->id] = 0;
+                child->nextDeferred = *dropped;
+                *dropped = child;
+            }
+        }
+        hmap_free(folder->subfolders);
+        folder->subfolders = hmap_new();
+        for(size_t c = 0; c < count; c++){
+            Tree* child = children[c];
+            hmap_insert(folder->subfolders, names[c], child);
+            recovery->parents[child->id] = folder->id;
+        }
+    }
+    free(names);
+    free(children);
+    return err;
+}
 
-    size_t lenCheck = strlen(source);
-    if(lenCheck == 1){ //root given
-        return EBUSY;
+
+//putting `folder`, which is in no folder after an incremental checkpoint, on the list of `orphans` (linked through nextKept, which nobody
+//uses while the tree is recovered) with everything inside of it that is not in other folders either; they are freed once all of them are
+//found, as an orphan may still have a subfolder that went into another orphan meanwhile
+void orphaningFolder(Recovery* recovery, Tree* folder, Tree** orphans){
+    recovery->folders[folder->id] = NULL;
+    folder->nextKept = *orphans;
+    *orphans = folder;
+    const char* key;
+    void* value;
+    HashMapIterator it = hmap_iterator(folder->subfolders);
+    while (hmap_next(folder->subfolders, &it, &key, &value)){
+        Tree* child = value;
+        if(recovery->parents[child->id] == folder->id){
+            orphaningFolder(recovery, child, orphans);
+        }
     }
+}
 
-    size_t lenCheckTarget = strlen(target);
-    if(lenCheckTarget == 1){
-        return EEXIST;
+
+//reading the incremental checkpoint `number` of the tree at `path` into the tree being recovered, return ENOENT if there is none;
+//the folders that it does not put anywhere were removed since the checkpoint before it
+int loadingIncrement(Tree* tree, const char* path, Recovery* recovery, unsigned long number){
+    char* increment = incrementPath(path, number);
+    if(increment == NULL){
+        return ENOMEM;
+    }
+    size_t size;
+    int err;
+    unsigned char* image = readingFile(increment, &size, &err);
+    free(increment);
+    if(image == NULL){
+        return err;
+    }
+    const unsigned char* position = image + SAVE_MAGIC_LENGTH;
+    const unsigned char* end = image + size;
+    size_t version;
+    size_t segment;
+    size_t previous;
+    if(size < SAVE_MAGIC_LENGTH || memcmp(image, INCREMENT_MAGIC, SAVE_MAGIC_LENGTH) != 0 || loadingNumber(&position, end, &version) == false
+       || loadingNumber(&position, end, &segment) == false || segment == 0 || loadingNumber(&position, end, &previous) == false
+       || previous != recovery->since){
+        err = EINVAL;
+    }
+    Tree* dropped = NULL;
+    while(err == 0 && position != end){
+        err = applyingFolder(recovery, rootOf(tree), &position, end, &dropped);
+    }
+    if(err == 0){ //otherwise some of them may be claimed still, they are left to leak
+        Tree* orphans = NULL;
+        for(; dropped != NULL; dropped = dropped->nextDeferred){
+            if(recovery->parents[dropped->id] == 0 && recovery->folders[dropped->id] == dropped){
+                orphaningFolder(recovery, dropped, &orphans);
+            }
+        }
+        while(orphans != NULL){
+            Tree* next = orphans->nextKept;
+            folderFree(orphans);
+            orphans = next;
+        }
+        recovery->since = version;
+        recovery->lastVersion = version;
+        recovery->segment = segment;
+        recovery->increment = number;
     }
+    free(image);
+    return err;
+}
 
-    char* toLatestAncestor = latestCommonAncestor(source, target);
-    size_t helpme = strlen(toLatestAncestor);
-    Tree* tablicaKolejnychFolderow[helpme];
-    int i;
-    if(goingToWork(tree, toLatestAncestor, tablicaKolejnychFolderow, &i) == ENOENT){
-        free(toLatestAncestor);
-        returningFromWork(tablicaKolejnychFolderow, i, false);
-        return ENOENT;
+
+//Checkpoints: CHECKPOINT_MAGIC (as long as SAVE_MAGIC), the version of the snapshot, the segment of the journal that follows it, the number
+//of the latest incremental checkpoint merged into it, then the root as savingFolder writes it with ids
+//Incremental checkpoints ("<path>.checkpoint.<n>", numbered on from that one): INCREMENT_MAGIC, the version of the snapshot, the segment,
+//the version of the checkpoint before it, then every folder changed since that one (see changedAt) as its id, the number of its subfolders
+//and each of them as its name and id
+//reading the checkpoint of the tree at `path` into the new `tree`, then the incremental ones after it up to `upTo`; without a checkpoint
+//the tree stays empty (with the root as the folder 1) and the journal starts at segment 1
+int loadingCheckpoints(Tree* tree, const char* path, Recovery* recovery, unsigned long upTo){
+    char* checkpoint = pathWith(path, ".checkpoint");
+    if(checkpoint == NULL){
+        return ENOMEM;
     }
-    free(toLatestAncestor);
+    size_t size;
+    int err;
+    unsigned char* image = readingFile(checkpoint, &size, &err);
+    free(checkpoint);
+    recovery->clean = true;
+    if(image == NULL){
+        recovery->segment = 1;
+        return err == ENOENT ? rememberingFolder(recovery, 1, rootOf(tree)) : err;
+    }
+    const unsigned char* position = image + SAVE_MAGIC_LENGTH;
+    size_t since;
+    size_t first;
+    size_t merged;
+    if(size < SAVE_MAGIC_LENGTH || memcmp(image, CHECKPOINT_MAGIC, SAVE_MAGIC_LENGTH) != 0 || loadingNumber(&position, image + size, &since) == false
+       || loadingNumber(&position, image + size, &first) == false || first == 0 || loadingNumber(&position, image + size, &merged) == false){
+        err = EINVAL;
+    }
+    if(err == 0){
+        unsigned char* rest = (unsigned char*) position;
+        err = loadingFolder(rootOf(tree), &rest, image + size, 1, recovery);
+        if(err == 0 && rest != image + size){
+            err = EINVAL;
+        }
+        recovery->since = since;
+        recovery->lastVersion = since;
+        recovery->segment = first;
+        recovery->increment = merged;
+        recovery->merged = merged;
+    }
+    free(image);
+    while(err == 0 && recovery->increment < upTo){
+        err = loadingIncrement(tree, path, recovery, recovery->increment + 1);
+    }
+    return err == ENOENT ? 0 : err; //the latest one was read
+}
 
-    if(is_path_valid(source) == false || is_path_valid(target) == false){
-        returningFromWork(tablicaKolejnychFolderow, i, true);
+
+//deleting the incremental checkpoints of the tree at `path` up to `number`; they are never skipped, so they end at the first one that is
+//not there. Return 0 or errno
+int droppingIncrements(const char* path, unsigned long number){
+    for(unsigned long n = number; n > 0; n--){
+        char* increment = incrementPath(path, n);
+        if(increment == NULL){
+            return ENOMEM;
+        }
+        int err = unlink(increment) == 0 ? 0 : errno;
+        free(increment);
+        if(err == ENOENT){
+            return 0;
+        }
+        if(err != 0){
+            return err;
+        }
+    }
+    return 0;
+}
+
+
+Tree* tree_recover(const char* path, TreeDurability durability){
+    Tree* tree = tree_new();
+    if(tree == NULL){
+        errno = ENOMEM;
+        return NULL;
+    }
+    TreeContext* context = contextOf(tree);
+    Recovery recovery;
+    memset(&recovery, 0, sizeof(Recovery));
+    unsigned long last;
+    context->journalPath = strdup(path);
+    int err = context->journalPath == NULL ? ENOMEM : 0;
+    if(err == 0){
+        err = loadingCheckpoints(tree, path, &recovery, ULONG_MAX);
+    }
+    if(err == 0){
+        raisingVersion(recovery.since); //so that the folders changed by the journal are newer than the checkpoints
+        recovery.clean = false;
+        err = journal_replay(path, recovery.segment, replayingChange, &recovery, &last);
+    }
+    if(err == 0){
+        err = journal_drop(path, recovery.segment); //left by a checkpoint that did not finish
+    }
+    if(err == 0){
+        err = droppingIncrements(path, recovery.merged); //the same
+    }
+    if(err == 0){
+        raisingVersion(recovery.lastVersion);
+        atomic_store(&context->lastId, recovery.lastId);
+        context->checkpointed = recovery.since;
+        context->increment = recovery.increment;
+        context->merged = recovery.merged;
+        context->durability = durability;
+        context->journal = journal_open(path, last);
+        if(context->journal == NULL){
+            err = errno;
+        }
+    }
+    free(recovery.folders);
+    free(recovery.parents);
+    if(err != 0){
+        tree_free(tree);
+        errno = err;
+        return NULL;
+    }
+    return tree;
+}
+
+
+int tree_sync(Tree* tree, TreeDurability durability){
+    Journal* journal = contextOf(tree)->journal;
+    if(journal == NULL){
         return EINVAL;
     }
+    return journal_wait(journal, journal_position(journal), (JournalDurability) durability);
+}
 
 
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    char* pathSourceParent = make_path_to_parent(source, component);
-    size_t len = strlen(pathSourceParent);
+//writing the checkpoint of the tree at `version` (whose segment is `segment`, and which has the incremental checkpoints up to `merged`),
+//reading its folders at `readAt`: the version of a snapshot, or ULONG_MAX for a tree that nobody else sees
+int writingCheckpoint(const char* path, Tree* root, unsigned long version, unsigned long segment, unsigned long merged, unsigned long readAt){
+    FILE* file = fopen(path, "wb");
+    if(file == NULL){
+        return errno;
+    }
+    setvbuf(file, NULL, _IOFBF, SAVE_BUFFER_SIZE);
+    fwrite(CHECKPOINT_MAGIC, 1, SAVE_MAGIC_LENGTH, file);
+    savingNumber(file, version);
+    savingNumber(file, segment);
+    savingNumber(file, merged);
+    savingFolder(file, root, readAt, true);
+    return closingSaved(file);
+}
 
-    Tree* sourceParent = tree;
-    sourceParent = hmap_get(sourceParent->subfolders, "/");
-    Tree* folderToMove;
 
-    if(len == 1){ //path to parent like "/"
-        folderToMove = hmap_get(sourceParent->subfolders, component);
-        if(folderToMove == NULL){
-            free(pathSourceParent);
-            returningFromWork(tablicaKolejnychFolderow, i, true);
-            return ENOENT;
+//writing the folders of the subtree of `folder`, as they are at `version` of a snapshot, that were changed after `since`
+void savingChanged(FILE* file, Tree* folder, unsigned long version, unsigned long since){
+    const char* key;
+    void* child;
+    SortedSetIterator it;
+    if(atomic_load(&folder->changedAt) > since){
+        size_t count = 0;
+        it = sset_iterator_at(folder->names, NULL, version);
+        while(sset_next(folder->names, &it, &key)){
+            count++;
         }
+        savingNumber(file, folder->id);
+        savingNumber(file, count);
+        it = sset_iterator_at(folder->names, NULL, version);
+        while(sset_next_value(folder->names, &it, &key, &child)){
+            savingName(file, key);
+            savingNumber(file, ((Tree*) child)->id);
+        }
+    }
+    it = sset_iterator_at(folder->names, NULL, version);
+    while(sset_next_value(folder->names, &it, &key, &child)){
+        savingChanged(file, child, version, since);
+    }
+}
 
+
+//writing the incremental checkpoint of the tree at `version` of a snapshot (whose segment is `segment`), after the checkpoint at `since`
+int writingIncrement(const char* path, Tree* root, unsigned long version, unsigned long segment, unsigned long since){
+    FILE* file = fopen(path, "wb");
+    if(file == NULL){
+        return errno;
     }
-    else{
-        const char* name_start = pathSourceParent + 1; //element after "/"
-        while (name_start < pathSourceParent + len) {
-            char* name_end = strchr(name_start, '/'); // End of current path component, at '/'.
-            int lenTemp = 0;
-            for (const char* p = name_start; p != name_end; ++p){
-                lenTemp++;
-            }
+    setvbuf(file, NULL, _IOFBF, SAVE_BUFFER_SIZE);
+    fwrite(INCREMENT_MAGIC, 1, SAVE_MAGIC_LENGTH, file);
+    savingNumber(file, version);
+    savingNumber(file, segment);
+    savingNumber(file, since);
+    savingChanged(file, root, version, since);
+    return closingSaved(file);
+}
 
-            char folderName[lenTemp + 1];
-            strncpy(folderName, name_start, lenTemp);
-            folderName[lenTemp] = '\0';
 
-            sourceParent = hmap_get(sourceParent->subfolders, folderName);
-            if(sourceParent == NULL){
-                free(pathSourceParent);
-                returningFromWork(tablicaKolejnychFolderow, i, true);
-                return ENOENT;
-            }
-            name_start = name_end + 1;
+//merging the checkpoint with the incremental ones after it into a new checkpoint, on a thread of its own, so that nobody waits for it;
+//a full checkpoint written meanwhile makes the merged one useless. If it fails, the next incremental checkpoint starts it again
+void* compacting(void* argument){
+    Tree* tree = argument;
+    TreeContext* context = contextOf(tree);
+    pthread_mutex_lock(&context->checkpointMutex);
+    unsigned long upTo = context->increment;
+    unsigned long fullCheckpoints = context->fullCheckpoints;
+    pthread_mutex_unlock(&context->checkpointMutex);
+
+    Recovery recovery;
+    memset(&recovery, 0, sizeof(Recovery));
+    Tree* merged = tree_new(); //the checkpoints are read into it, as they would be by tree_recover
+    char* checkpoint = pathWith(context->journalPath, ".checkpoint");
+    char* written = pathWith(context->journalPath, ".checkpoint.merged");
+    int err = merged == NULL || checkpoint == NULL || written == NULL ? ENOMEM : 0;
+    if(err == 0){
+        err = loadingCheckpoints(merged, context->journalPath, &recovery, upTo);
+    }
+    if(err == 0){
+        err = writingCheckpoint(written, rootOf(merged), recovery.since, recovery.segment, recovery.increment, ULONG_MAX);
+    }
+    pthread_mutex_lock(&context->checkpointMutex);
+    if(err == 0 && fullCheckpoints == context->fullCheckpoints && rename(written, checkpoint) == 0){
+        context->merged = recovery.increment;
+        if(journal_sync_directory(context->journal) == 0){
+            droppingIncrements(context->journalPath, recovery.increment);
         }
-        folderToMove = hmap_get(sourceParent->subfolders, component);
-        if(folderToMove == NULL){
-            free(pathSourceParent);
-            returningFromWork(tablicaKolejnychFolderow, i, true);
-            return ENOENT;
+    }
+    else if(written != NULL){
+        unlink(written);
+    }
+    context->compacting = false;
+    pthread_mutex_unlock(&context->checkpointMutex);
+    free(recovery.folders);
+    free(recovery.parents);
+    free(checkpoint);
+    free(written);
+    if(merged != NULL){
+        tree_free(merged);
+    }
+    return NULL;
+}
+
+
+//starting the compactor once enough incremental checkpoints are not merged yet (with checkpointMutex held)
+void startingCompactor(Tree* tree){
+    TreeContext* context = contextOf(tree);
+    if(context->increment - context->merged < COMPACT_AFTER_INCREMENTS || context->compacting){
+        return;
+    }
+    if(context->compactorStarted){ //it is done already
+        pthread_join(context->compactor, NULL);
+    }
+    context->compacting = true;
+    context->compactorStarted = pthread_create(&context->compactor, NULL, compacting, tree) == 0;
+    if(context->compactorStarted == false){
+        context->compacting = false;
+    }
+}
+
+
+//writing a full or an incremental checkpoint; the journal goes on in a new segment before the snapshot is taken, so the older segments
+//have only the changes that are in the snapshot. The checkpoint is written next to its file and replaces it at once
+int checkpointing(Tree* tree, bool incremental){
+    TreeContext* context = contextOf(tree);
+    if(context->journal == NULL){
+        return EINVAL;
+    }
+    pthread_mutex_lock(&context->checkpointMutex);
+    incremental = incremental && context->checkpointed != 0; //there is nothing to start from yet
+    unsigned long number = context->increment + (incremental ? 1 : 0);
+    char* checkpoint = incremental ? incrementPath(context->journalPath, number) : pathWith(context->journalPath, ".checkpoint");
+    char* written = checkpoint != NULL ? pathWith(checkpoint, ".new") : NULL;
+    unsigned long segment;
+    int err = written == NULL ? ENOMEM : journal_rotate(context->journal, &segment);
+    TreeSnapshot* snapshot = NULL;
+    if(err == 0){
+        snapshot = tree_snapshot(tree);
+        err = snapshot == NULL ? ENOMEM : 0;
+    }
+    unsigned long version = snapshot != NULL ? snapshot->version : 0;
+    if(err == 0 && incremental){
+        err = writingIncrement(written, rootOf(tree), version, segment, context->checkpointed);
+    }
+    else if(err == 0){
+        err = writingCheckpoint(written, rootOf(tree), version, segment, number, version);
+    }
+    if(snapshot != NULL){
+        tree_snapshot_free(snapshot);
+    }
+    if(err == 0 && rename(written, checkpoint) != 0){
+        err = errno;
+    }
+    if(err == 0){ //the next incremental checkpoint starts from this one, whatever happens below
+        context->checkpointed = version;
+        if(incremental){
+            context->increment = number;
+        }
+        else{
+            context->merged = number;
+            context->fullCheckpoints++;
         }
+        err = journal_sync_directory(context->journal);
+    }
+    else if(written != NULL){
+        unlink(written);
+    }
+    if(err == 0){
+        err = journal_drop(context->journalPath, segment);
     }
+    if(err == 0 && incremental == false){
+        err = droppingIncrements(context->journalPath, number);
+    }
+    if(err == 0 && incremental){
+        startingCompactor(tree);
+    }
+    pthread_mutex_unlock(&context->checkpointMutex);
+    free(checkpoint);
+    free(written);
+    return err;
+}
 
 
-    char componentTarget[MAX_FOLDER_NAME_LENGTH + 1];
-    char* pathSourceParentTarget = make_path_to_parent(target, componentTarget);
-    size_t lenTarget = strlen(pathSourceParentTarget);
+int tree_checkpoint(Tree* tree){
+    return checkpointing(tree, false);
+}
+
+
+int tree_checkpoint_incremental(Tree* tree){
+    return checkpointing(tree, true);
+}
 
-    Tree* targetParent = tree;
-    targetParent = hmap_get(targetParent->subfolders, "/");
 
-    if(lenTarget == 1){ //path to parent like "/"
-        if(hmap_get(targetParent->subfolders, componentTarget) != NULL){
-            free(pathSourceParent);
-            free(pathSourceParentTarget);
-            returningFromWork(tablicaKolejnychFolderow, i, true);
-            return EEXIST;
+//telling the queue that `pending` has completed, with `result` (and `listing`)
+void completing(Pending* pending, int result, char* listing){
+    TreeQueue* queue = pending->queue;
+    free(pending->path);
+    free(pending->target);
+    free(pending->held);
+    pending->completion.result = result;
+    pending->completion.listing = listing;
+    pending->next = NULL;
+    pthread_mutex_lock(&queue->mutex);
+    if(queue->completed == NULL){
+        uint64_t one = 1;
+        if(write(queue->fd, &one, sizeof(one)) != sizeof(one)){
+            perror("eventfd write failed\n");
+            exit(1);
         }
-        hmap_remove(sourceParent->subfolders, component);
-        hmap_insert(targetParent->subfolders, componentTarget, folderToMove);
-        char temp[MAX_FOLDER_NAME_LENGTH + 1];
-        strncpy(temp, componentTarget, MAX_FOLDER_NAME_LENGTH + 1);
+        queue->completed = pending;
     }
     else{
-        const char* name_start = pathSourceParentTarget + 1; //element after "/"
-        while (name_start < pathSourceParentTarget + lenTarget) {
-            char* name_end = strchr(name_start, '/'); // End of current path componentTarget, at '/'.
-            int lenTemp = 0; //name lenght of the current folder
-            for (const char* p = name_start; p != name_end; ++p){
-                lenTemp++;
-            }
+        queue->lastCompleted->next = pending;
+    }
+    queue->lastCompleted = pending;
+    queue->inProgress--;
+    if(queue->inProgress == 0){
+        pthread_cond_broadcast(&queue->idle);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
 
-            char folderName[lenTemp + 1];
-            strncpy(folderName, name_start, lenTemp);
-            folderName[lenTemp] = '\0';
 
-            targetParent = hmap_get(targetParent->subfolders, folderName);
-            if(targetParent == NULL){
-                free(pathSourceParent);
-                free(pathSourceParentTarget);
-                returningFromWork(tablicaKolejnychFolderow, i, true);
-                return ENOENT;
-            }
-            name_start = name_end + 1;
+//the folder that `pending` was stopped by is its own now (the way it wanted to enter it)
+void enteredBlocked(Pending* pending){
+    pending->held[pending->heldCount++] = (HeldFolder) {pending->blockedOn, pending->asWriter};
+    folderRelease(pending->blockedOn);
+    pending->blockedOn = NULL;
+}
+
+
+//parking `pending` on the folder it could not enter, counted as waiting for it the way a thread would be, unless the folder can be
+//entered now; return whether it was parked - then it may be resumed on another thread right away, and it is not ours anymore
+bool parking(Pending* pending){
+    Monitor* m = pending->blockedOn->monitor;
+    bool asWriter = pending->asWriter;
+    pthread_mutex_lock(&m->mutex);
+    bool parked = mayEnter(m, asWriter) == false;
+    if(parked){ //whoever lets it go, when it is our turn, lets us in and resumes us
+        pending->next = NULL;
+        Pending** link = &m->parked;
+        while(*link != NULL){
+            link = &(*link)->next;
+        }
+        *link = pending;
+        if(asWriter){
+            m->writerWaiting++;
+            m->parkedWriters++;
+        }
+        else{
+            m->readerWaiting++;
+            m->parkedReaders++;
+        }
+    }
+    else if(asWriter){
+        m->writerNumber++;
+    }
+    else{
+        m->readerNumber++;
+    }
+    pthread_mutex_unlock(&m->mutex);
+    if(parked == false){
+        enteredBlocked(pending);
+    }
+    return parked;
+}
+
+
+//running an asynchronous operation from the start, until it either completes or is parked
+void runningTask(WorkPool* pool, void* arg){
+    (void) pool;
+    Pending* pending = arg;
+    if(pending->blockedOn != NULL){ //resumed, we were let in
+        enteredBlocked(pending);
+    }
+    Pending* previous = runningPending; //resuming runs us on the thread that let the folder go, if the pool has no memory
+    Tree* tree = pending->queue->tree;
+    for(;;){
+        runningPending = pending;
+        pending->replayed = 0;
+        char* list = NULL;
+        int result;
+        if(pending->kind == 'l'){
+            list = listing(tree, rootOf(tree), pending->path);
+            result = list != NULL ? 0 : is_path_valid(pending->path) ? ENOENT : EINVAL;
+        }
+        else if(pending->kind == 'c'){
+            result = creating(tree, rootOf(tree), pending->path);
+        }
+        else if(pending->kind == 'r'){
+            result = removing(tree, rootOf(tree), pending->path, false);
+        }
+        else{
+            result = moving(tree, rootOf(tree), pending->path, pending->target);
+        }
+        if(pending->blockedOn == NULL){
+            pending->replayed = 0;
+            lettingGoRest(pending); //if the walk went a shorter way this time
+            runningPending = previous;
+            completing(pending, result, list);
+            return;
+        }
+        runningPending = previous;
+        if(parking(pending)){
+            return;
         }
+    }
+}
 
-        if(hmap_get(targetParent->subfolders, componentTarget) != NULL){
-            free(pathSourceParent);
-            free(pathSourceParentTarget);
-            returningFromWork(tablicaKolejnychFolderow, i, true);
-            return EEXIST;
+
+//handing the operations that were let into a monitor back to the threads of their queues
+void resuming(Pending* parked){
+    while(parked != NULL){
+        Pending* next = parked->next;
+        if(wpool_submit(parked->queue->pool, runningTask, parked) == false){
+            runningTask(NULL, parked); //it does not wait for folders, so it cannot wait for the ones we hold
         }
+        parked = next;
+    }
+}
+
 
-        if(is_substring(source, target) == true){
-            free(pathSourceParent);
-            free(pathSourceParentTarget);
-            returningFromWork(tablicaKolejnychFolderow, i, true);
-            return -1; //source is subfolder of the target
+TreeQueue* tree_queue_new(Tree* tree, int threads){
+    TreeQueue* queue = malloc(sizeof(TreeQueue));
+    if(queue == NULL){
+        return NULL;
+    }
+    queue->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    queue->pool = queue->fd >= 0 ? wpool_new(threads) : NULL;
+    if(queue->pool == NULL){
+        if(queue->fd >= 0){
+            close(queue->fd);
         }
+        free(queue);
+        return NULL;
+    }
+    queue->tree = tree;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->idle, NULL);
+    queue->inProgress = 0;
+    queue->completed = NULL;
+    queue->lastCompleted = NULL;
+    return queue;
+}
+
 
-        hmap_remove(sourceParent->subfolders, component);
-        hmap_insert(targetParent->subfolders, componentTarget, folderToMove);
-        char temp2[MAX_FOLDER_NAME_LENGTH + 1]; //memory for new name of the folder
-        strncpy(temp2, componentTarget, MAX_FOLDER_NAME_LENGTH + 1);
+void tree_queue_free(TreeQueue* queue){
+    pthread_mutex_lock(&queue->mutex);
+    while(queue->inProgress > 0){ //parked ones too, they are not tasks of the pool
+        pthread_cond_wait(&queue->idle, &queue->mutex);
     }
+    pthread_mutex_unlock(&queue->mutex);
+    wpool_free(queue->pool);
+    while(queue->completed != NULL){
+        Pending* next = queue->completed->next;
+        free(queue->completed->completion.listing);
+        free(queue->completed);
+        queue->completed = next;
+    }
+    close(queue->fd);
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->idle);
+    free(queue);
+}
 
-    free(pathSourceParent);
-    free(pathSourceParentTarget);
-    returningFromWork(tablicaKolejnychFolderow, i, true);
+
+int tree_queue_fd(TreeQueue* queue){
+    return queue->fd;
+}
+
+
+size_t tree_queue_reap(TreeQueue* queue, TreeCompletion completions[], size_t max){
+    size_t count = 0;
+    pthread_mutex_lock(&queue->mutex);
+    while(count < max && queue->completed != NULL){
+        Pending* pending = queue->completed;
+        queue->completed = pending->next;
+        completions[count++] = pending->completion;
+        free(pending);
+    }
+    if(count > 0 && queue->completed == NULL){ //not readable anymore, until the next completion
+        uint64_t value;
+        if(read(queue->fd, &value, sizeof(value)) != sizeof(value)){
+            perror("eventfd read failed\n");
+            exit(1);
+        }
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return count;
+}
+
+
+//submitting an operation of the given kind to the threads of the queue
+int submitting(TreeQueue* queue, char kind, const char* path, const char* target, void* data){
+    Pending* pending = malloc(sizeof(Pending));
+    if(pending == NULL){
+        return ENOMEM;
+    }
+    pending->queue = queue;
+    pending->kind = kind;
+    pending->path = strdup(path);
+    pending->target = target != NULL ? strdup(target) : NULL;
+    pending->blockedOn = NULL;
+    //a walk holds at most one folder per component of its paths, and the folders it starts at
+    pending->held = malloc((strlen(path) + (target != NULL ? strlen(target) : 0) + 2) * sizeof(HeldFolder));
+    pending->heldCount = 0;
+    pending->replayed = 0;
+    pending->completion.data = data;
+    if(pending->path == NULL || (target != NULL && pending->target == NULL) || pending->held == NULL){
+        free(pending->path);
+        free(pending->target);
+        free(pending->held);
+        free(pending);
+        return ENOMEM;
+    }
+    pthread_mutex_lock(&queue->mutex);
+    queue->inProgress++;
+    pthread_mutex_unlock(&queue->mutex);
+    if(wpool_submit(queue->pool, runningTask, pending) == false){
+        pthread_mutex_lock(&queue->mutex);
+        queue->inProgress--;
+        if(queue->inProgress == 0){
+            pthread_cond_broadcast(&queue->idle);
+        }
+        pthread_mutex_unlock(&queue->mutex);
+        free(pending->path);
+        free(pending->target);
+        free(pending->held);
+        free(pending);
+        return ENOMEM;
+    }
     return 0;
 }
 
 
+int tree_submit_list(TreeQueue* queue, const char* path, void* data){
+    return submitting(queue, 'l', path, NULL, data);
+}
+
+
+int tree_submit_create(TreeQueue* queue, const char* path, void* data){
+    return submitting(queue, 'c', path, NULL, data);
+}
+
+
+int tree_submit_remove(TreeQueue* queue, const char* path, void* data){
+    return submitting(queue, 'r', path, NULL, data);
+}
+
+
+int tree_submit_move(TreeQueue* queue, const char* source, const char* target, void* data){
+    return submitting(queue, 'm', source, target, data);
+}
@@ -1,4 +1,6 @@
 #pragma once
+#include <stdbool.h>
+#include <sys/types.h>
 
 typedef struct Tree Tree; // Let "Tree" mean the same as "struct Tree".
 
@@ -8,8 +10,266 @@ void tree_free(Tree*);
 
 char* tree_list(Tree* tree, const char* path);
 
+// Like tree_list, but write the listing into `buffer` instead of allocating it.
+// Set `*needed` (if not NULL) to the size of the listing, including the terminating null character.
+// Return 0 on success, ERANGE (with `buffer` untouched) if `capacity` is smaller than that - `buffer`
+// may be NULL to only ask for the size - ENOENT / EINVAL like tree_list, or ENOMEM.
+int tree_list_into(Tree* tree, const char* path, char* buffer, size_t capacity, size_t* needed);
+
+// Like tree_list, but only the first `limit` names greater than `after` (or from the first one, if `after` is NULL).
+// Set `*next` to NULL if that was the last page, otherwise to a continuation token - to be passed as `after` to get
+// the next page, and freed by the caller. Only the names of the page are visited, the folder is not sorted nor copied.
+// Return NULL (with `*next` NULL too) and set errno to EINVAL if the path is invalid or `limit` is 0, ENOENT if the
+// path does not exist, or ENOMEM.
+char* tree_list_page(Tree* tree, const char* path, const char* after, size_t limit, char** next);
+
+// Called by tree_iterate with each name; returning false stops the iteration.
+typedef bool (*TreeIterateCallback)(const char* name, void* context);
+
+// Call `callback` with the name of every subfolder of `path`, in sorted order, with `context` as its second argument.
+// The folder is locked only while the next chunk of names is copied, never during callbacks, so the iteration does not
+// block other operations for its whole duration. Each name is reported at most once; names created or removed meanwhile
+// may or may not be reported. If the folder is removed meanwhile, the iteration ends early.
+// Return 0, or ENOENT / EINVAL if the path does not exist / is invalid.
+int tree_iterate(Tree* tree, const char* path, TreeIterateCallback callback, void* context);
+
+// Changes of the listing of `path` since its version `since`, for clients that keep a copy of it.
+// Set `*version` to the current version of the folder (0 is never one). Then:
+// - if `since` is that version, return 0 with `*added` and `*removed` set to NULL (unchanged, nothing allocated);
+// - if `since` is one of the folder's recent versions, return 0 with `*added` and `*removed` set to the sorted,
+//   comma-separated names added and removed since then;
+// - otherwise (too old, or not a version of this folder), return ESTALE with `*added` set to the whole listing
+//   and `*removed` to NULL - so `since` = 0 gives the listing together with its version.
+// Strings are freed by the caller. Return ENOENT / EINVAL / ENOMEM (nothing allocated) on failure.
+int tree_list_since(Tree* tree, const char* path, unsigned long since, unsigned long* version, char** added, char** removed);
+
 int tree_create(Tree* tree, const char* path);
 
+// Like tree_create, but also create all the missing folders on the way (like mkdir -p), in a single walk.
+// Return 0 if the folder was created or already existed, EINVAL if the path is invalid, or ENOMEM (then nothing
+// is created).
+int tree_create_all(Tree* tree, const char* path);
+
 int tree_remove(Tree* tree, const char* path);
 
+// Like tree_remove, but also remove everything inside of the folder. Only taking the folder out of its parent
+// happens right away, the folders inside are freed later by a background thread. Their watches see them removed,
+// and operations through their handles fail with ENOENT from then on.
+int tree_remove_recursive(Tree* tree, const char* path);
+
 int tree_move(Tree* tree, const char* source, const char* target);
+
+// Copy the folder `source` with everything inside of it to `target` (like cp -r). The copy is made on the
+// threads of the tree (if there is more than one processor) and linked at `target` at once; a folder changed
+// while it is being copied is copied either before or after the change. `target` may be inside of `source`.
+// Return 0, or ENOENT / EEXIST / EINVAL like tree_move, or ENOMEM.
+int tree_copy(Tree* tree, const char* source, const char* target);
+
+// Like tree_copy, but the copy of `source` in `from` is made at `target` in `to` (another tree, or the same one).
+// Only `to` is changed, and only by linking the finished copy.
+int tree_copy_between(Tree* from, const char* source, Tree* to, const char* target);
+
+typedef enum TreeBatchKind {
+    TREE_BATCH_LIST,
+    TREE_BATCH_CREATE,
+    TREE_BATCH_REMOVE,
+    TREE_BATCH_MOVE,
+} TreeBatchKind;
+
+// One operation of tree_apply_batch.
+typedef struct TreeBatchOp {
+    TreeBatchKind kind;
+    const char* path; // the source, for a move
+    const char* target; // only for a move
+} TreeBatchOp;
+
+typedef struct TreeBatchResult {
+    int result; // as returned by tree_create, tree_remove or tree_move; for a listing 0, or ENOENT / EINVAL / ENOMEM
+    char* listing; // the result of a listing with result 0 (freed by the caller), NULL otherwise
+} TreeBatchResult;
+
+// Apply the `n` operations of `ops`, putting the result of each one into the same place of `results`. The operations on one folder
+// (listing it, creating and removing its subfolders) are applied together while it is held once - as a writer, if any of them changes
+// it - and the folders above it stay held for the next folders below them, so they are walked once, not once per operation.
+// Between moves (which are applied one by one, in their places), operations are applied in the sorted order of their folders (a folder
+// before the ones inside of it), and in their own order within a folder: a folder can be created with its subfolders in one batch,
+// but one that is removed has to be emptied by an earlier batch (or before a move). Every operation is atomic, the batch is not.
+// On a journaled tree, the batch waits for the journal once, for all of its changes.
+// Return 0, or ENOMEM (then nothing is applied).
+int tree_apply_batch(Tree* tree, const TreeBatchOp ops[], size_t n, TreeBatchResult results[]);
+
+// A reference-counted handle to a folder, like a directory file descriptor for openat().
+// The *_at functions take paths relative to the handle's folder ("/" is the folder itself),
+// so they do not walk (nor lock) anything above it. A handle stays valid when the folder or
+// any of its ancestors is moved. If the folder is removed, operations through the handle
+// fail with ENOENT. All handles have to be closed before tree_free.
+typedef struct TreeHandle TreeHandle;
+
+// Return a handle to the folder at `path`, or NULL if the path is invalid or does not exist.
+TreeHandle* tree_open(Tree* tree, const char* path);
+
+void tree_close(TreeHandle* handle);
+
+char* tree_list_at(TreeHandle* handle, const char* path);
+
+int tree_list_into_at(TreeHandle* handle, const char* path, char* buffer, size_t capacity, size_t* needed);
+
+char* tree_list_page_at(TreeHandle* handle, const char* path, const char* after, size_t limit, char** next);
+
+int tree_iterate_at(TreeHandle* handle, const char* path, TreeIterateCallback callback, void* context);
+
+int tree_list_since_at(TreeHandle* handle, const char* path, unsigned long since, unsigned long* version, char** added, char** removed);
+
+int tree_create_at(TreeHandle* handle, const char* path);
+
+int tree_create_all_at(TreeHandle* handle, const char* path);
+
+int tree_remove_at(TreeHandle* handle, const char* path);
+
+int tree_remove_recursive_at(TreeHandle* handle, const char* path);
+
+int tree_move_at(TreeHandle* handle, const char* source, const char* target);
+
+int tree_copy_at(TreeHandle* handle, const char* source, const char* target);
+
+// A subscription to the changes of a folder's subfolders (or, if recursive, of all folders below it).
+// Events are kept in a ring of the watch until read; when it is full, new events are lost and the reader
+// is told about it. Only operations that reach the folder through it are seen by a recursive watch, so an
+// operation through a handle below the folder is not. Watches have to be removed before tree_free.
+typedef struct TreeWatch TreeWatch;
+
+typedef enum TreeEventType {
+    TREE_EVENT_CREATE, // `path` appeared (was created, or moved in from outside of the watched folder)
+    TREE_EVENT_REMOVE, // `path` disappeared (was removed, or moved out); "/" if it was the watched folder itself
+    TREE_EVENT_MOVE, // `path` was moved to `target`
+} TreeEventType;
+
+// Paths are relative to the watched folder. An event is a single allocation, freed by the caller with free().
+typedef struct TreeEvent {
+    TreeEventType type;
+    const char* path;
+    const char* target; // NULL unless it is a move
+} TreeEvent;
+
+// Watch the folder at `path`, keeping up to `capacity` unread events (rounded up to a power of two).
+// Return NULL if the path is invalid or does not exist. Operations that start after it returns are seen.
+TreeWatch* tree_watch(Tree* tree, const char* path, bool recursive, size_t capacity);
+
+TreeWatch* tree_watch_at(TreeHandle* handle, const char* path, bool recursive, size_t capacity);
+
+// Move up to `max` of the oldest unread events into `events`, return how many were moved. Set `*overflowed`
+// (if not NULL) to whether any event was lost since the last call - then a fresh tree_list is needed.
+size_t tree_watch_read(TreeWatch* watch, TreeEvent* events[], size_t max, bool* overflowed);
+
+// Stop watching and free the watch, together with its unread events.
+void tree_unwatch(TreeWatch* watch);
+
+// A consistent, read-only view of the whole tree at one moment, for backups and audits. Taking one waits only for the
+// changes that are in progress; afterwards the tree is changed as usual, and only the folders that change keep their
+// older subfolders for it (so it costs memory proportional to the changes made while it lives, not to the tree).
+// Reading it takes no locks and never waits for the tree. Snapshots have to be freed before tree_free.
+typedef struct TreeSnapshot TreeSnapshot;
+
+// Return a snapshot of the tree, or NULL if out of memory.
+TreeSnapshot* tree_snapshot(Tree* tree);
+
+// Like tree_list, but the folder as it was in the snapshot.
+char* tree_snapshot_list(TreeSnapshot* snapshot, const char* path);
+
+// Like tree_iterate, but the folder as it was in the snapshot. Names are valid until the snapshot is freed.
+int tree_snapshot_iterate(TreeSnapshot* snapshot, const char* path, TreeIterateCallback callback, void* context);
+
+void tree_snapshot_free(TreeSnapshot* snapshot);
+
+// Save the whole tree into the file at `path` (replacing it), as it is in a snapshot: other operations go on while it is written.
+// Return 0, or the errno of the file operation that failed (or ENOMEM).
+int tree_save(Tree* tree, const char* path);
+
+// Return a new tree with the folders saved by tree_save into the file at `path`. On failure return NULL and set errno to
+// the one of the file operation that failed, EINVAL if the file is not a saved tree, or ENOMEM.
+Tree* tree_load(const char* path);
+
+// Like tree_save, but write a read-only image of the tree, which can be used without loading it (see TreeImage.h).
+int tree_save_image(Tree* tree, const char* path);
+
+// How durable a change of a journaled tree (see tree_recover) is when the operation that made it returns.
+typedef enum TreeDurability {
+    TREE_DURABILITY_NONE, // queued for writing only, lost if the process dies before it is written
+    TREE_DURABILITY_WRITTEN, // written to the journal, lost only if the system goes down
+    TREE_DURABILITY_SYNCED, // written and synced to the disk
+} TreeDurability;
+
+// Return the tree kept at `path`: its latest checkpoint (see tree_checkpoint) with the changes journaled after it,
+// or an empty tree if there is nothing there yet. From then on every change of the tree (made by tree_create,
+// tree_remove, tree_move, tree_copy or any of their variants) is appended to a journal, in the files "<path>.<n>";
+// changes made at the same time are written and synced together. Operations that change the tree return once
+// their change is as durable as `durability` asks for; if the journal fails, they return the errno of the write that
+// failed (the change is made, but only in memory). On failure return NULL and set errno (EINVAL if the files are damaged).
+Tree* tree_recover(const char* path, TreeDurability durability);
+
+// Wait until every change made so far is as durable as `durability` asks for, when some of them need more than
+// the tree gives to all. Return 0, the error of the journal, or EINVAL if the tree is not journaled.
+int tree_sync(Tree* tree, TreeDurability durability);
+
+// Write the tree (as it is in a snapshot, so other operations go on meanwhile) into "<path>.checkpoint" and drop
+// the part of the journal that it replaces. Return 0, the errno of the file operation that failed, ENOMEM,
+// or EINVAL if the tree is not journaled.
+int tree_checkpoint(Tree* tree);
+
+// Like tree_checkpoint, but write into "<path>.checkpoint.<n>" only the folders whose subfolders changed since the previous
+// checkpoint (so it writes as much as was changed, although finding those folders still visits the whole tree). A full checkpoint
+// is written instead if there is none yet. Every few incremental checkpoints, a background thread merges them into the full one
+// (reading the whole tree into memory once more to do it); tree_recover reads the full checkpoint and the ones that are not merged yet.
+int tree_checkpoint_incremental(Tree* tree);
+
+// A queue of asynchronous operations, for event loops that must not wait for folders: submitting an operation returns at
+// once, and its result comes later as a completion of the queue. Operations are run on the threads of the queue; one that
+// finds a folder it has to enter held by others does not wait for it, but is parked on the folder (keeping the folders above
+// it) and run again once it is let in, so contended folders take no threads. A parked operation waits its turn like a waiting
+// thread: it keeps the ones that come after it out of the folder. On a journaled tree, the threads do wait for the journal.
+// Queues have to be freed before tree_free.
+typedef struct TreeQueue TreeQueue;
+
+typedef struct TreeCompletion {
+    void* data; // as submitted with the operation
+    int result; // as returned by its function; for a listing 0, or ENOENT / EINVAL / ENOMEM
+    char* listing; // the result of a listing with result 0 (freed by the caller), NULL otherwise
+} TreeCompletion;
+
+// Return a queue for operations on `tree`, run on `threads` threads, or NULL if out of memory (or threads).
+TreeQueue* tree_queue_new(Tree* tree, int threads);
+
+// Wait until every operation submitted to the queue completes, then free it together with the completions not taken.
+void tree_queue_free(TreeQueue* queue);
+
+// Return an eventfd (for poll, epoll or select), readable while the queue has completions to take.
+int tree_queue_fd(TreeQueue* queue);
+
+// Move up to `max` of the oldest completions into `completions`, return how many were moved. Never waits.
+size_t tree_queue_reap(TreeQueue* queue, TreeCompletion completions[], size_t max);
+
+// Submit tree_list, tree_create, tree_remove or tree_move, with `data` for its completion. Paths are copied.
+// Return 0, or ENOMEM (then it is not submitted).
+int tree_submit_list(TreeQueue* queue, const char* path, void* data);
+
+int tree_submit_create(TreeQueue* queue, const char* path, void* data);
+
+int tree_submit_remove(TreeQueue* queue, const char* path, void* data);
+
+int tree_submit_move(TreeQueue* queue, const char* source, const char* target, void* data);
+
+// Removed folders are freed by a background thread of the tree. Set (those that are not NULL) `*queued` to the number
+// of removed folders (or subtrees) waiting for it, `*reclaimed` to the number of those freed so far, and `*lastLagUs`,
+// `*maxLagUs` to how long the latest one and the longest one waited, in microseconds.
+void tree_reclaim_stats(Tree* tree, size_t* queued, size_t* reclaimed, unsigned long* lastLagUs, unsigned long* maxLagUs);
+
+// Start caching up to `capacity` full paths of recently visited folders, so that operations on them
+// do not have to walk (and lock) every folder from "/". Has to be called before the tree is shared.
+// A move or removal makes invalid only the entries of the paths that go through its folder. An operation that
+// finds its folder in the cache holds only that folder, like one through a handle: a move of a folder above it
+// that starts after the operation has entered it does not wait for the operation to finish. Entries keep the
+// folders on their paths in memory (even removed ones) until they are found invalid or evicted.
+void tree_enable_path_cache(Tree* tree, size_t capacity);
+
+// Set `*hits` and `*misses` to the number of path cache lookups that did, and did not, find the folder.
+void tree_path_cache_stats(Tree* tree, size_t* hits, size_t* misses);
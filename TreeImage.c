@@ -0,0 +1,289 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "TreeImage.h"
+#include "path_utils.h"
+
+// The layout of an image (all numbers in the byte order of the machine that wrote it):
+// - a Header at offset 0,
+// - Records of the folders, each at an offset divisible by 8: the Record, its Entries (sorted by name), then the
+//   listing text with its null character, padded with zeros to a multiple of 8.
+// The root folder is written last, every other folder before its parent.
+
+#define IMAGE_MAGIC "dirimg01"
+#define IMAGE_MAGIC_LENGTH 8
+
+// How much of an image is buffered before it is written.
+#define WRITE_BUFFER_SIZE (1 << 20)
+
+typedef struct Header Header;
+
+struct Header {
+    char magic[IMAGE_MAGIC_LENGTH];
+    uint64_t root; // Offset of the root's Record.
+    uint64_t size; // Of the whole file.
+};
+
+typedef struct Record Record;
+
+struct Record {
+    uint64_t count; // Of the subfolders.
+    uint64_t listing_length; // Without the null character.
+};
+
+typedef struct Entry Entry;
+
+struct Entry {
+    uint64_t folder; // Offset of the subfolder's Record.
+    uint32_t name; // Position of the name in the listing.
+    uint32_t length; // Of the name.
+};
+
+struct TreeImage {
+    const char* map;
+    size_t size;
+    const Record* root;
+};
+
+struct TreeImageWriter {
+    FILE* file;
+    char* path;
+    uint64_t position;
+};
+
+static const Record* record_at(TreeImage* image, uint64_t offset);
+
+TreeImage* timage_open(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    if (status.st_size < (off_t)sizeof(Header)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    void* map = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd); // The mapping stays.
+    if (map == MAP_FAILED) {
+        errno = err;
+        return NULL;
+    }
+
+    TreeImage* image = malloc(sizeof(TreeImage));
+    if (!image) {
+        munmap(map, status.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    image->map = map;
+    image->size = status.st_size;
+    const Header* header = map;
+    image->root = NULL;
+    if (memcmp(header->magic, IMAGE_MAGIC, IMAGE_MAGIC_LENGTH) == 0 && header->size == image->size)
+        image->root = record_at(image, header->root);
+    if (!image->root) {
+        timage_close(image);
+        errno = EINVAL;
+        return NULL;
+    }
+    return image;
+}
+
+void timage_close(TreeImage* image)
+{
+    munmap((void*)image->map, image->size);
+    free(image);
+}
+
+static const Entry* entries_of(const Record* record)
+{
+    return (const Entry*)(record + 1);
+}
+
+static const char* listing_of(const Record* record)
+{
+    return (const char*)(entries_of(record) + record->count);
+}
+
+// Return the Record at `offset`, or NULL if it does not fit in the image (so a damaged image is never read out of bounds).
+static const Record* record_at(TreeImage* image, uint64_t offset)
+{
+    if (offset % 8 != 0 || offset < sizeof(Header) || offset > image->size - sizeof(Record))
+        return NULL;
+    const Record* record = (const Record*)(image->map + offset);
+    uint64_t room = image->size - offset - sizeof(Record);
+    if (record->count > room / sizeof(Entry) || record->listing_length >= room - record->count * sizeof(Entry))
+        return NULL;
+    if (listing_of(record)[record->listing_length] != '\0')
+        return NULL;
+    return record;
+}
+
+// Binary search for the subfolder `name` of `record`.
+static const Record* find_child(TreeImage* image, const Record* record, const char* name)
+{
+    const Entry* entries = entries_of(record);
+    const char* listing = listing_of(record);
+    size_t name_length = strlen(name);
+    size_t low = 0;
+    size_t high = record->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const Entry* entry = &entries[middle];
+        if ((uint64_t)entry->name + entry->length > record->listing_length)
+            return NULL;
+        size_t common = entry->length < name_length ? entry->length : name_length;
+        int cmp = memcmp(name, listing + entry->name, common);
+        if (cmp == 0)
+            cmp = (name_length > entry->length) - (name_length < entry->length);
+        if (cmp == 0)
+            return record_at(image, entry->folder);
+        if (cmp < 0)
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    return NULL;
+}
+
+// The Record of the folder at `path`, or NULL if there is no such folder. Sets `*invalid` if the path is invalid.
+static const Record* find_folder(TreeImage* image, const char* path, bool* invalid)
+{
+    *invalid = !is_path_valid(path);
+    if (*invalid)
+        return NULL;
+    const Record* record = image->root;
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    const char* subpath = path;
+    while (record && (subpath = split_path(subpath, component)))
+        record = find_child(image, record, component);
+    return record;
+}
+
+const char* timage_list(TreeImage* image, const char* path, size_t* length)
+{
+    bool invalid;
+    const Record* record = find_folder(image, path, &invalid);
+    if (!record)
+        return NULL;
+    if (length)
+        *length = record->listing_length;
+    return listing_of(record);
+}
+
+int timage_list_into(TreeImage* image, const char* path, char* buffer, size_t capacity, size_t* needed)
+{
+    bool invalid;
+    const Record* record = find_folder(image, path, &invalid);
+    if (!record)
+        return invalid ? EINVAL : ENOENT;
+    size_t size = record->listing_length + 1;
+    if (needed)
+        *needed = size;
+    if (capacity < size)
+        return ERANGE;
+    memcpy(buffer, listing_of(record), size);
+    return 0;
+}
+
+bool timage_exists(TreeImage* image, const char* path)
+{
+    bool invalid;
+    return find_folder(image, path, &invalid) != NULL;
+}
+
+TreeImageWriter* timage_writer_new(const char* path)
+{
+    TreeImageWriter* writer = malloc(sizeof(TreeImageWriter));
+    char* copy = strdup(path);
+    if (!writer || !copy) {
+        free(writer);
+        free(copy);
+        errno = ENOMEM;
+        return NULL;
+    }
+    writer->file = fopen(path, "wb");
+    if (!writer->file) {
+        int err = errno;
+        free(writer);
+        free(copy);
+        errno = err;
+        return NULL;
+    }
+    writer->path = copy;
+    setvbuf(writer->file, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+    Header header; // Filled in by timage_writer_finish.
+    memset(&header, 0, sizeof(Header));
+    fwrite(&header, sizeof(Header), 1, writer->file);
+    writer->position = sizeof(Header);
+    return writer;
+}
+
+uint64_t timage_writer_add(TreeImageWriter* writer, const char* const names[], const uint64_t folders[], size_t count)
+{
+    uint64_t offset = writer->position;
+    Record record = { count, 0 };
+    for (size_t i = 0; i < count; ++i)
+        record.listing_length += strlen(names[i]) + (i > 0);
+    fwrite(&record, sizeof(Record), 1, writer->file);
+
+    uint32_t position = 0;
+    for (size_t i = 0; i < count; ++i) {
+        Entry entry = { folders[i], position, strlen(names[i]) };
+        fwrite(&entry, sizeof(Entry), 1, writer->file);
+        position += entry.length + 1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (i > 0)
+            putc(',', writer->file);
+        fputs(names[i], writer->file);
+    }
+    putc('\0', writer->file);
+
+    writer->position += sizeof(Record) + count * sizeof(Entry) + record.listing_length + 1;
+    while (writer->position % 8 != 0) {
+        putc('\0', writer->file);
+        writer->position++;
+    }
+    return offset;
+}
+
+int timage_writer_finish(TreeImageWriter* writer, uint64_t root)
+{
+    int err = 0;
+    if (root == 0) {
+        err = ECANCELED;
+    } else {
+        Header header;
+        memcpy(header.magic, IMAGE_MAGIC, IMAGE_MAGIC_LENGTH);
+        header.root = root;
+        header.size = writer->position;
+        if (fseek(writer->file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(Header), 1, writer->file) != 1
+            || fflush(writer->file) != 0 || fsync(fileno(writer->file)) != 0)
+            err = errno != 0 ? errno : EIO;
+        else if (ferror(writer->file))
+            err = EIO; // An earlier write failed.
+    }
+    if (fclose(writer->file) != 0 && err == 0)
+        err = errno;
+    if (err != 0)
+        unlink(writer->path); // Never leave an image that looks complete but is not.
+    free(writer->path);
+    free(writer);
+    return err;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A read-only image of a tree in a file, used through mmap: opening it reads nothing, lookups and listings work
+// directly on the mapping (no deserialization, no allocation), and processes that open the same image share
+// its pages in the page cache. Images are written by tree_save_image (see Tree.h).
+//
+// Every folder is a record with its subfolders sorted by name - each with the offset of the subfolder's record
+// and the position of its name in the folder's listing, which is stored ready-made after them. Offsets are
+// relative to the start of the file, so the image does not depend on where it is mapped.
+typedef struct TreeImage TreeImage;
+
+// Map the image at `path`. Return NULL (with errno set, EINVAL if it is not an image) on failure.
+TreeImage* timage_open(const char* path);
+
+// Unmap the image. Listings returned by timage_list are not valid afterwards.
+void timage_close(TreeImage* image);
+
+// Return the listing of the folder at `path` (sorted, comma-separated names of its subfolders) as a pointer into
+// the mapping, and set `*length` (if not NULL) to its length, without the terminating null character.
+// Return NULL if the path is invalid or there is no such folder.
+const char* timage_list(TreeImage* image, const char* path, size_t* length);
+
+// Like tree_list_into (see Tree.h): copy the listing of `path` into `buffer`.
+// Return 0, ERANGE, ENOENT or EINVAL.
+int timage_list_into(TreeImage* image, const char* path, char* buffer, size_t capacity, size_t* needed);
+
+// Return whether the folder at `path` is in the image.
+bool timage_exists(TreeImage* image, const char* path);
+
+// Writing an image: folders are added before their parents, the root last.
+typedef struct TreeImageWriter TreeImageWriter;
+
+// Start writing an image into the file at `path` (replacing it). Return NULL (with errno set) on failure.
+TreeImageWriter* timage_writer_new(const char* path);
+
+// Add a folder with `count` subfolders: `names` in increasing order, `folders` the offsets returned for them.
+// Return the offset of the folder (never 0).
+uint64_t timage_writer_add(TreeImageWriter* writer, const char* const names[], const uint64_t folders[], size_t count);
+
+// Finish the image with `root` as its root folder and close the file. If `root` is 0, the file is removed instead
+// (and ECANCELED returned). Return 0, or the errno of the file operation that failed (EIO if it is not known);
+// an image that failed is removed too.
+int timage_writer_finish(TreeImageWriter* writer, uint64_t root);
@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+
+// The protocol of the tree server (see server.c), over a Unix domain stream socket. All numbers are in the byte order
+// of the machine, as the clients and the server run on the same one.
+//
+// A request is a frame: its length (uint32_t, of the rest of the frame), an id chosen by the client (uint32_t), the
+// operation (uint8_t, a TreeOperation), then its paths - each as its length (uint16_t) followed by its characters,
+// without a null character.
+//
+// A response is a frame too: its length, the id of its request, the result (int32_t: 0 or an errno, as returned by the
+// function of Tree.h; ENOSYS for an unknown operation, EINVAL if the paths do not fit in the frame), then - only for
+// TREE_OP_LIST with result 0 - the listing, without a null character.
+//
+// Clients may send any number of requests without waiting for their responses; the responses come in the order of the
+// requests of the connection. The server executes all of the requests that it reads from a connection at once, and
+// writes all of their responses together. A client may shut down its side of the connection after its last request;
+// the server sends the responses to all of its whole requests, then closes the connection.
+
+typedef enum TreeOperation {
+    TREE_OP_LIST = 1, // path
+    TREE_OP_CREATE = 2, // path
+    TREE_OP_REMOVE = 3, // path
+    TREE_OP_MOVE = 4, // source, target
+} TreeOperation;
+
+// Bytes of a request frame before the paths, and of a response frame before the listing (with the length).
+#define TREE_REQUEST_HEADER 9
+#define TREE_RESPONSE_HEADER 12
+
+// The longest request frame the server accepts (two paths of MAX_PATH_LENGTH), with its length; a longer one makes it
+// close the connection.
+#define TREE_MAX_REQUEST (TREE_REQUEST_HEADER + 2 * (2 + 4095))
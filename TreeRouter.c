@@ -0,0 +1,265 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Tree.h"
+#include "TreeRouter.h"
+#include "path_utils.h"
+
+typedef struct Shard Shard;
+
+struct Shard {
+    Tree* tree;
+    pthread_rwlock_t lock; // Readers: operations inside of the shard; writers: moves from or into it.
+    char padding[64]; // Keeps the locks of neighbouring shards out of each other's cache lines.
+};
+
+struct TreeRouter {
+    Shard* shards;
+    size_t count;
+    unsigned depth;
+};
+
+TreeRouter* trouter_new(size_t shards, unsigned depth)
+{
+    if (shards == 0 || depth == 0)
+        return NULL;
+    TreeRouter* router = malloc(sizeof(TreeRouter));
+    Shard* array = calloc(shards, sizeof(Shard));
+    if (!router || !array) {
+        free(router);
+        free(array);
+        return NULL;
+    }
+    router->shards = array;
+    router->count = shards;
+    router->depth = depth;
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    // Operations inside of a shard never stop coming, a move must not wait for that.
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (size_t i = 0; i < shards; ++i) {
+        pthread_rwlock_init(&array[i].lock, &attributes);
+        array[i].tree = tree_new();
+        if (!array[i].tree) {
+            router->count = i + 1;
+            trouter_free(router);
+            router = NULL;
+            break;
+        }
+    }
+    pthread_rwlockattr_destroy(&attributes);
+    return router;
+}
+
+void trouter_free(TreeRouter* router)
+{
+    for (size_t i = 0; i < router->count; ++i) {
+        if (router->shards[i].tree)
+            tree_free(router->shards[i].tree);
+        pthread_rwlock_destroy(&router->shards[i].lock);
+    }
+    free(router->shards);
+    free(router);
+}
+
+// The number of components of a valid path.
+static unsigned depth_of(const char* path)
+{
+    unsigned depth = 0;
+    for (const char* c = path + 1; *c != '\0'; ++c)
+        depth += *c == '/';
+    return depth;
+}
+
+size_t trouter_shard_of(TreeRouter* router, const char* path)
+{
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a of the first `depth` components, with their slashes.
+    unsigned depth = 0;
+    for (const char* c = path + 1; *c != '\0' && depth < router->depth; ++c) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+        depth += *c == '/';
+    }
+    return hash % router->count;
+}
+
+static void lock_all(TreeRouter* router, bool writer)
+{
+    for (size_t i = 0; i < router->count; ++i) { // Always in this order, see trouter_move.
+        if (writer)
+            pthread_rwlock_wrlock(&router->shards[i].lock);
+        else
+            pthread_rwlock_rdlock(&router->shards[i].lock);
+    }
+}
+
+static void unlock_all(TreeRouter* router)
+{
+    for (size_t i = 0; i < router->count; ++i)
+        pthread_rwlock_unlock(&router->shards[i].lock);
+}
+
+// The sorted listing of the names in the listings of `path` in all of the shards (held), each name once.
+static char* merged_listing(TreeRouter* router, const char* path)
+{
+    char* listings[router->count];
+    size_t names = 0;
+    size_t length = 0;
+    bool failed = false;
+    for (size_t i = 0; i < router->count; ++i) {
+        listings[i] = tree_list(router->shards[i].tree, path);
+        failed = failed || !listings[i];
+        for (const char* c = listings[i]; c && *c != '\0'; ++c)
+            names += *c == ',';
+        if (listings[i] && listings[i][0] != '\0') {
+            names++;
+            length += strlen(listings[i]) + 1;
+        }
+    }
+    const char** sorted = failed ? NULL : malloc((names + 1) * sizeof(char*));
+    char* merged = sorted ? malloc(length + 1) : NULL;
+    if (merged) {
+        size_t n = 0;
+        for (size_t i = 0; i < router->count; ++i) {
+            char* save;
+            for (char* name = strtok_r(listings[i], ",", &save); name; name = strtok_r(NULL, ",", &save))
+                sorted[n++] = name;
+        }
+        sort_names(sorted, n);
+        char* end = merged;
+        for (size_t k = 0; k < n; ++k) {
+            if (k > 0 && strcmp(sorted[k], sorted[k - 1]) == 0)
+                continue; // Folders above the sharding depth are in every shard.
+            if (end != merged)
+                *end++ = ',';
+            size_t name_length = strlen(sorted[k]);
+            memcpy(end, sorted[k], name_length);
+            end += name_length;
+        }
+        *end = '\0';
+    }
+    free(sorted);
+    for (size_t i = 0; i < router->count; ++i)
+        free(listings[i]);
+    return merged;
+}
+
+char* trouter_list(TreeRouter* router, const char* path)
+{
+    if (!is_path_valid(path))
+        return NULL;
+    if (depth_of(path) >= router->depth) {
+        Shard* shard = &router->shards[trouter_shard_of(router, path)];
+        pthread_rwlock_rdlock(&shard->lock);
+        char* listing = tree_list(shard->tree, path);
+        pthread_rwlock_unlock(&shard->lock);
+        return listing;
+    }
+    lock_all(router, false);
+    char* listing = merged_listing(router, path);
+    unlock_all(router);
+    return listing;
+}
+
+int trouter_create(TreeRouter* router, const char* path)
+{
+    if (!is_path_valid(path) || strlen(path) == 1 || depth_of(path) >= router->depth) { // The tree tells about "/" and invalid paths.
+        Shard* shard = &router->shards[is_path_valid(path) ? trouter_shard_of(router, path) : 0];
+        pthread_rwlock_rdlock(&shard->lock);
+        int err = tree_create(shard->tree, path);
+        pthread_rwlock_unlock(&shard->lock);
+        return err;
+    }
+    lock_all(router, true);
+    int err = 0;
+    size_t created = 0; // The shards have the same folders above the sharding depth, so it is made in all or in none.
+    while (created < router->count && (err = tree_create(router->shards[created].tree, path)) == 0)
+        created++;
+    if (err != 0) {
+        while (created > 0)
+            tree_remove(router->shards[--created].tree, path);
+    }
+    unlock_all(router);
+    return err;
+}
+
+int trouter_remove(TreeRouter* router, const char* path)
+{
+    if (!is_path_valid(path) || strlen(path) == 1 || depth_of(path) >= router->depth) {
+        Shard* shard = &router->shards[is_path_valid(path) ? trouter_shard_of(router, path) : 0];
+        pthread_rwlock_rdlock(&shard->lock);
+        int err = tree_remove(shard->tree, path);
+        pthread_rwlock_unlock(&shard->lock);
+        return err;
+    }
+    lock_all(router, true);
+    int err = 0;
+    for (size_t i = 0; i < router->count && err == 0; ++i) { // It has to be empty in all of them.
+        size_t needed;
+        err = tree_list_into(router->shards[i].tree, path, NULL, 0, &needed);
+        if (err == ERANGE)
+            err = needed > 1 ? ENOTEMPTY : 0;
+    }
+    size_t removed = 0;
+    while (err == 0 && removed < router->count && (err = tree_remove(router->shards[removed].tree, path)) == 0)
+        removed++;
+    if (err != 0) {
+        while (removed > 0)
+            tree_create(router->shards[--removed].tree, path);
+    }
+    unlock_all(router);
+    return err;
+}
+
+// A move between shards: the source shard is held as a writer, so the subtree cannot change while it is copied, nor be
+// seen once the copy is linked; the target shard only as a reader, its tree links the finished copy at once. The errors
+// are the ones of tree_move, in the same order (the target cannot be inside of the source, nor the other way around:
+// then they would be in the same shard).
+static int moving_between(Tree* from, const char* source, Tree* to, const char* target)
+{
+    if (tree_list_into(from, source, NULL, 0, NULL) == ENOENT)
+        return ENOENT;
+    int err = tree_copy_between(from, source, to, target);
+    if (err != 0)
+        return err;
+    err = tree_remove_recursive(from, source);
+    if (err != 0 && tree_list_into(from, source, NULL, 0, NULL) != ENOENT)
+        tree_remove_recursive(to, target); // Not removed, so the copy goes instead: the folder stays in one shard.
+    return err;
+}
+
+int trouter_move(TreeRouter* router, const char* source, const char* target)
+{
+    if (strlen(source) == 1)
+        return EBUSY;
+    if (strlen(target) == 1)
+        return EEXIST;
+    if (!is_path_valid(source) || !is_path_valid(target))
+        return EINVAL;
+    if (depth_of(source) < router->depth || depth_of(target) < router->depth)
+        return EXDEV;
+
+    size_t first = trouter_shard_of(router, source);
+    size_t second = trouter_shard_of(router, target);
+    if (first == second) {
+        Shard* shard = &router->shards[first];
+        pthread_rwlock_rdlock(&shard->lock);
+        int err = tree_move(shard->tree, source, target);
+        pthread_rwlock_unlock(&shard->lock);
+        return err;
+    }
+    // In the order of the shards, like lock_all, so two moves in opposite directions do not wait for each other forever.
+    if (first < second) {
+        pthread_rwlock_wrlock(&router->shards[first].lock);
+        pthread_rwlock_rdlock(&router->shards[second].lock);
+    } else {
+        pthread_rwlock_rdlock(&router->shards[second].lock);
+        pthread_rwlock_wrlock(&router->shards[first].lock);
+    }
+    int err = moving_between(router->shards[first].tree, source, router->shards[second].tree, target);
+    pthread_rwlock_unlock(&router->shards[first].lock);
+    pthread_rwlock_unlock(&router->shards[second].lock);
+    return err;
+}
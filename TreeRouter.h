@@ -0,0 +1,39 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// One namespace split between several independent trees (shards), so that operations on different parts of it do not
+// meet on the root of a single tree: a folder `depth` levels below "/" (or deeper) lives in the shard chosen by a hash
+// of the first `depth` components of its path - with depth 1, every top-level folder goes to a shard with everything
+// inside of it. The folders above that depth are kept in every shard, so each shard has the parents of its folders.
+//
+// Every shard has a readers-writers lock of its own (never one for all of them): operations on one shard hold only its
+// lock as readers, and go on in its tree as usual. Operations that span shards hold the locks of all of them:
+// listing, creating and removing folders above the sharding depth, and moving a folder to another shard. Such a move
+// holds the source shard as a writer and the target one as a reader: the subtree is copied aside (like tree_copy) and
+// linked into the target shard at once, then removed from the source one, which nobody sees until both are done.
+typedef struct TreeRouter TreeRouter;
+
+// Return a router over `shards` new trees, which routes by the first `depth` components of paths (both at least 1),
+// or NULL if out of memory.
+TreeRouter* trouter_new(size_t shards, unsigned depth);
+
+void trouter_free(TreeRouter* router);
+
+// Like tree_list; the listing of a folder above the sharding depth is merged from all of the shards.
+char* trouter_list(TreeRouter* router, const char* path);
+
+// Like tree_create and tree_remove. A folder above the sharding depth is created or removed in all of the shards, or
+// (if that fails in one of them) in none, and the error of the failed one is returned.
+int trouter_create(TreeRouter* router, const char* path);
+
+int trouter_remove(TreeRouter* router, const char* path);
+
+// Like tree_move. Return EXDEV if the source or the target is above the sharding depth (moving it would change the
+// shard of everything inside of it). If a move to another shard cannot make the copy (out of memory), nothing is
+// moved and ENOMEM is returned.
+int trouter_move(TreeRouter* router, const char* source, const char* target);
+
+// Return the shard that the folder at `path` (a valid path, at least `depth` levels below "/") belongs to.
+size_t trouter_shard_of(TreeRouter* router, const char* path);
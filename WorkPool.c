@@ -0,0 +1,236 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "WorkPool.h"
+
+typedef struct Task Task;
+
+struct Task {
+    WorkPoolTask run;
+    void* arg;
+};
+
+typedef struct Queue Queue;
+
+// A growing ring of tasks: the owner pushes and pops at the back, thieves pop at the front.
+struct Queue {
+    pthread_mutex_t lock;
+    Task* tasks;
+    size_t capacity; // A power of two.
+    size_t front; // Positions grow forever, a task at position p is in tasks[p % capacity].
+    size_t back;
+};
+
+typedef struct Worker Worker;
+
+struct Worker {
+    WorkPool* pool;
+    int index;
+    pthread_t thread;
+};
+
+struct WorkPool {
+    int n_threads; // Started ones, only their queues are used.
+    int n_queues; // One for each thread, then the one of tasks submitted from outside.
+    Worker* workers;
+    Queue* queues;
+    atomic_size_t pending; // Submitted and not finished yet.
+    atomic_size_t queued; // Submitted and not taken yet.
+    atomic_int sleeping; // Threads waiting for `wakeup`.
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup; // Something was queued, or the pool stops.
+    pthread_cond_t finished; // `pending` dropped to 0.
+    bool stopping;
+};
+
+// The worker running on this thread, if it belongs to some pool.
+static _Thread_local Worker* current;
+
+#define INITIAL_QUEUE_CAPACITY 64
+
+static bool queue_push(Queue* queue, Task task)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (queue->back - queue->front == queue->capacity) {
+        Task* tasks = malloc(2 * queue->capacity * sizeof(Task));
+        if (!tasks) {
+            pthread_mutex_unlock(&queue->lock);
+            return false;
+        }
+        for (size_t p = queue->front; p != queue->back; ++p)
+            tasks[p % (2 * queue->capacity)] = queue->tasks[p % queue->capacity];
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->capacity *= 2;
+    }
+    queue->tasks[queue->back % queue->capacity] = task;
+    queue->back++;
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+static bool queue_pop(Queue* queue, Task* task, bool from_back)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->front != queue->back;
+    if (found && from_back) {
+        queue->back--;
+        *task = queue->tasks[queue->back % queue->capacity];
+    } else if (found) {
+        *task = queue->tasks[queue->front % queue->capacity];
+        queue->front++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+// Take a task: the newest one of our own queue, or else the oldest one of somebody else's, or else the oldest one
+// submitted from outside (so those run first come, first served).
+static bool take(WorkPool* pool, int index, Task* task)
+{
+    if (atomic_load(&pool->queued) == 0)
+        return false;
+    for (int q = 0; q <= pool->n_threads; ++q) {
+        int victim = q < pool->n_threads ? (index + q) % pool->n_threads : pool->n_queues - 1;
+        if (queue_pop(&pool->queues[victim], task, victim == index)) {
+            atomic_fetch_sub(&pool->queued, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// One of the pending tasks is done.
+static void finish(WorkPool* pool)
+{
+    if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->finished);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void* run(void* arg)
+{
+    Worker* worker = arg;
+    WorkPool* pool = worker->pool;
+    current = worker;
+    for (;;) {
+        Task task;
+        if (take(pool, worker->index, &task)) {
+            task.run(pool, task.arg);
+            finish(pool);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->sleeping, 1); // Before checking `queued`, see wpool_submit.
+        while (atomic_load(&pool->queued) == 0 && !pool->stopping)
+            pthread_cond_wait(&pool->wakeup, &pool->lock);
+        atomic_fetch_sub(&pool->sleeping, 1);
+        bool stop = pool->stopping && atomic_load(&pool->queued) == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop)
+            return NULL;
+    }
+}
+
+WorkPool* wpool_new(int threads)
+{
+    if (threads < 1)
+        threads = 1;
+    WorkPool* pool = malloc(sizeof(WorkPool));
+    if (!pool)
+        return NULL;
+    pool->workers = malloc(threads * sizeof(Worker));
+    pool->queues = malloc((threads + 1) * sizeof(Queue));
+    if (!pool->workers || !pool->queues) {
+        free(pool->workers);
+        free(pool->queues);
+        free(pool);
+        return NULL;
+    }
+    pool->n_queues = threads + 1;
+    for (int q = 0; q < pool->n_queues; ++q) {
+        pthread_mutex_init(&pool->queues[q].lock, NULL);
+        pool->queues[q].tasks = malloc(INITIAL_QUEUE_CAPACITY * sizeof(Task));
+        pool->queues[q].capacity = INITIAL_QUEUE_CAPACITY;
+        pool->queues[q].front = 0;
+        pool->queues[q].back = 0;
+    }
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->sleeping, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    pool->stopping = false;
+
+    pool->n_threads = 0;
+    for (int w = 0; w < threads && pool->queues[pool->n_queues - 1].tasks; ++w) {
+        pool->workers[w].pool = pool;
+        pool->workers[w].index = w;
+        if (!pool->queues[w].tasks || pthread_create(&pool->workers[w].thread, NULL, run, &pool->workers[w]) != 0)
+            break;
+        pool->n_threads++;
+    }
+    if (pool->n_threads == 0) {
+        wpool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void wpool_free(WorkPool* pool)
+{
+    wpool_wait(pool);
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+    for (int w = 0; w < pool->n_threads; ++w)
+        pthread_join(pool->workers[w].thread, NULL);
+
+    for (int q = 0; q < pool->n_queues; ++q) {
+        pthread_mutex_destroy(&pool->queues[q].lock);
+        free(pool->queues[q].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wakeup);
+    pthread_cond_destroy(&pool->finished);
+    free(pool->queues);
+    free(pool->workers);
+    free(pool);
+}
+
+int wpool_threads(WorkPool* pool)
+{
+    return pool->n_threads;
+}
+
+bool wpool_submit(WorkPool* pool, WorkPoolTask task, void* arg)
+{
+    int index = current && current->pool == pool ? current->index : pool->n_queues - 1;
+    atomic_fetch_add(&pool->pending, 1);
+    if (!queue_push(&pool->queues[index], (Task) { task, arg })) {
+        finish(pool);
+        return false;
+    }
+    // A thread going to sleep counts itself before it checks `queued`, we check `sleeping` after
+    // increasing `queued`, so one of us sees the other.
+    atomic_fetch_add(&pool->queued, 1);
+    if (atomic_load(&pool->sleeping) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wakeup);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return true;
+}
+
+void wpool_wait(WorkPool* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->pending) > 0)
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+// A fixed set of threads running tasks, with work stealing: every thread has its own queue of tasks,
+// tasks submitted by a task go to the queue of its thread (and are taken from there newest first),
+// and a thread without tasks takes the oldest ones from the queues of the others. Tasks submitted
+// from outside the pool go to a queue of their own, taken oldest first when no thread has tasks.
+typedef struct WorkPool WorkPool;
+
+typedef void (*WorkPoolTask)(WorkPool* pool, void* arg);
+
+// Create a pool of `threads` threads. Return NULL if not even one of them could be started.
+WorkPool* wpool_new(int threads);
+
+// Stop the threads and free the pool. Tasks still submitted are run first.
+void wpool_free(WorkPool* pool);
+
+// Return the number of threads of the pool.
+int wpool_threads(WorkPool* pool);
+
+// Run `task(pool, arg)` on one of the threads. Can be called by tasks themselves.
+// Return false (and do not run it) if there is no memory for it.
+bool wpool_submit(WorkPool* pool, WorkPoolTask task, void* arg);
+
+// Wait until all the submitted tasks, and all the tasks they submitted, are finished.
+void wpool_wait(WorkPool* pool);
@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Tree.h"
+#include "err.h"
+
+// Batches of operations (see tree_apply_batch), each result checked in the place of its operation:
+//  - a folder created together with its subfolders, listed before and after them,
+//  - a folder removed in the batch that empties it (ENOTEMPTY) and in a later one,
+//  - moves between creates, each applied in its place,
+//  - EINVAL for the invalid operations only, the others applied,
+//  - operations given in the reverse order of their folders, with results in the original order.
+
+#define OP(kind_, path_) { TREE_BATCH_##kind_, path_, NULL }
+#define MOVE(source, target) { TREE_BATCH_MOVE, source, target }
+
+// The expected result of an operation, and its listing (only for a listing with result 0).
+typedef struct Expected {
+    int result;
+    const char* listing;
+} Expected;
+
+static void applying(Tree* tree, const char* what, const TreeBatchOp ops[], const Expected expected[], size_t n)
+{
+    TreeBatchResult results[n];
+    int err = tree_apply_batch(tree, ops, n, results);
+    if (err != 0)
+        fatal("%s: %d", what, err);
+    for (size_t k = 0; k < n; ++k) {
+        const char* listing = results[k].listing;
+        if (results[k].result != expected[k].result || !listing != !expected[k].listing
+            || (listing && strcmp(listing, expected[k].listing) != 0))
+            fatal("%s, operation %zu: %d \"%s\" instead of %d \"%s\"", what, k, results[k].result, listing ? listing : "",
+                expected[k].result, expected[k].listing ? expected[k].listing : "");
+        free(results[k].listing);
+    }
+}
+
+int main(void)
+{
+    Tree* tree = tree_new();
+    if (!tree)
+        fatal("tree_new");
+
+    TreeBatchOp create_ops[] = {
+        OP(LIST, "/x/"),
+        OP(CREATE, "/x/y/"),
+        OP(LIST, "/x/"),
+        OP(CREATE, "/x/z/"),
+        OP(CREATE, "/x/"),
+        OP(CREATE, "/x/"),
+    };
+    Expected create_results[] = { { 0, "" }, { 0, NULL }, { 0, "y" }, { 0, NULL }, { 0, NULL }, { EEXIST, NULL } };
+    applying(tree, "Create with subfolders", create_ops, create_results, 6);
+
+    TreeBatchOp remove_ops[] = { OP(REMOVE, "/x/"), OP(REMOVE, "/x/y/"), OP(REMOVE, "/x/z/"), OP(LIST, "/x/") };
+    Expected remove_results[] = { { ENOTEMPTY, NULL }, { 0, NULL }, { 0, NULL }, { 0, "" } };
+    applying(tree, "Remove with subfolders", remove_ops, remove_results, 4);
+    TreeBatchOp later_ops[] = { OP(REMOVE, "/x/"), OP(LIST, "/") };
+    Expected later_results[] = { { 0, NULL }, { 0, "" } };
+    applying(tree, "Remove after an earlier batch", later_ops, later_results, 2);
+
+    TreeBatchOp move_ops[] = {
+        OP(CREATE, "/p/"),
+        MOVE("/p/", "/q/"),
+        OP(CREATE, "/q/r/"),
+        OP(CREATE, "/p/s/"),
+        MOVE("/q/r/", "/t/"),
+        OP(CREATE, "/t/u/"),
+        OP(LIST, "/q/"),
+        OP(LIST, "/"),
+    };
+    Expected move_results[] = {
+        { 0, NULL }, { 0, NULL }, { 0, NULL }, { ENOENT, NULL }, { 0, NULL }, { 0, NULL }, { 0, "" }, { 0, "q,t" },
+    };
+    applying(tree, "Moves between creates", move_ops, move_results, 8);
+
+    TreeBatchOp invalid_ops[] = {
+        OP(CREATE, "/Bad/"),
+        OP(CREATE, "/v/"),
+        OP(LIST, "relative/"),
+        MOVE("/v/", "/w"),
+        OP(REMOVE, "/v//"),
+        OP(CREATE, "/v/w/"),
+        OP(LIST, "/v/"),
+    };
+    Expected invalid_results[] = {
+        { EINVAL, NULL }, { 0, NULL }, { EINVAL, NULL }, { EINVAL, NULL }, { EINVAL, NULL }, { 0, NULL }, { 0, "w" },
+    };
+    applying(tree, "Invalid operations", invalid_ops, invalid_results, 7);
+
+    // Deepest folders first, names in reverse: applied the other way round.
+    TreeBatchOp reversed_ops[] = {
+        OP(LIST, "/q/"),
+        OP(CREATE, "/q/c/"),
+        OP(LIST, "/v/w/"),
+        OP(CREATE, "/v/w/b/"),
+        OP(CREATE, "/v/w/a/"),
+        OP(LIST, "/v/w/"),
+        OP(CREATE, "/q/b/"),
+        OP(CREATE, "/q/a/"),
+        OP(LIST, "/q/"),
+        OP(REMOVE, "/t/u/"),
+        OP(LIST, "/t/"),
+    };
+    Expected reversed_results[] = {
+        { 0, "" }, { 0, NULL }, { 0, "" }, { 0, NULL }, { 0, NULL }, { 0, "a,b" }, { 0, NULL }, { 0, NULL }, { 0, "a,b,c" },
+        { 0, NULL }, { 0, "" },
+    };
+    applying(tree, "Reversed operations", reversed_ops, reversed_results, 11);
+
+    tree_free(tree);
+    printf("ok: batches\n");
+    return 0;
+}
@@ -1,9 +1,12 @@
 #include "path_utils.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 bool is_path_valid(const char* path)
 {
@@ -51,6 +54,8 @@ char* make_path_to_parent(const char* path, char* component)
 
     size_t subpath_len = p - path + 1; // Include '/' at p.
     char* result = malloc(subpath_len + 1); // Include terminating null character.
+    if (!result)
+        return NULL;
     strncpy(result, path, subpath_len);
     result[subpath_len] = '\0';
 
@@ -64,11 +69,142 @@ char* make_path_to_parent(const char* path, char* component)
     return result;
 }
 
-// A wrapper for using strcmp in qsort.
-// The arguments here are actually pointers to (const char*).
-static int compare_string_pointers(const void* p1, const void* p2)
+// Number of distinct symbols in folder names, 'a'-'z'.
+#define N_LETTERS 26
+
+// Below this many keys a bucket is sorted by insertion, counting 27 buckets does not pay off.
+#define RADIX_CUTOFF 32
+
+// From this many keys, the buckets of the first letter are sorted in separate threads.
+#define RADIX_PARALLEL_THRESHOLD (1 << 16)
+
+// At most this many threads (including the calling one) sort the buckets of one call, fewer if there are fewer processors.
+#define RADIX_MAX_THREADS 8
+
+// Bucket of a key at position `depth`: 0 for the end of the key, 1 + letter otherwise.
+// All keys sorted together share their first `depth` characters, so key[depth] is always readable.
+static inline int bucket_of(const char* key, size_t depth)
+{
+    unsigned char c = key[depth];
+    return c ? c - 'a' + 1 : 0;
+}
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+static void insertion_sort(const char** keys, size_t n, size_t depth)
+{
+    for (size_t i = 1; i < n; ++i) {
+        const char* key = keys[i];
+        size_t j = i;
+        while (j > 0 && strcmp(keys[j - 1] + depth, key + depth) > 0) {
+            keys[j] = keys[j - 1];
+            j--;
+        }
+        keys[j] = key;
+    }
+}
+
+// Distribute `keys` by their character at `depth` (stably, through `scratch` of the same size).
+// On return `starts[b]` is the index of the first key of bucket b, and `starts[N_LETTERS + 1]` is n.
+static void distribute(const char** keys, const char** scratch, size_t n, size_t depth, size_t starts[N_LETTERS + 2])
+{
+    size_t counts[N_LETTERS + 1] = { 0 };
+    for (size_t i = 0; i < n; ++i)
+        counts[bucket_of(keys[i], depth)]++;
+    size_t position = 0;
+    for (int b = 0; b <= N_LETTERS; ++b) {
+        starts[b] = position;
+        position += counts[b];
+    }
+    starts[N_LETTERS + 1] = n;
+
+    size_t next[N_LETTERS + 1];
+    memcpy(next, starts, sizeof(next));
+    for (size_t i = 0; i < n; ++i)
+        scratch[next[bucket_of(keys[i], depth)]++] = keys[i];
+    memcpy(keys, scratch, n * sizeof(char*));
+}
+
+// MSD radix sort of keys sharing their first `depth` characters.
+static void radix_sort(const char** keys, const char** scratch, size_t n, size_t depth)
+{
+    if (n < RADIX_CUTOFF) {
+        insertion_sort(keys, n, depth);
+        return;
+    }
+    size_t starts[N_LETTERS + 2];
+    distribute(keys, scratch, n, depth, starts);
+    // Bucket 0 holds equal keys (ended at `depth`), nothing to sort there.
+    for (int b = 1; b <= N_LETTERS; ++b)
+        radix_sort(keys + starts[b], scratch + starts[b], starts[b + 1] - starts[b], depth + 1);
+}
+
+typedef struct {
+    const char** keys;
+    const char** scratch;
+    size_t n;
+} SortTask;
+
+// The buckets of the first letter, taken one by one by the threads that sort them.
+typedef struct {
+    SortTask tasks[N_LETTERS]; // Largest first, so that no thread is left alone with a big one at the end.
+    atomic_int next;
+} SortJob;
+
+static void* sort_worker(void* arg)
+{
+    SortJob* job = arg;
+    int t;
+    while ((t = atomic_fetch_add(&job->next, 1)) < N_LETTERS)
+        radix_sort(job->tasks[t].keys, job->tasks[t].scratch, job->tasks[t].n, 1);
+    return NULL;
+}
+
+// Like radix_sort at depth 0, but the buckets of the first letter (disjoint parts of `keys` and `scratch`)
+// are sorted in parallel, by the calling thread and up to RADIX_MAX_THREADS - 1 others (one per processor).
+static void radix_sort_parallel(const char** keys, const char** scratch, size_t n)
 {
-    return strcmp(*(const char**)p1, *(const char**)p2);
+    size_t starts[N_LETTERS + 2];
+    distribute(keys, scratch, n, 0, starts);
+
+    SortJob job;
+    for (int b = 1; b <= N_LETTERS; ++b) {
+        SortTask task = { keys + starts[b], scratch + starts[b], starts[b + 1] - starts[b] };
+        int t = b - 1;
+        for (; t > 0 && job.tasks[t - 1].n < task.n; --t)
+            job.tasks[t] = job.tasks[t - 1];
+        job.tasks[t] = task;
+    }
+    atomic_init(&job.next, 0);
+
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int n_threads = processors < RADIX_MAX_THREADS ? (int)processors : RADIX_MAX_THREADS;
+    pthread_t threads[RADIX_MAX_THREADS];
+    int started = 0;
+    while (started < n_threads - 1 && pthread_create(&threads[started], NULL, sort_worker, &job) == 0)
+        started++;
+    sort_worker(&job);
+    for (int t = 0; t < started; ++t)
+        pthread_join(threads[t], NULL);
+}
+
+void sort_names(const char** names, size_t n)
+{
+    if (n < 2)
+        return;
+    const char** scratch = malloc(n * sizeof(char*));
+    if (!scratch) { // Sorting in place, in O(n log n) as well.
+        qsort(names, n, sizeof(char*), compare_names);
+        return;
+    }
+    if (n >= RADIX_PARALLEL_THRESHOLD)
+        radix_sort_parallel(names, scratch, n);
+    else
+        radix_sort(names, scratch, n, 0);
+    free(scratch);
 }
 
 const char** make_map_contents_array(HashMap* map)
@@ -82,7 +218,7 @@ const char** make_map_contents_array(HashMap* map)
         key++;
     }
     *key = NULL; // Set last array element to NULL.
-    qsort(result, n_keys, sizeof(char*), compare_string_pointers);
+    sort_names(result, n_keys);
     return result;
 }
 
@@ -35,10 +35,14 @@ const char* split_path(const char* path, char* component);
 // - `path`: should be a valid path (see `is_path_valid`).
 // - `component`: if not NULL, should be a buffer of size at least MAX_FOLDER_NAME_LENGTH + 1.
 //    Then the last component will be copied there (without any '/' characters).
-// If path is "/", returns NULL and leaves `component` unchanged.
+// If path is "/", returns NULL and leaves `component` unchanged; also NULL if out of memory.
 // Otherwise the result is a valid path.
 char* make_path_to_parent(const char* path, char* component);
 
+// Sort `n` folder names (valid per `is_path_valid`, so only 'a'-'z') lexicographically, in place.
+// This is a radix sort over the 26 letters; large arrays are sorted using several threads (one per processor, at most 8).
+void sort_names(const char** names, size_t n);
+
 // Return an array containing all keys, lexicographically sorted.
 // The result is null-terminated.
 // Keys are not copied, they are only valid as long as the map.
@@ -0,0 +1,204 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Tree.h"
+#include "err.h"
+
+// A queue of asynchronous operations (see TreeQueue in Tree.h), on a single thread, while a folder is held by a writer
+// (a tree_create stopped in the middle of an allocation):
+//  - the operations that need the folder are parked, and the thread of the queue still runs the others,
+//  - once the folder is let go, the parked ones are let in first come, first served,
+//  - the eventfd of the queue is readable exactly while there are completions to take,
+//  - tree_queue_free waits for the parked operations before it returns.
+
+#define PARKED 16
+
+extern void* __libc_malloc(size_t size);
+
+// The allocation of this thread that stops it until `go` (counted from 1), once; 0 for none. Other threads never stop.
+static _Thread_local long stopping;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static bool stopped;
+static bool go;
+
+void* malloc(size_t size)
+{
+    if (stopping > 0 && --stopping == 0) {
+        pthread_mutex_lock(&mutex);
+        stopped = true;
+        pthread_cond_broadcast(&changed);
+        while (!go)
+            pthread_cond_wait(&changed, &mutex);
+        pthread_mutex_unlock(&mutex);
+    }
+    return __libc_malloc(size);
+}
+
+static Tree* tree;
+
+// Create "/a/writer/", stopping at its second allocation: the first one is the path of the parent, made before "/a/" is
+// entered; the second one is the new folder, made while "/a/" is held as a writer.
+static void* writer(void* arg)
+{
+    (void)arg;
+    stopping = 2;
+    int result = tree_create(tree, "/a/writer/");
+    if (result != 0)
+        fatal("The writer: %d", result);
+    return NULL;
+}
+
+static pthread_t holding(void)
+{
+    pthread_mutex_lock(&mutex);
+    stopped = false;
+    go = false;
+    pthread_mutex_unlock(&mutex);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, writer, NULL) != 0)
+        fatal("pthread_create");
+    pthread_mutex_lock(&mutex);
+    while (!stopped)
+        pthread_cond_wait(&changed, &mutex);
+    pthread_mutex_unlock(&mutex);
+    return thread;
+}
+
+static void letting_go(pthread_t thread)
+{
+    pthread_mutex_lock(&mutex);
+    go = true;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread, NULL);
+}
+
+static bool readable(int fd, int timeout_ms)
+{
+    struct pollfd poll_fd = { .fd = fd, .events = POLLIN };
+    int ready = poll(&poll_fd, 1, timeout_ms);
+    if (ready < 0)
+        syserr("poll");
+    return ready > 0;
+}
+
+// Take `count` completions, waiting for them on the eventfd, into `completions`.
+static void reaping(TreeQueue* queue, TreeCompletion completions[], size_t count)
+{
+    size_t taken = 0;
+    while (taken < count) {
+        if (!readable(tree_queue_fd(queue), 10000))
+            fatal("Only %zu completions out of %zu", taken, count);
+        size_t reaped = tree_queue_reap(queue, completions + taken, count - taken);
+        if (reaped == 0)
+            fatal("Readable without completions");
+        taken += reaped;
+    }
+}
+
+static void expect_completion(TreeCompletion* completion, long data, int result, const char* listing)
+{
+    if ((long)completion->data != data || completion->result != result
+        || (listing && (!completion->listing || strcmp(completion->listing, listing) != 0)))
+        fatal("Completion %ld with %d \"%s\" instead of %ld with %d \"%s\"", (long)completion->data, completion->result,
+            completion->listing ? completion->listing : "", data, result, listing ? listing : "");
+    free(completion->listing);
+}
+
+// The path of the `i`-th folder created in "/a/".
+static void child_path(int i, char* path)
+{
+    sprintf(path, "/a/%c%c/", 'a' + i / 26, 'a' + i % 26);
+}
+
+static void parked_in_order(TreeQueue* queue)
+{
+    int fd = tree_queue_fd(queue);
+    if (readable(fd, 0))
+        fatal("Readable without completions");
+    pthread_t thread = holding();
+
+    // Every child created twice: the first ones submitted succeed, the later ones find them.
+    char path[16];
+    for (long k = 0; k < 2 * PARKED; ++k) {
+        child_path(k % PARKED, path);
+        if (tree_submit_create(queue, path, (void*)k) != 0)
+            fatal("Submitting");
+    }
+    if (readable(fd, 200))
+        fatal("An operation went into a folder held by a writer");
+
+    // The only thread of the queue is not taken by the parked operations.
+    if (tree_submit_list(queue, "/b/", (void*)-1L) != 0)
+        fatal("Submitting a listing");
+    TreeCompletion completions[2 * PARKED];
+    reaping(queue, completions, 1);
+    expect_completion(&completions[0], -1, 0, "");
+    if (readable(fd, 0))
+        fatal("Readable after every completion was taken");
+
+    letting_go(thread);
+    reaping(queue, completions, 2 * PARKED);
+    for (long k = 0; k < 2 * PARKED; ++k)
+        expect_completion(&completions[k], k, k < PARKED ? 0 : EEXIST, NULL);
+    if (readable(fd, 0))
+        fatal("Readable after every completion was taken");
+    if (tree_remove(tree, "/a/writer/") != 0)
+        fatal("Removing the writer's folder");
+}
+
+static atomic_bool freed;
+
+static void* freeing(void* queue)
+{
+    tree_queue_free(queue);
+    atomic_store(&freed, true);
+    return NULL;
+}
+
+static void freed_after_parked(TreeQueue* queue)
+{
+    pthread_t thread = holding();
+    char path[16];
+    for (long k = 0; k < PARKED; ++k) {
+        child_path(k, path);
+        if (tree_submit_remove(queue, path, (void*)k) != 0)
+            fatal("Submitting");
+    }
+    pthread_t freeing_thread;
+    if (pthread_create(&freeing_thread, NULL, freeing, queue) != 0)
+        fatal("pthread_create");
+    struct timespec pause = { 0, 200 * 1000000 };
+    nanosleep(&pause, NULL);
+    if (atomic_load(&freed))
+        fatal("The queue was freed with parked operations");
+    letting_go(thread);
+    pthread_join(freeing_thread, NULL);
+    char* listing = tree_list(tree, "/a/");
+    if (!listing || strcmp(listing, "writer") != 0)
+        fatal("Listing after the queue was freed: %s", listing ? listing : "(none)");
+    free(listing);
+}
+
+int main(void)
+{
+    tree = tree_new();
+    if (!tree || tree_create(tree, "/a/") != 0 || tree_create(tree, "/b/") != 0)
+        fatal("tree_new");
+    TreeQueue* queue = tree_queue_new(tree, 1);
+    if (!queue)
+        fatal("tree_queue_new");
+    parked_in_order(queue);
+    freed_after_parked(queue);
+    tree_free(tree);
+    printf("ok: %d parked operations\n", 3 * PARKED);
+    return 0;
+}
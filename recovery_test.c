@@ -0,0 +1,274 @@
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Tree.h"
+#include "err.h"
+#include "path_utils.h"
+
+// Recovering journaled trees (see tree_recover) after their process is killed: every change is made both in the
+// journaled tree and in a model tree (made by tree_new), and the recovered tree has to be the same as the model.
+//  - a journal whose last record is torn (cut short, as by a crash in the middle of writing it),
+//  - a full checkpoint, incremental ones after it and changes journaled after those,
+//  - enough incremental checkpoints to be merged into the full one, then a clean tree_free.
+// Usage: recovery_test [changes], 300 changes between checkpoints by default.
+
+static int changes = 300;
+
+// A random path of 1 to 3 components, each one of 3 letters.
+static void random_path(unsigned* seed, char* path)
+{
+    int depth = 1 + rand_r(seed) % 3;
+    char* end = path;
+    *end++ = '/';
+    for (int d = 0; d < depth; ++d) {
+        *end++ = 'a' + rand_r(seed) % 3;
+        *end++ = '/';
+    }
+    *end = '\0';
+}
+
+// Make `count` random changes in `tree`, and the same ones in `model` (or nowhere, if it is NULL): they must give the
+// same results.
+static void changing(Tree* tree, Tree* model, unsigned* seed, int count)
+{
+    char path[16];
+    char target[16];
+    for (int k = 0; k < count; ++k) {
+        int kind = rand_r(seed) % 10;
+        random_path(seed, path);
+        random_path(seed, target);
+        int result;
+        int expected = 0;
+        if (kind < 5) {
+            result = tree_create(tree, path);
+            if (model)
+                expected = tree_create(model, path);
+        } else if (kind < 7) {
+            result = tree_remove_recursive(tree, path);
+            if (model)
+                expected = tree_remove_recursive(model, path);
+        } else if (kind < 9) {
+            result = tree_move(tree, path, target);
+            if (model)
+                expected = tree_move(model, path, target);
+        } else {
+            result = tree_copy(tree, path, target);
+            if (model)
+                expected = tree_copy(model, path, target);
+        }
+        if (model && result != expected)
+            fatal("Change %d (%d of %s, %s) gave %d, the model %d", k, kind, path, target, result, expected);
+    }
+}
+
+static void dumping(Tree* tree, const char* path, FILE* out)
+{
+    char* listing = tree_list(tree, path);
+    if (!listing)
+        fatal("Cannot list %s", path);
+    fprintf(out, "%s:%s;", path, listing);
+    char* save;
+    for (char* name = strtok_r(listing, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        char child[MAX_PATH_LENGTH + 1];
+        snprintf(child, sizeof(child), "%s%s/", path, name);
+        dumping(tree, child, out);
+    }
+    free(listing);
+}
+
+// Every folder of the tree with its listing, freed by the caller.
+static char* dump_of(Tree* tree)
+{
+    char* dump;
+    size_t size;
+    FILE* out = open_memstream(&dump, &size);
+    if (!out)
+        syserr("open_memstream");
+    dumping(tree, "/", out);
+    fclose(out);
+    return dump;
+}
+
+static void compare(Tree* tree, Tree* model, const char* what)
+{
+    char* dump = dump_of(tree);
+    char* expected = dump_of(model);
+    if (strcmp(dump, expected) != 0)
+        fatal("%s: the recovered tree\n%s\nis not the model\n%s", what, dump, expected);
+    free(dump);
+    free(expected);
+}
+
+// Run `work` on the tree at `path` in a child process, which is killed (with nothing written at exit) once the work is done.
+static void killed_after(void (*work)(Tree* tree), const char* path)
+{
+    int done[2];
+    if (pipe(done) != 0)
+        syserr("pipe");
+    pid_t child = fork();
+    if (child < 0)
+        syserr("fork");
+    if (child == 0) {
+        Tree* tree = tree_recover(path, TREE_DURABILITY_WRITTEN);
+        if (!tree)
+            syserr("tree_recover in the child");
+        work(tree);
+        if (write(done[1], "", 1) != 1)
+            syserr("write");
+        pause();
+    }
+    char byte;
+    if (read(done[0], &byte, 1) != 1)
+        fatal("The child process failed");
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    close(done[0]);
+    close(done[1]);
+}
+
+// The journal segment of the tree at `path` with the greatest number.
+static void last_segment(const char* directory, const char* path, char* segment)
+{
+    const char* base = strrchr(path, '/') + 1;
+    size_t base_length = strlen(base);
+    unsigned long last = 0;
+    DIR* dir = opendir(directory);
+    if (!dir)
+        syserr("opendir");
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        char* end;
+        if (strncmp(name, base, base_length) != 0 || name[base_length] != '.')
+            continue;
+        unsigned long n = strtoul(name + base_length + 1, &end, 10);
+        if (end != name + base_length + 1 && *end == '\0' && n > last)
+            last = n;
+    }
+    closedir(dir);
+    if (last == 0)
+        fatal("No journal segment of %s", path);
+    sprintf(segment, "%s.%lu", path, last);
+}
+
+static void torn_work(Tree* tree)
+{
+    unsigned seed = 1;
+    changing(tree, NULL, &seed, changes);
+    int err = tree_create(tree, "/z/"); // The last record, to be torn.
+    if (err != 0)
+        fatal("Cannot create /z/ (%d)", err);
+}
+
+static void checkpointed_work(Tree* tree)
+{
+    unsigned seed = 2;
+    changing(tree, NULL, &seed, changes);
+    if (tree_checkpoint(tree) != 0)
+        fatal("tree_checkpoint");
+    for (int i = 0; i < 3; ++i) {
+        changing(tree, NULL, &seed, changes);
+        if (tree_checkpoint_incremental(tree) != 0)
+            fatal("tree_checkpoint_incremental");
+    }
+    changing(tree, NULL, &seed, changes); // Only in the journal.
+}
+
+static void removing_all(const char* directory)
+{
+    DIR* dir = opendir(directory);
+    if (!dir)
+        syserr("opendir");
+    struct dirent* entry;
+    char file[4096];
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        snprintf(file, sizeof(file), "%s/%s", directory, entry->d_name);
+        unlink(file);
+    }
+    closedir(dir);
+    rmdir(directory);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+        changes = atoi(argv[1]);
+    char directory[] = "/tmp/recovery_test_XXXXXX";
+    if (!mkdtemp(directory))
+        syserr("mkdtemp");
+    char path[64];
+    char segment[128];
+
+    // A torn last record is cut off: the tree is recovered without its change, and the journal goes on after the
+    // changes before it.
+    sprintf(path, "%s/torn", directory);
+    killed_after(torn_work, path);
+    last_segment(directory, path, segment);
+    FILE* file = fopen(segment, "r+");
+    if (!file || fseek(file, 0, SEEK_END) != 0)
+        syserr("Cannot open %s", segment);
+    long size = ftell(file);
+    if (size < 3 || ftruncate(fileno(file), size - 3) != 0)
+        syserr("Cannot tear the last record of %s", segment);
+    fclose(file);
+    Tree* model = tree_new();
+    unsigned seed = 1;
+    changing(model, NULL, &seed, changes);
+    Tree* tree = tree_recover(path, TREE_DURABILITY_WRITTEN);
+    if (!tree)
+        syserr("tree_recover after a torn record");
+    compare(tree, model, "torn record");
+    changing(tree, model, &seed, changes);
+    tree_free(tree);
+    tree = tree_recover(path, TREE_DURABILITY_WRITTEN);
+    if (!tree)
+        syserr("tree_recover after the torn record was cut off");
+    compare(tree, model, "changes after a torn record");
+    tree_free(tree);
+    tree_free(model);
+
+    // A full checkpoint with incremental ones after it, and the journal after those.
+    sprintf(path, "%s/incremental", directory);
+    killed_after(checkpointed_work, path);
+    model = tree_new();
+    seed = 2;
+    changing(model, NULL, &seed, 5 * changes);
+    tree = tree_recover(path, TREE_DURABILITY_WRITTEN);
+    if (!tree)
+        syserr("tree_recover after incremental checkpoints");
+    compare(tree, model, "incremental checkpoints");
+    tree_free(tree);
+    tree_free(model);
+
+    // Incremental checkpoints merged into the full one, in the background.
+    sprintf(path, "%s/merged", directory);
+    tree = tree_recover(path, TREE_DURABILITY_NONE);
+    model = tree_new();
+    if (!tree || !model)
+        syserr("tree_recover");
+    seed = 3;
+    for (int i = 0; i < 12; ++i) {
+        changing(tree, model, &seed, changes);
+        if (tree_checkpoint_incremental(tree) != 0)
+            fatal("tree_checkpoint_incremental");
+    }
+    changing(tree, model, &seed, changes);
+    tree_free(tree);
+    tree = tree_recover(path, TREE_DURABILITY_NONE);
+    if (!tree)
+        syserr("tree_recover after merged checkpoints");
+    compare(tree, model, "merged checkpoints");
+    tree_free(tree);
+    tree_free(model);
+
+    removing_all(directory);
+    printf("ok: %d changes between checkpoints\n", changes);
+    return 0;
+}
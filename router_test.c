@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "TreeRouter.h"
+#include "err.h"
+
+// A router over several shards (see TreeRouter.h), routing by the first 2 components of paths:
+//  - folders above the sharding depth created and removed in all of the shards, ENOTEMPTY if any of them has a
+//    folder inside, and nothing left behind in any shard when one of them fails (out of memory) after the others,
+//  - moves inside of a shard and to another one, with the whole subtree, and nothing moved if that runs out of memory,
+//  - EXDEV for moves of folders above the sharding depth, ENOENT for a missing source or target parent.
+
+#define SHARDS 4
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+extern void __libc_free(void* pointer);
+
+// The allocation of this thread that fails (counted from 1), once; 0 for none. Other threads never fail.
+static _Thread_local long failing;
+
+static bool failing_now(void)
+{
+    return failing > 0 && --failing == 0;
+}
+
+void* malloc(size_t size)
+{
+    return failing_now() ? NULL : __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    return failing_now() ? NULL : __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size)
+{
+    return failing_now() ? NULL : __libc_realloc(pointer, size);
+}
+
+void free(void* pointer)
+{
+    __libc_free(pointer);
+}
+
+static void expect(int result, int expected, const char* what)
+{
+    if (result != expected)
+        fatal("%s: %d instead of %d", what, result, expected);
+}
+
+static void expect_listing(TreeRouter* router, const char* path, const char* expected)
+{
+    char* listing = trouter_list(router, path);
+    if (!listing != !expected || (listing && strcmp(listing, expected) != 0))
+        fatal("Listing of %s: \"%s\" instead of \"%s\"", path, listing ? listing : "(none)",
+            expected ? expected : "(none)");
+    free(listing);
+}
+
+// Put into `path` a folder `parent` (a path) + a name of two letters, other than `except` (if not NULL), in the shard
+// `shard` if `same`, in another one if not.
+static void path_in_shard(TreeRouter* router, const char* parent, size_t shard, bool same, const char* except, char* path)
+{
+    for (int name = 0; name < 26 * 26; ++name) {
+        sprintf(path, "%s%c%c/", parent, 'a' + name / 26, 'a' + name % 26);
+        if ((trouter_shard_of(router, path) == shard) == same && (!except || strcmp(path, except) != 0))
+            return;
+    }
+    fatal("No name for a shard under %s", parent);
+}
+
+static void shallow(TreeRouter* router)
+{
+    expect(trouter_create(router, "/a/"), 0, "Shallow create");
+    expect(trouter_create(router, "/a/"), EEXIST, "Shallow create again");
+    expect(trouter_create(router, "/b/"), 0, "Shallow create");
+    expect_listing(router, "/", "a,b");
+
+    char first[16];
+    char second[16];
+    path_in_shard(router, "/a/", 0, true, NULL, first);
+    path_in_shard(router, "/a/", 0, false, NULL, second);
+    expect(trouter_create(router, first), 0, "Create in a shard");
+    expect(trouter_create(router, second), 0, "Create in another shard");
+    bool ordered = strcmp(first, second) < 0;
+    char merged[8]; // Both names, sorted.
+    sprintf(merged, "%.2s,%.2s", ordered ? first + 3 : second + 3, ordered ? second + 3 : first + 3);
+    expect_listing(router, "/a/", merged);
+    expect(trouter_remove(router, "/a/"), ENOTEMPTY, "Shallow remove of a folder with children");
+    expect(trouter_remove(router, first), 0, "Remove in a shard");
+    expect(trouter_remove(router, "/a/"), ENOTEMPTY, "Shallow remove of a folder with a child in one shard");
+    expect(trouter_remove(router, second), 0, "Remove in another shard");
+    expect(trouter_remove(router, "/a/"), 0, "Shallow remove");
+    expect(trouter_remove(router, "/a/"), ENOENT, "Shallow remove again");
+    expect_listing(router, "/", "b");
+}
+
+static void rollback(TreeRouter* router)
+{
+    int failures = 0;
+    for (long n = 1;; ++n) {
+        failing = n;
+        int result = trouter_create(router, "/c/");
+        failing = 0;
+        if (result == 0)
+            break;
+        expect(result, ENOMEM, "Shallow create out of memory");
+        expect_listing(router, "/", "b"); // In none of the shards.
+        failures++;
+    }
+    expect_listing(router, "/", "b,c");
+    for (long n = 1;; ++n) {
+        failing = n;
+        int result = trouter_remove(router, "/c/");
+        failing = 0;
+        if (result == 0)
+            break;
+        expect(result, ENOMEM, "Shallow remove out of memory");
+        expect_listing(router, "/", "b,c"); // In all of the shards.
+        failures++;
+    }
+    expect_listing(router, "/", "b");
+    if (failures < SHARDS)
+        fatal("Only %d allocations failed", failures);
+}
+
+static void moves(TreeRouter* router)
+{
+    char source[16];
+    char target[16];
+    char other[16];
+    char inside[32];
+    path_in_shard(router, "/b/", 0, true, NULL, source);
+    path_in_shard(router, "/b/", 0, false, NULL, target);
+    path_in_shard(router, "/b/", trouter_shard_of(router, target), true, target, other);
+    sprintf(inside, "%sx/", source);
+    expect(trouter_create(router, source), 0, "Create a source");
+    expect(trouter_create(router, inside), 0, "Create inside of it");
+    strcat(inside, "y/");
+    expect(trouter_create(router, inside), 0, "Create deeper");
+
+    expect(trouter_move(router, "/b/", "/d/"), EXDEV, "Shallow move");
+    expect(trouter_move(router, source, "/d/"), EXDEV, "Move above the sharding depth");
+    expect(trouter_move(router, "/b/", target), EXDEV, "Move from above the sharding depth");
+    expect(trouter_move(router, source, "/d/dd/"), ENOENT, "Move to a missing parent");
+    expect(trouter_move(router, "/d/dd/", target), ENOENT, "Move from a missing parent");
+    expect(trouter_move(router, source, target), 0, "Move to another shard");
+    expect_listing(router, source, NULL);
+    expect_listing(router, target, "x");
+    sprintf(inside, "%sx/", target);
+    expect_listing(router, inside, "y");
+    expect(trouter_move(router, target, other), 0, "Move inside of a shard");
+    expect_listing(router, target, NULL);
+    expect_listing(router, other, "x");
+    expect(trouter_create(router, source), 0, "Create at the old source");
+    expect(trouter_move(router, other, source), EEXIST, "Move onto a folder in another shard");
+
+    expect(trouter_remove(router, source), 0, "Remove the old source");
+    int failures = 0;
+    for (long n = 1;; ++n) {
+        failing = n;
+        int result = trouter_move(router, other, source);
+        failing = 0;
+        if (result == 0)
+            break;
+        expect(result, ENOMEM, "Move to another shard out of memory");
+        expect_listing(router, other, "x"); // Not moved.
+        expect_listing(router, source, NULL);
+        failures++;
+    }
+    expect_listing(router, other, NULL);
+    sprintf(inside, "%sx/", source);
+    expect_listing(router, inside, "y");
+    if (failures == 0)
+        fatal("No allocation of a move failed");
+}
+
+int main(void)
+{
+    TreeRouter* router = trouter_new(SHARDS, 2);
+    if (!router)
+        fatal("trouter_new");
+    shallow(router);
+    rollback(router);
+    moves(router);
+    trouter_free(router);
+    printf("ok: %d shards\n", SHARDS);
+    return 0;
+}
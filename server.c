@@ -0,0 +1,386 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Tree.h"
+#include "TreeProtocol.h"
+#include "err.h"
+#include "path_utils.h"
+
+// Serves one tree to the processes that connect to a Unix domain socket (see TreeProtocol.h).
+// Usage: server socket_path [workers] [journal_path]
+// With `journal_path`, the tree is the one kept there (see tree_recover), and every change is written to its journal
+// before it is answered. The server stops on SIGINT or SIGTERM.
+//
+// The main thread accepts connections and gives them to the workers in turn. Every worker waits for its connections with
+// an epoll of its own; a connection belongs to one worker, so its requests are executed one after another, in order.
+
+#define DEFAULT_WORKERS 4
+
+#define EPOLL_EVENTS 64
+
+// How much a connection reads at once, and how many unsent responses it may have before the server stops reading its requests.
+#define READ_SIZE (64 * 1024)
+#define MAX_PENDING_OUTPUT (1024 * 1024)
+
+// How long the listener is left alone once the server is out of descriptors, before accepting is tried again.
+#define ACCEPT_PAUSE_MS 100
+
+typedef struct Connection Connection;
+
+struct Connection {
+    int fd;
+    unsigned char* input; // READ_SIZE bytes, the first `input_length` of them not executed yet.
+    size_t input_length;
+    unsigned char* output; // Responses from `output_start` to `output_length` are not sent yet.
+    size_t output_start;
+    size_t output_length;
+    size_t output_capacity;
+    bool reading; // EPOLLIN is on, not turned off because of too much output.
+    bool writing; // EPOLLOUT is on.
+    bool finished; // The client sends nothing more: once the responses are sent, the connection is closed.
+};
+
+typedef struct Worker Worker;
+
+struct Worker {
+    pthread_t thread;
+    int epoll; // Also waits for an eventfd, readable once the server stops.
+    Tree* tree;
+};
+
+// Make room for `size` more bytes of output. Return false if out of memory.
+static bool reserve_output(Connection* connection, size_t size)
+{
+    if (connection->output_start > 0 && connection->output_start == connection->output_length) {
+        connection->output_start = 0;
+        connection->output_length = 0;
+    }
+    if (connection->output_length + size <= connection->output_capacity)
+        return true;
+    size_t capacity = connection->output_capacity > 0 ? connection->output_capacity : READ_SIZE;
+    while (capacity < connection->output_length + size)
+        capacity *= 2;
+    unsigned char* output = realloc(connection->output, capacity);
+    if (!output)
+        return false;
+    connection->output = output;
+    connection->output_capacity = capacity;
+    return true;
+}
+
+// Append the header of a response, whose `length` bytes of listing are in the output right after it already.
+static void add_header(Connection* connection, uint32_t id, int32_t result, size_t length)
+{
+    unsigned char* frame = connection->output + connection->output_length;
+    uint32_t frame_length = TREE_RESPONSE_HEADER - sizeof(uint32_t) + length;
+    memcpy(frame, &frame_length, sizeof(uint32_t));
+    memcpy(frame + 4, &id, sizeof(uint32_t));
+    memcpy(frame + 8, &result, sizeof(int32_t));
+    connection->output_length += TREE_RESPONSE_HEADER + length;
+}
+
+// Append a response without a listing. Return false if out of memory.
+static bool respond(Connection* connection, uint32_t id, int32_t result)
+{
+    if (!reserve_output(connection, TREE_RESPONSE_HEADER))
+        return false;
+    add_header(connection, id, result, 0);
+    return true;
+}
+
+// Append the response to listing `path`, with the listing written by tree_list_into right into the output.
+// Return false if out of memory (of the server, not of the tree: that is the result of the request).
+static bool respond_listing(Worker* worker, Connection* connection, uint32_t id, const char* path)
+{
+    size_t needed;
+    int result = tree_list_into(worker->tree, path, NULL, 0, &needed);
+    while (result == ERANGE) { // Again if the folder has grown meanwhile.
+        if (!reserve_output(connection, TREE_RESPONSE_HEADER + needed))
+            return false;
+        char* listing = (char*)connection->output + connection->output_length + TREE_RESPONSE_HEADER;
+        result = tree_list_into(worker->tree, path, listing, needed, &needed);
+    }
+    if (result != 0)
+        return respond(connection, id, result);
+    add_header(connection, id, 0, needed - 1); // Without the null character.
+    return true;
+}
+
+// Read a path of a request into `path` (MAX_PATH_LENGTH + 1 bytes). Return false if it does not fit in the frame.
+static bool read_path(const unsigned char** position, const unsigned char* end, char* path)
+{
+    uint16_t length;
+    if (end - *position < (ptrdiff_t)sizeof(uint16_t))
+        return false;
+    memcpy(&length, *position, sizeof(uint16_t));
+    *position += sizeof(uint16_t);
+    if (length > MAX_PATH_LENGTH || end - *position < length)
+        return false;
+    memcpy(path, *position, length);
+    path[length] = '\0';
+    *position += length;
+    return true;
+}
+
+// Execute the request in `frame` (of `length` bytes, without its length) and append its response.
+// Return false if out of memory.
+static bool execute(Worker* worker, Connection* connection, const unsigned char* frame, size_t length)
+{
+    uint32_t id;
+    memcpy(&id, frame, sizeof(uint32_t));
+    uint8_t operation = frame[4];
+    const unsigned char* position = frame + 5;
+    const unsigned char* end = frame + length;
+    char path[MAX_PATH_LENGTH + 1];
+    char target[MAX_PATH_LENGTH + 1];
+    if (operation < TREE_OP_LIST || operation > TREE_OP_MOVE)
+        return respond(connection, id, ENOSYS);
+    if (!read_path(&position, end, path) || (operation == TREE_OP_MOVE && !read_path(&position, end, target)) || position != end)
+        return respond(connection, id, EINVAL);
+
+    switch (operation) {
+    case TREE_OP_LIST:
+        return respond_listing(worker, connection, id, path);
+    case TREE_OP_CREATE:
+        return respond(connection, id, tree_create(worker->tree, path));
+    case TREE_OP_REMOVE:
+        return respond(connection, id, tree_remove(worker->tree, path));
+    default:
+        return respond(connection, id, tree_move(worker->tree, path, target));
+    }
+}
+
+// Execute all of the whole requests read so far. Return false if the connection has to be closed.
+static bool execute_all(Worker* worker, Connection* connection)
+{
+    size_t start = 0;
+    while (connection->input_length - start >= sizeof(uint32_t)) {
+        uint32_t length;
+        memcpy(&length, connection->input + start, sizeof(uint32_t));
+        if (length < TREE_REQUEST_HEADER - sizeof(uint32_t) || length > TREE_MAX_REQUEST - sizeof(uint32_t))
+            return false; // Not a request, the rest of the stream cannot be trusted.
+        if (connection->input_length - start - sizeof(uint32_t) < length)
+            break;
+        if (!execute(worker, connection, connection->input + start + sizeof(uint32_t), length))
+            return false;
+        start += sizeof(uint32_t) + length;
+    }
+    memmove(connection->input, connection->input + start, connection->input_length - start);
+    connection->input_length -= start;
+    return true;
+}
+
+static void update_events(Worker* worker, Connection* connection, bool reading, bool writing)
+{
+    if (reading == connection->reading && writing == connection->writing)
+        return;
+    connection->reading = reading;
+    connection->writing = writing;
+    struct epoll_event event = { (reading ? EPOLLIN : 0) | (writing ? EPOLLOUT : 0), { .ptr = connection } };
+    epoll_ctl(worker->epoll, EPOLL_CTL_MOD, connection->fd, &event);
+}
+
+// Send as much of the output as the socket takes. Return false if the connection has to be closed.
+static bool send_output(Worker* worker, Connection* connection)
+{
+    while (connection->output_start < connection->output_length) {
+        ssize_t sent = send(connection->fd, connection->output + connection->output_start,
+            connection->output_length - connection->output_start, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (sent < 0)
+            return false;
+        connection->output_start += sent;
+    }
+    size_t pending = connection->output_length - connection->output_start;
+    update_events(worker, connection, !connection->finished && pending < MAX_PENDING_OUTPUT, pending > 0);
+    return !connection->finished || pending > 0;
+}
+
+// Read what has come, execute it and send the responses. Return false if the connection has to be closed.
+static bool receive_input(Worker* worker, Connection* connection)
+{
+    ssize_t received = recv(connection->fd, connection->input + connection->input_length, READ_SIZE - connection->input_length, 0);
+    if (received < 0)
+        return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+    if (received == 0) { // The client has shut down its side (a request cut short is never executed), it may still read.
+        connection->finished = true;
+        return send_output(worker, connection);
+    }
+    connection->input_length += received;
+    return execute_all(worker, connection) && send_output(worker, connection);
+}
+
+static void close_connection(Worker* worker, Connection* connection)
+{
+    epoll_ctl(worker->epoll, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    free(connection->input);
+    free(connection->output);
+    free(connection);
+}
+
+static void* working(void* argument)
+{
+    Worker* worker = argument;
+    struct epoll_event events[EPOLL_EVENTS];
+    bool stopping = false;
+    while (!stopping) {
+        int count = epoll_wait(worker->epoll, events, EPOLL_EVENTS, -1);
+        if (count < 0 && errno != EINTR)
+            syserr("epoll_wait");
+        for (int i = 0; i < count; ++i) {
+            Connection* connection = events[i].data.ptr;
+            if (!connection) {
+                stopping = true;
+                continue;
+            }
+            bool open = true;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                open = false;
+            if (open && (events[i].events & EPOLLOUT))
+                open = send_output(worker, connection);
+            if (open && (events[i].events & EPOLLIN))
+                open = receive_input(worker, connection);
+            if (!open)
+                close_connection(worker, connection);
+        }
+    }
+    return NULL;
+}
+
+// Give a new connection to `worker`. Return false if out of memory.
+static bool adding_connection(Worker* worker, int fd)
+{
+    Connection* connection = calloc(1, sizeof(Connection));
+    unsigned char* input = malloc(READ_SIZE);
+    if (!connection || !input) {
+        free(connection);
+        free(input);
+        return false;
+    }
+    connection->fd = fd;
+    connection->input = input;
+    connection->reading = true;
+    struct epoll_event event = { EPOLLIN, { .ptr = connection } };
+    if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+        free(input);
+        free(connection);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2 || argc > 4)
+        fatal("Usage: %s socket_path [workers] [journal_path]", argv[0]);
+    int worker_count = argc > 2 ? atoi(argv[2]) : DEFAULT_WORKERS;
+    if (worker_count < 1)
+        fatal("The number of workers has to be positive");
+
+    // The signals are taken by the main thread only, through a signalfd; blocked before the tree starts
+    // threads of its own, so that none of them is killed by one.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    Tree* tree = argc > 3 ? tree_recover(argv[3], TREE_DURABILITY_WRITTEN) : tree_new();
+    if (!tree)
+        syserr("Cannot make the tree");
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(argv[1]) >= sizeof(address.sun_path))
+        fatal("The socket path is too long");
+    strcpy(address.sun_path, argv[1]);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener < 0)
+        syserr("socket");
+    unlink(argv[1]); // Left by a server that was killed.
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+        syserr("Cannot listen on %s", argv[1]);
+
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    int stop = eventfd(0, EFD_CLOEXEC);
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd < 0 || stop < 0 || epoll < 0)
+        syserr("Cannot set up the main loop");
+    struct epoll_event event = { EPOLLIN, { .fd = listener } };
+    epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &event);
+    event.data.fd = signal_fd;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, signal_fd, &event);
+
+    Worker workers[worker_count];
+    for (int i = 0; i < worker_count; ++i) {
+        workers[i].tree = tree;
+        workers[i].epoll = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event stopping = { EPOLLIN, { .ptr = NULL } };
+        if (workers[i].epoll < 0 || epoll_ctl(workers[i].epoll, EPOLL_CTL_ADD, stop, &stopping) != 0)
+            syserr("Cannot set up a worker");
+        if ((errno = pthread_create(&workers[i].thread, NULL, working, &workers[i])) != 0)
+            syserr("pthread_create");
+    }
+
+    int next = 0;
+    bool running = true;
+    bool accepting = true;
+    while (running) {
+        struct epoll_event events[2];
+        int count = epoll_wait(epoll, events, 2, accepting ? -1 : ACCEPT_PAUSE_MS);
+        if (count < 0 && errno != EINTR)
+            syserr("epoll_wait");
+        if (!accepting) {
+            event.data.fd = listener;
+            epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &event);
+            accepting = true;
+        }
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.fd == signal_fd) {
+                running = false;
+                continue;
+            }
+            int fd;
+            while ((fd = accept(listener, NULL, NULL)) >= 0) {
+                if (fcntl(fd, F_SETFL, O_NONBLOCK) != 0 || !adding_connection(&workers[next], fd))
+                    close(fd);
+                next = (next + 1) % worker_count;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // The connection waits in the backlog and the listener stays readable: it is left out of the epoll for a
+                // while, instead of waking this loop again at once, until connections closed meanwhile make room.
+                epoll_ctl(epoll, EPOLL_CTL_DEL, listener, NULL);
+                accepting = false;
+            }
+        }
+    }
+
+    uint64_t one = 1;
+    if (write(stop, &one, sizeof(one)) != sizeof(one))
+        syserr("Cannot stop the workers");
+    for (int i = 0; i < worker_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        // The connections left are freed with the process.
+        close(workers[i].epoll);
+    }
+    close(listener);
+    unlink(argv[1]);
+    tree_free(tree); // With a journal, writes what is left of it.
+    return 0;
+}
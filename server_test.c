@@ -0,0 +1,313 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "TreeProtocol.h"
+#include "err.h"
+
+// A client of the tree server (see TreeProtocol.h), run against a server started by the test itself:
+//  - many requests sent at once, before any response is read, answered in order,
+//  - a request sent in pieces, with pauses between them,
+//  - ENOSYS for an unknown operation, EINVAL for paths that do not fit in the frame and for invalid paths,
+//  - a client that shuts down its side right after its requests still gets all of their responses,
+//  - a frame longer than any request closes the connection.
+// Usage: server_test server_executable
+
+#define PIPELINED 2000
+
+// A request frame, built by add_request.
+typedef struct Requests {
+    unsigned char data[1 << 20];
+    size_t length;
+} Requests;
+
+static void add_bytes(Requests* requests, const void* bytes, size_t length)
+{
+    if (requests->length + length > sizeof(requests->data))
+        fatal("Too many requests");
+    memcpy(requests->data + requests->length, bytes, length);
+    requests->length += length;
+}
+
+static void add_path(Requests* requests, const char* path)
+{
+    uint16_t length = strlen(path);
+    add_bytes(requests, &length, sizeof(length));
+    add_bytes(requests, path, length);
+}
+
+// Append a request with its paths (`target` only if it is not NULL).
+static void add_request(Requests* requests, uint32_t id, uint8_t operation, const char* path, const char* target)
+{
+    uint32_t length = TREE_REQUEST_HEADER - sizeof(uint32_t) + 2 + strlen(path) + (target ? 2 + strlen(target) : 0);
+    add_bytes(requests, &length, sizeof(length));
+    add_bytes(requests, &id, sizeof(id));
+    add_bytes(requests, &operation, sizeof(operation));
+    add_path(requests, path);
+    if (target)
+        add_path(requests, target);
+}
+
+static void send_all(int fd, const void* data, size_t length)
+{
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0)
+            syserr("send");
+        data = (const char*)data + sent;
+        length -= sent;
+    }
+}
+
+// Read exactly `length` bytes. Return false on the end of the stream before the first one.
+static bool receive_all(int fd, void* data, size_t length)
+{
+    size_t received = 0;
+    while (received < length) {
+        ssize_t count = recv(fd, (char*)data + received, length - received, 0);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            syserr("recv");
+        if (count == 0 && received == 0)
+            return false;
+        if (count == 0)
+            fatal("The connection was closed in the middle of a response");
+        received += count;
+    }
+    return true;
+}
+
+// Read the next response into `*id`, `*result` and `listing` (4096 bytes, null-terminated). Return false on the end
+// of the stream.
+static bool receive_response(int fd, uint32_t* id, int32_t* result, char* listing)
+{
+    unsigned char header[TREE_RESPONSE_HEADER];
+    if (!receive_all(fd, header, sizeof(header)))
+        return false;
+    uint32_t length;
+    memcpy(&length, header, sizeof(uint32_t));
+    memcpy(id, header + 4, sizeof(uint32_t));
+    memcpy(result, header + 8, sizeof(int32_t));
+    size_t listing_length = length - (TREE_RESPONSE_HEADER - sizeof(uint32_t));
+    if (length < TREE_RESPONSE_HEADER - sizeof(uint32_t) || listing_length > 4095)
+        fatal("A response of a wrong length: %u", length);
+    if (listing_length > 0 && !receive_all(fd, listing, listing_length))
+        fatal("The connection was closed in the middle of a response");
+    listing[listing_length] = '\0';
+    return true;
+}
+
+static void expect(int fd, uint32_t id, int32_t result, const char* listing)
+{
+    uint32_t got_id;
+    int32_t got_result;
+    char got_listing[4096];
+    if (!receive_response(fd, &got_id, &got_result, got_listing))
+        fatal("No response to request %u", id);
+    if (got_id != id || got_result != result || (listing && strcmp(got_listing, listing) != 0))
+        fatal("Request %u: got %u with %d \"%s\", not %d \"%s\"", id, got_id, got_result, got_listing, result,
+            listing ? listing : "");
+}
+
+static void expect_closed(int fd)
+{
+    uint32_t id;
+    int32_t result;
+    char listing[4096];
+    if (receive_response(fd, &id, &result, listing))
+        fatal("Response %u after the end", id);
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec pause = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&pause, NULL);
+}
+
+// A connection to the server at `socket_path`, waiting for it to listen.
+static int connecting(const char* socket_path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strcpy(address.sun_path, socket_path);
+    for (int attempt = 0; attempt < 500; ++attempt) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            syserr("socket");
+        if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0)
+            return fd;
+        close(fd);
+        sleep_ms(10);
+    }
+    fatal("Cannot connect to the server");
+    return -1;
+}
+
+// The name of the `i`-th folder, `i` in letters.
+static void folder_path(int i, char* path)
+{
+    *path++ = '/';
+    do {
+        *path++ = 'a' + i % 26;
+        i /= 26;
+    } while (i > 0);
+    *path++ = '/';
+    *path = '\0';
+}
+
+static Requests requests;
+
+static void pipelined(const char* socket_path)
+{
+    int fd = connecting(socket_path);
+    requests.length = 0;
+    char path[16];
+    for (int i = 0; i < PIPELINED; ++i) {
+        folder_path(i, path);
+        add_request(&requests, 2 * i, TREE_OP_CREATE, path, NULL);
+        add_request(&requests, 2 * i + 1, TREE_OP_LIST, path, NULL);
+    }
+    send_all(fd, requests.data, requests.length);
+    for (int i = 0; i < PIPELINED; ++i) {
+        expect(fd, 2 * i, 0, NULL);
+        expect(fd, 2 * i + 1, 0, "");
+    }
+    requests.length = 0;
+    for (int i = 0; i < PIPELINED; ++i) {
+        folder_path(i, path);
+        add_request(&requests, i, TREE_OP_REMOVE, path, NULL);
+    }
+    send_all(fd, requests.data, requests.length);
+    for (int i = 0; i < PIPELINED; ++i)
+        expect(fd, i, 0, NULL);
+    close(fd);
+}
+
+static void split(const char* socket_path)
+{
+    int fd = connecting(socket_path);
+    requests.length = 0;
+    add_request(&requests, 7, TREE_OP_CREATE, "/split/", NULL);
+    add_request(&requests, 8, TREE_OP_MOVE, "/split/", "/joined/");
+    add_request(&requests, 9, TREE_OP_LIST, "/", NULL);
+    size_t pieces[] = { 1, 3, 5, 2, 11 }; // Cutting the length, the header and the paths.
+    size_t sent = 0;
+    for (size_t p = 0; p < sizeof(pieces) / sizeof(pieces[0]); ++p) {
+        send_all(fd, requests.data + sent, pieces[p]);
+        sent += pieces[p];
+        sleep_ms(20);
+    }
+    send_all(fd, requests.data + sent, requests.length - sent);
+    expect(fd, 7, 0, NULL);
+    expect(fd, 8, 0, NULL);
+    expect(fd, 9, 0, "joined");
+    close(fd);
+}
+
+static void errors(const char* socket_path)
+{
+    int fd = connecting(socket_path);
+    requests.length = 0;
+    add_request(&requests, 1, 9, "/", NULL);
+    add_request(&requests, 2, 0, "/", NULL);
+    // A path longer than its frame: the length of the frame is the length of an empty path.
+    uint32_t length = TREE_REQUEST_HEADER - sizeof(uint32_t) + 2;
+    uint32_t id = 3;
+    uint8_t operation = TREE_OP_CREATE;
+    uint16_t path_length = 100;
+    add_bytes(&requests, &length, sizeof(length));
+    add_bytes(&requests, &id, sizeof(id));
+    add_bytes(&requests, &operation, sizeof(operation));
+    add_bytes(&requests, &path_length, sizeof(path_length));
+    add_request(&requests, 4, TREE_OP_MOVE, "/a/", NULL); // Without its target.
+    add_request(&requests, 5, TREE_OP_CREATE, "/NotAName/", NULL);
+    add_request(&requests, 6, TREE_OP_LIST, "/missing/", NULL);
+    add_request(&requests, 7, TREE_OP_LIST, "relative/", NULL);
+    add_request(&requests, 8, TREE_OP_REMOVE, "/", NULL);
+    add_request(&requests, 9, TREE_OP_LIST, "/", NULL); // Still served after all of that.
+    send_all(fd, requests.data, requests.length);
+    expect(fd, 1, ENOSYS, NULL);
+    expect(fd, 2, ENOSYS, NULL);
+    expect(fd, 3, EINVAL, NULL);
+    expect(fd, 4, EINVAL, NULL);
+    expect(fd, 5, EINVAL, NULL);
+    expect(fd, 6, ENOENT, NULL);
+    expect(fd, 7, EINVAL, NULL);
+    expect(fd, 8, EBUSY, NULL);
+    expect(fd, 9, 0, "joined");
+    close(fd);
+}
+
+static void half_closed(const char* socket_path)
+{
+    int fd = connecting(socket_path);
+    requests.length = 0;
+    char path[16];
+    for (int i = 0; i < PIPELINED; ++i) {
+        folder_path(i - i % 2, path); // Created, then listed.
+        add_request(&requests, i, i % 2 == 0 ? TREE_OP_CREATE : TREE_OP_LIST, path, NULL);
+    }
+    add_bytes(&requests, "\x20\0\0", 3); // A request cut short, never executed.
+    send_all(fd, requests.data, requests.length);
+    if (shutdown(fd, SHUT_WR) != 0)
+        syserr("shutdown");
+    for (int i = 0; i < PIPELINED; ++i)
+        expect(fd, i, 0, i % 2 == 0 ? NULL : "");
+    expect_closed(fd);
+    close(fd);
+}
+
+static void oversized(const char* socket_path)
+{
+    int fd = connecting(socket_path);
+    requests.length = 0;
+    add_request(&requests, 1, TREE_OP_LIST, "/joined/", NULL);
+    send_all(fd, requests.data, requests.length);
+    expect(fd, 1, 0, "");
+    uint32_t length = TREE_MAX_REQUEST; // One more than the longest, counting its length.
+    send_all(fd, &length, sizeof(length));
+    expect_closed(fd);
+    close(fd);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2)
+        fatal("Usage: %s server_executable", argv[0]);
+    char socket_path[64];
+    snprintf(socket_path, sizeof(socket_path), "/tmp/server_test_%d.socket", (int)getpid());
+    pid_t server = fork();
+    if (server < 0)
+        syserr("fork");
+    if (server == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM); // Not left running when the test fails.
+        execl(argv[1], argv[1], socket_path, "2", (char*)NULL);
+        syserr("Cannot run %s", argv[1]);
+    }
+
+    pipelined(socket_path);
+    split(socket_path);
+    errors(socket_path);
+    half_closed(socket_path);
+    oversized(socket_path);
+
+    int status;
+    if (kill(server, SIGTERM) != 0 || waitpid(server, &status, 0) != server)
+        syserr("Cannot stop the server");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fatal("The server failed");
+    printf("ok: %d pipelined requests\n", 2 * PIPELINED);
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "SharedTree.h"
+#include "err.h"
+
+// Two processes working on one SharedTree at the same time: each of them creates its own folders in "/a/", moves
+// them to "/b/" and lists both folders while the other one does the same, then the parent checks what is left.
+// Usage: shared_tree_test [folders], 10000 folders per process by default (enough for the two to overlap).
+
+#define SEGMENT_SIZE (16 * 1024 * 1024)
+
+// The name of the `i`-th folder of a process: its letter, then `i` in letters.
+static void folder_name(char letter, int i, char* name)
+{
+    *name++ = letter;
+    do {
+        *name++ = 'a' + i % 26;
+        i /= 26;
+    } while (i > 0);
+    *name = '\0';
+}
+
+// Whether `listing` is a list of names in increasing order (a listing may be taken in the middle of the other
+// process's changes, but never sees one half done).
+static bool sorted_listing(const char* listing)
+{
+    const char* previous = NULL;
+    size_t previous_length = 0;
+    const char* name = listing;
+    while (*name != '\0') {
+        size_t length = strcspn(name, ",");
+        if (length == 0)
+            return false;
+        if (previous) {
+            int order = strncmp(previous, name, length < previous_length ? length : previous_length);
+            if (order > 0 || (order == 0 && previous_length >= length))
+                return false;
+        }
+        previous = name;
+        previous_length = length;
+        name += length;
+        if (*name == ',')
+            name++;
+    }
+    return true;
+}
+
+static void check_listing(SharedTree* tree, const char* path)
+{
+    char* listing = stree_list(tree, path);
+    if (!listing)
+        fatal("Cannot list %s", path);
+    if (!sorted_listing(listing))
+        fatal("The listing of %s is not sorted: %s", path, listing);
+    free(listing);
+}
+
+// The work of one process: every folder is created in "/a/" and then moved to "/b/", every third one is removed there.
+static void working(SharedTree* tree, char letter, int folders)
+{
+    char name[16];
+    char source[32];
+    char target[32];
+    for (int i = 0; i < folders; ++i) {
+        folder_name(letter, i, name);
+        sprintf(source, "/a/%s/", name);
+        sprintf(target, "/b/%s/", name);
+        int err = stree_create(tree, source);
+        if (err != 0)
+            fatal("Cannot create %s (%d)", source, err);
+        if ((err = stree_create(tree, source)) != EEXIST)
+            fatal("Created %s twice (%d)", source, err);
+        if ((err = stree_move(tree, source, target)) != 0)
+            fatal("Cannot move %s to %s (%d)", source, target, err);
+        if (i % 3 == 0 && (err = stree_remove(tree, target)) != 0)
+            fatal("Cannot remove %s (%d)", target, err);
+        if (i % 16 == 0) {
+            check_listing(tree, "/a/");
+            check_listing(tree, "/b/");
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int folders = argc > 1 ? atoi(argv[1]) : 10000;
+    char segment[64];
+    sprintf(segment, "/shared_tree_test_%d", (int)getpid());
+
+    if (stree_new(segment, 64) != NULL || errno != ENOSPC)
+        fatal("A segment too small for the root was not refused with ENOSPC");
+    SharedTree* tree = stree_new(segment, SEGMENT_SIZE);
+    if (!tree)
+        syserr("stree_new");
+    if (stree_create(tree, "/a/") != 0 || stree_create(tree, "/b/") != 0)
+        fatal("Cannot create the folders to work in");
+
+    pid_t child = fork();
+    if (child < 0)
+        syserr("fork");
+    if (child == 0) { // With a mapping of its own, not the one inherited from the parent.
+        stree_close(tree);
+        SharedTree* opened = stree_open(segment);
+        if (!opened)
+            syserr("stree_open");
+        working(opened, 'c', folders);
+        stree_close(opened);
+        return 0;
+    }
+    working(tree, 'p', folders);
+    int status;
+    if (waitpid(child, &status, 0) != child)
+        syserr("waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fatal("The child process failed");
+
+    // Both processes see the same tree: "/a/" is empty, "/b/" has the folders that were not removed, in order.
+    char* listing = stree_list(tree, "/a/");
+    if (!listing || listing[0] != '\0')
+        fatal("/a/ is not empty: %s", listing ? listing : "(none)");
+    free(listing);
+    listing = stree_list(tree, "/b/");
+    if (!listing || !sorted_listing(listing))
+        fatal("Cannot list /b/, or it is not sorted");
+    int count = 0;
+    for (char* c = listing; *c != '\0'; ++c)
+        count += *c == ',';
+    count += listing[0] != '\0';
+    free(listing);
+    int expected = 2 * (folders - (folders + 2) / 3);
+    if (count != expected)
+        fatal("/b/ has %d folders, not %d", count, expected);
+    char name[16];
+    char path[32];
+    for (int i = 0; i < folders; ++i) {
+        for (const char* letter = "cp"; *letter != '\0'; ++letter) {
+            folder_name(*letter, i, name);
+            sprintf(path, "/b/%s/", name);
+            listing = stree_list(tree, path);
+            if ((listing != NULL) != (i % 3 != 0))
+                fatal("%s is %s", path, listing ? "there" : "missing");
+            free(listing);
+        }
+    }
+
+    stree_close(tree);
+    if (stree_unlink(segment) != 0)
+        fatal("Cannot unlink the segment");
+    printf("ok: %d folders of each process\n", folders);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "path_utils.h"
+
+// Compares sort_names (used for the deltas of tree_list_since and the listings merged from shards) with qsort and strcmp,
+// on random folder names.
+// Usage: sort_benchmark [max_exponent], sorts 10^3 .. 10^max_exponent names (10^7 by default).
+
+#define MAX_NAME_LENGTH 12
+
+static int compare_string_pointers(const void* p1, const void* p2)
+{
+    return strcmp(*(const char**)p1, *(const char**)p2);
+}
+
+static double seconds_since(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+    int max_exponent = argc > 1 ? atoi(argv[1]) : 7;
+    srand(2137);
+
+    printf("%10s %12s %12s %8s\n", "keys", "qsort [s]", "radix [s]", "speedup");
+    size_t n = 1000;
+    for (int exponent = 3; exponent <= max_exponent; ++exponent, n *= 10) {
+        char* pool = malloc(n * (MAX_NAME_LENGTH + 1));
+        const char** by_qsort = malloc(n * sizeof(char*));
+        const char** by_radix = malloc(n * sizeof(char*));
+        if (!pool || !by_qsort || !by_radix) {
+            fprintf(stderr, "Not enough memory for %zu keys\n", n);
+            return 1;
+        }
+        char* position = pool;
+        for (size_t i = 0; i < n; ++i) {
+            int length = 1 + rand() % MAX_NAME_LENGTH;
+            by_qsort[i] = by_radix[i] = position;
+            for (int j = 0; j < length; ++j)
+                *position++ = 'a' + rand() % 26;
+            *position++ = '\0';
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        qsort(by_qsort, n, sizeof(char*), compare_string_pointers);
+        double qsort_time = seconds_since(&start);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        sort_names(by_radix, n);
+        double radix_time = seconds_since(&start);
+
+        for (size_t i = 0; i < n; ++i) {
+            if (strcmp(by_qsort[i], by_radix[i]) != 0) {
+                fprintf(stderr, "Results differ at %zu: %s %s\n", i, by_qsort[i], by_radix[i]);
+                return 1;
+            }
+        }
+        printf("%10zu %12.4f %12.4f %7.2fx\n", n, qsort_time, radix_time, qsort_time / radix_time);
+
+        free(pool);
+        free(by_qsort);
+        free(by_radix);
+    }
+    return 0;
+}
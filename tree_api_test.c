@@ -0,0 +1,277 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Tree.h"
+#include "err.h"
+
+// The parts of the Tree.h API that go beyond single operations on paths:
+//  - handles (tree_open) that stay on their folder while it or its ancestors are moved,
+//  - watches: moves inside, out of and into the watched folder, events below it for recursive watches only, and a full
+//    ring that tells the reader about the lost events once,
+//  - tree_create_all on a path that exists (whole or in part), which changes nothing that is there already,
+//  - handles and watches in a subtree removed by tree_remove_recursive: ENOENT for every operation through the removed
+//    folder at once, through the folders inside of it once the background thread frees them, even if a folder is created
+//    at the same path again,
+//  - snapshots, which keep showing the tree as it was, whatever is created, removed or moved after them.
+
+static void expect(int result, int expected, const char* what)
+{
+    if (result != expected)
+        fatal("%s: %d instead of %d", what, result, expected);
+}
+
+// Check (and free) `listing`: NULL if `expected` is NULL.
+static void expect_listing(char* listing, const char* expected, const char* what)
+{
+    if (!listing != !expected || (listing && strcmp(listing, expected) != 0))
+        fatal("%s: \"%s\" instead of \"%s\"", what, listing ? listing : "(none)", expected ? expected : "(none)");
+    free(listing);
+}
+
+static void handle_after_moves(Tree* tree)
+{
+    expect(tree_create_all(tree, "/a/b/c/"), 0, "Create a path");
+    TreeHandle* handle = tree_open(tree, "/a/b/");
+    if (!handle)
+        fatal("tree_open");
+
+    expect(tree_move(tree, "/a/", "/x/"), 0, "Move the parent");
+    expect_listing(tree_list_at(handle, "/"), "c", "Listing through the handle after its parent moved");
+    expect(tree_create_at(handle, "/d/"), 0, "Create through the handle");
+    expect_listing(tree_list(tree, "/x/b/"), "c,d", "Listing at the new path");
+
+    expect(tree_create(tree, "/y/"), 0, "Create a new parent");
+    expect(tree_move(tree, "/x/", "/y/x/"), 0, "Move the parent deeper");
+    expect(tree_move(tree, "/y/x/b/", "/e/"), 0, "Move the folder itself");
+    expect(tree_move_at(handle, "/c/", "/d/c/"), 0, "Move through the handle");
+    expect_listing(tree_list(tree, "/e/d/"), "c", "Listing of the moved folder");
+    expect_listing(tree_list_at(handle, "/d/"), "c", "Listing of the moved folder through the handle");
+    expect_listing(tree_list(tree, "/y/x/"), "", "Listing of the old parent");
+    expect(tree_remove_at(handle, "/d/"), ENOTEMPTY, "Remove a folder with a child through the handle");
+
+    tree_close(handle);
+    expect(tree_remove_recursive(tree, "/e/"), 0, "Remove the moved folder");
+    expect(tree_remove_recursive(tree, "/y/"), 0, "Remove the new parent");
+}
+
+// Read the next event of `watch` (there has to be one) and check it; `target` only for a move, `overflowed` as the read
+// should tell it.
+static void expect_event(TreeWatch* watch, TreeEventType type, const char* path, const char* target, bool overflowed)
+{
+    TreeEvent* event;
+    bool lost;
+    if (tree_watch_read(watch, &event, 1, &lost) != 1)
+        fatal("No event, expected %s", path);
+    if (event->type != type || strcmp(event->path, path) != 0 || !event->target != !target
+        || (target && strcmp(event->target, target) != 0))
+        fatal("Event %d %s %s instead of %d %s %s", event->type, event->path, event->target ? event->target : "", type,
+            path, target ? target : "");
+    if (lost != overflowed)
+        fatal("At %s: overflowed is %d", path, lost);
+    free(event);
+}
+
+static void expect_no_event(TreeWatch* watch, bool overflowed, const char* what)
+{
+    TreeEvent* event;
+    bool lost;
+    if (tree_watch_read(watch, &event, 1, &lost) != 0)
+        fatal("%s: an event of %s", what, event->path);
+    if (lost != overflowed)
+        fatal("%s: overflowed is %d", what, lost);
+}
+
+static void watching(Tree* tree)
+{
+    expect(tree_create(tree, "/w/"), 0, "Create a watched folder");
+    expect(tree_create(tree, "/z/"), 0, "Create a folder outside");
+    TreeWatch* watch = tree_watch(tree, "/w/", false, 4);
+    TreeWatch* recursive = tree_watch(tree, "/w/", true, 64);
+    if (!watch || !recursive)
+        fatal("tree_watch");
+
+    expect(tree_create(tree, "/w/a/"), 0, "Create");
+    expect(tree_move(tree, "/w/a/", "/w/b/"), 0, "Move inside");
+    expect(tree_create(tree, "/w/b/c/"), 0, "Create below");
+    expect(tree_move(tree, "/w/b/c/", "/w/d/"), 0, "Move up");
+    expect(tree_move(tree, "/w/b/", "/z/b/"), 0, "Move out");
+    expect(tree_move(tree, "/z/", "/w/z/"), 0, "Move in");
+    expect_event(watch, TREE_EVENT_CREATE, "/a/", NULL, true); // The move in did not fit into the ring of 4 events.
+    expect_event(watch, TREE_EVENT_MOVE, "/a/", "/b/", false);
+    expect_event(watch, TREE_EVENT_CREATE, "/d/", NULL, false); // Appeared, from a folder that is not watched.
+    expect_event(watch, TREE_EVENT_REMOVE, "/b/", NULL, false);
+    expect_no_event(watch, false, "After the overflow was read");
+    expect_event(recursive, TREE_EVENT_CREATE, "/a/", NULL, false);
+    expect_event(recursive, TREE_EVENT_MOVE, "/a/", "/b/", false);
+    expect_event(recursive, TREE_EVENT_CREATE, "/b/c/", NULL, false);
+    expect_event(recursive, TREE_EVENT_MOVE, "/b/c/", "/d/", false);
+    expect_event(recursive, TREE_EVENT_REMOVE, "/b/", NULL, false);
+    expect_event(recursive, TREE_EVENT_CREATE, "/z/", NULL, false);
+    expect_no_event(recursive, false, "The recursive watch");
+
+    expect(tree_remove(tree, "/w/d/"), 0, "Remove after the overflow");
+    expect_event(watch, TREE_EVENT_REMOVE, "/d/", NULL, false);
+    expect(tree_remove_recursive(tree, "/w/"), 0, "Remove the watched folder");
+    expect_event(watch, TREE_EVENT_REMOVE, "/", NULL, false);
+    expect_no_event(watch, false, "After the watched folder was removed");
+    tree_unwatch(watch);
+    tree_unwatch(recursive);
+}
+
+static void creating_all(Tree* tree)
+{
+    expect(tree_create_all(tree, "/m/n/"), 0, "Create a path");
+    expect(tree_create(tree, "/m/o/"), 0, "Create a sibling");
+    unsigned long version;
+    char* added;
+    char* removed;
+    expect(tree_list_since(tree, "/m/", 0, &version, &added, &removed), ESTALE, "Version of a folder");
+    expect_listing(added, "n,o", "Listing with its version");
+    TreeWatch* watch = tree_watch(tree, "/", true, 16);
+    if (!watch)
+        fatal("tree_watch");
+
+    expect(tree_create_all(tree, "/m/n/"), 0, "Create an existing path");
+    expect(tree_create_all(tree, "/m/"), 0, "Create an existing parent");
+    expect(tree_create_all(tree, "/"), 0, "Create the root");
+    expect(tree_create(tree, "/m/n/"), EEXIST, "Create an existing folder");
+    expect_no_event(watch, false, "Creating existing folders");
+    unsigned long unchanged;
+    expect(tree_list_since(tree, "/m/", version, &unchanged, &added, &removed), 0, "Changes of an existing parent");
+    if (unchanged != version || added || removed)
+        fatal("Creating existing folders changed the version %lu to %lu", version, unchanged);
+
+    expect(tree_create_all(tree, "/m/n/p/q/"), 0, "Create a path that exists in part");
+    expect_event(watch, TREE_EVENT_CREATE, "/m/n/p/", NULL, false);
+    expect_event(watch, TREE_EVENT_CREATE, "/m/n/p/q/", NULL, false);
+    expect_no_event(watch, false, "Creating a path that exists in part");
+    expect_listing(tree_list(tree, "/m/"), "n,o", "Listing of an existing parent");
+    expect_listing(tree_list(tree, "/m/n/p/"), "q", "Listing of a created folder");
+    expect(tree_create_all(tree, "/m/N/"), EINVAL, "Create an invalid path");
+
+    TreeHandle* handle = tree_open(tree, "/m/");
+    if (!handle)
+        fatal("tree_open");
+    expect(tree_create_all_at(handle, "/n/p/"), 0, "Create an existing path through a handle");
+    expect(tree_create_all_at(handle, "/"), 0, "Create the folder of a handle");
+    expect_no_event(watch, false, "Creating existing folders through a handle");
+    tree_close(handle);
+    tree_unwatch(watch);
+    expect(tree_remove_recursive(tree, "/m/"), 0, "Remove the path");
+}
+
+// Wait until the background thread of `tree` has freed more than `reclaimed` removed folders (or subtrees).
+static void waiting_for_reclaimer(Tree* tree, size_t reclaimed)
+{
+    size_t now = reclaimed;
+    for (int wait = 0; wait < 500 && now == reclaimed; ++wait) {
+        struct timespec pause = { 0, 10 * 1000000 };
+        nanosleep(&pause, NULL);
+        tree_reclaim_stats(tree, NULL, &now, NULL, NULL);
+    }
+    if (now == reclaimed)
+        fatal("The removed subtree was not freed");
+}
+
+static void removed_recursively(Tree* tree)
+{
+    expect(tree_create_all(tree, "/r/s/t/u/"), 0, "Create a path");
+    TreeHandle* top = tree_open(tree, "/r/s/");
+    TreeHandle* deeper = tree_open(tree, "/r/s/t/");
+    if (!top || !deeper)
+        fatal("tree_open");
+    TreeWatch* watch = tree_watch_at(deeper, "/", false, 16);
+    if (!watch)
+        fatal("tree_watch_at");
+    size_t reclaimed;
+    tree_reclaim_stats(tree, NULL, &reclaimed, NULL, NULL);
+
+    // The removed folder is marked at once, the ones inside of it by the background thread.
+    expect(tree_remove_recursive(tree, "/r/s/"), 0, "Remove the subtree");
+    expect_listing(tree_list_at(top, "/"), NULL, "Listing through a handle");
+    expect(tree_create_at(top, "/x/"), ENOENT, "Create through a handle");
+    expect(tree_remove_recursive_at(top, "/t/"), ENOENT, "Remove a subtree through a handle");
+    expect(tree_move_at(top, "/t/", "/v/"), ENOENT, "Move through a handle");
+    waiting_for_reclaimer(tree, reclaimed);
+    size_t needed;
+    expect(tree_list_into_at(deeper, "/", NULL, 0, &needed), ENOENT, "Listing through a handle below");
+    expect(tree_create_all_at(deeper, "/x/y/"), ENOENT, "Create a path through a handle below");
+    expect(tree_remove_at(deeper, "/u/"), ENOENT, "Remove through a handle below");
+    expect(tree_copy_at(deeper, "/u/", "/w/"), ENOENT, "Copy through a handle below");
+    expect_event(watch, TREE_EVENT_REMOVE, "/", NULL, false);
+    expect_no_event(watch, false, "The watch of a removed folder");
+
+    expect(tree_create_all(tree, "/r/s/t/"), 0, "Create the path again");
+    expect(tree_create_at(top, "/x/"), ENOENT, "Create through a handle to the old folder");
+    expect_listing(tree_list_at(deeper, "/"), NULL, "Listing through a handle to the old folder below");
+    expect_listing(tree_list(tree, "/r/s/"), "t", "Listing of the new folder");
+    tree_unwatch(watch);
+    tree_close(top);
+    tree_close(deeper);
+    expect(tree_remove_recursive(tree, "/r/"), 0, "Remove the new path");
+}
+
+// Append `name` and a comma to the string `context`.
+static bool appending(const char* name, void* context)
+{
+    strcat(context, name);
+    strcat(context, ",");
+    return true;
+}
+
+static void snapshots(Tree* tree)
+{
+    expect(tree_create_all(tree, "/s/b/c/"), 0, "Create a path");
+    expect(tree_create(tree, "/s/a/"), 0, "Create a sibling");
+    TreeSnapshot* before = tree_snapshot(tree);
+    if (!before)
+        fatal("tree_snapshot");
+
+    expect(tree_create(tree, "/s/d/"), 0, "Create after the snapshot");
+    expect(tree_remove_recursive(tree, "/s/b/"), 0, "Remove a subtree after the snapshot");
+    expect(tree_move(tree, "/s/a/", "/t/"), 0, "Move after the snapshot");
+    expect(tree_create(tree, "/t/e/"), 0, "Create in the moved folder");
+    expect(tree_copy(tree, "/t/", "/s/b/"), 0, "Copy onto the removed path");
+    TreeSnapshot* after = tree_snapshot(tree);
+    if (!after)
+        fatal("tree_snapshot");
+    expect(tree_remove_recursive(tree, "/s/"), 0, "Remove everything after the second snapshot");
+
+    expect_listing(tree_snapshot_list(before, "/"), "s", "Root in the first snapshot");
+    expect_listing(tree_snapshot_list(before, "/s/"), "a,b", "Folder in the first snapshot");
+    expect_listing(tree_snapshot_list(before, "/s/b/"), "c", "Removed folder in the first snapshot");
+    expect_listing(tree_snapshot_list(before, "/s/a/"), "", "Moved folder in the first snapshot");
+    expect_listing(tree_snapshot_list(before, "/t/"), NULL, "Target of a move in the first snapshot");
+    char names[64] = "";
+    expect(tree_snapshot_iterate(before, "/s/", appending, names), 0, "Iterating the first snapshot");
+    if (strcmp(names, "a,b,") != 0)
+        fatal("Iterating the first snapshot: %s", names);
+    expect(tree_snapshot_iterate(before, "/s/d/", appending, names), ENOENT, "Iterating a later folder");
+
+    expect_listing(tree_snapshot_list(after, "/"), "s,t", "Root in the second snapshot");
+    expect_listing(tree_snapshot_list(after, "/s/"), "b,d", "Folder in the second snapshot");
+    expect_listing(tree_snapshot_list(after, "/s/b/"), "e", "Copy in the second snapshot");
+    expect_listing(tree_list(tree, "/"), "t", "Root in the tree");
+    tree_snapshot_free(before);
+    tree_snapshot_free(after);
+    expect(tree_remove_recursive(tree, "/t/"), 0, "Remove the moved folder");
+}
+
+int main(void)
+{
+    Tree* tree = tree_new();
+    if (!tree)
+        fatal("tree_new");
+    handle_after_moves(tree);
+    watching(tree);
+    creating_all(tree);
+    removed_recursively(tree);
+    snapshots(tree);
+    expect_listing(tree_list(tree, "/"), "", "Listing of the root at the end");
+    tree_free(tree);
+    printf("ok: tree API\n");
+    return 0;
+}